@@ -0,0 +1,205 @@
+#include "block_cache.hh"
+
+// C++
+#include <algorithm>
+#include <new>
+
+// C
+#include <stdio.h>
+#include <string.h>
+
+
+// Supported block sizes: a sector up to a typical SD card cluster
+static const uint32_t kMinBlockSize = 512;
+static const uint32_t kMaxBlockSize = 4096;
+
+BlockCache::Stats& BlockCache::Stats::operator+=(const Stats &other)
+{
+    reads += other.reads;
+    direct_reads += other.direct_reads;
+    block_hits += other.block_hits;
+    block_misses += other.block_misses;
+    read_ahead_blocks += other.read_ahead_blocks;
+    read_ahead_used += other.read_ahead_used;
+    bytes_requested += other.bytes_requested;
+    bytes_read += other.bytes_read;
+
+    return *this;
+}
+
+BlockCache::BlockCache(const Settings &settings, ReadFunc read_func, void* source, uint32_t file_size)
+    : m_block_size(kMinBlockSize),
+      m_num_blocks(settings.num_blocks),
+      m_read_ahead(settings.read_ahead),
+      m_read_func(read_func),
+      m_source(source),
+      m_file_size(file_size),
+      m_slots(nullptr),
+      m_data(nullptr),
+      m_clock(0),
+      m_last_loaded(kNoBlock)
+{
+    // Use the largest supported power of two that isn't bigger than requested
+    while (m_block_size * 2 <= std::min(settings.block_size, kMaxBlockSize)) {
+        m_block_size *= 2;
+    }
+
+    if (m_num_blocks != 0) {
+        m_slots = new (std::nothrow) Slot[m_num_blocks];
+        m_data = new (std::nothrow) uint8_t[m_block_size * m_num_blocks];
+
+        if (m_slots == nullptr || m_data == nullptr) {
+            // Not enough memory: read directly instead
+            delete[] m_slots;
+            delete[] m_data;
+            m_slots = nullptr;
+            m_data = nullptr;
+            m_num_blocks = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < m_num_blocks; i++) {
+        m_slots[i].block = kNoBlock;
+        m_slots[i].length = 0;
+        m_slots[i].last_used = 0;
+        m_slots[i].read_ahead = false;
+    }
+}
+
+BlockCache::~BlockCache()
+{
+    delete[] m_slots;
+    delete[] m_data;
+}
+
+size_t BlockCache::read(uint32_t offset, uint8_t* buffer, size_t count)
+{
+    m_stats.reads++;
+    m_stats.bytes_requested += count;
+
+    if (m_num_blocks == 0 || count >= m_block_size) {
+        m_stats.direct_reads++;
+
+        const size_t bytes_read = m_read_func(m_source, offset, buffer, count);
+        m_stats.bytes_read += bytes_read;
+
+        return bytes_read;
+    }
+
+    size_t done = 0;
+
+    while (done < count) {
+        const uint32_t position = offset + done;
+        const uint32_t block = position / m_block_size;
+        const uint32_t start = position % m_block_size;
+
+        Slot* slot = find(block);
+
+        if (slot != nullptr) {
+            m_stats.block_hits++;
+
+            if (slot->read_ahead) {
+                m_stats.read_ahead_used++;
+                slot->read_ahead = false;
+            }
+
+        } else {
+            m_stats.block_misses++;
+
+            const bool sequential = m_read_ahead && m_num_blocks > 1 &&
+                                    m_last_loaded != kNoBlock && block == m_last_loaded + 1;
+
+            slot = load(block);
+            if (slot == nullptr) {
+                break;
+            }
+
+            if (sequential && find(block + 1) == nullptr) {
+                // Loading takes the least recently used slot, which is never the one just read
+                Slot* next = load(block + 1);
+
+                if (next != nullptr) {
+                    next->read_ahead = true;
+                    m_stats.read_ahead_blocks++;
+                }
+            }
+        }
+
+        slot->last_used = ++m_clock;
+
+        if (start >= slot->length) {
+            // End of file
+            break;
+        }
+
+        const size_t length = std::min<size_t>(count - done, slot->length - start);
+        memcpy(buffer + done, data(slot) + start, length);
+
+        done += length;
+    }
+
+    return done;
+}
+
+BlockCache::Slot* BlockCache::find(uint32_t block)
+{
+    for (uint32_t i = 0; i < m_num_blocks; i++) {
+        if (m_slots[i].block == block) {
+            return &m_slots[i];
+        }
+    }
+
+    return nullptr;
+}
+
+BlockCache::Slot* BlockCache::load(uint32_t block)
+{
+    const uint32_t offset = block * m_block_size;
+    if (offset >= m_file_size) {
+        return nullptr;
+    }
+
+    Slot* slot = &m_slots[0];
+    for (uint32_t i = 1; i < m_num_blocks; i++) {
+        if (m_slots[i].last_used < slot->last_used) {
+            slot = &m_slots[i];
+        }
+    }
+
+    const size_t length = std::min(m_block_size, m_file_size - offset);
+    const size_t bytes_read = m_read_func(m_source, offset, data(slot), length);
+
+    m_stats.bytes_read += bytes_read;
+    m_last_loaded = block;
+
+    if (bytes_read == 0) {
+        slot->block = kNoBlock;
+        slot->last_used = 0;
+        return nullptr;
+    }
+
+    slot->block = block;
+    slot->length = bytes_read;
+    slot->last_used = ++m_clock;
+    slot->read_ahead = false;
+
+    return slot;
+}
+
+void BlockCache::printStats(const Stats &stats)
+{
+    const uint32_t lookups = stats.block_hits + stats.block_misses;
+
+    printf("Read cache: %u reads (%u direct), %u block hits, %u misses (%u%% hit rate), %u read ahead (%u used)\n",
+        (unsigned) stats.reads,
+        (unsigned) stats.direct_reads,
+        (unsigned) stats.block_hits,
+        (unsigned) stats.block_misses,
+        (unsigned) (lookups != 0 ? ((uint64_t) stats.block_hits * 100) / lookups : 0),
+        (unsigned) stats.read_ahead_blocks,
+        (unsigned) stats.read_ahead_used);
+
+    printf("Read cache: %u KB requested, %u KB read from files\n",
+        (unsigned) (stats.bytes_requested / 1024),
+        (unsigned) (stats.bytes_read / 1024));
+}
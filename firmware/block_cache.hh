@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Small cache of aligned blocks read from one file
+ *
+ * FreeType reads fonts in many small pieces (table directories, loca entries, glyph
+ * headers), and most of them land in a block that was read shortly before. This sits
+ * between a FreeType stream and the filesystem, so those reads are served from memory
+ * instead of each one going to the storage device.
+ *
+ * Reads of a block or more bypass the cache, as they're typically whole tables that
+ * would only push out the blocks that are useful. Blocks are evicted least recently
+ * used first. With read-ahead enabled, a miss on the block after the last one read
+ * from the file also loads the next block, as the file is probably being read in order.
+ */
+class BlockCache
+{
+public:
+
+    struct Settings {
+        // Bytes per block: a power of two from 512 to 4096
+        uint32_t block_size;
+
+        // Blocks kept per file (zero disables caching)
+        uint32_t num_blocks;
+
+        // Load the following block when reads look sequential
+        bool read_ahead;
+    };
+
+    struct Stats {
+        // Reads through the cache, and the number that were too large to cache
+        uint32_t reads = 0;
+        uint32_t direct_reads = 0;
+
+        // Blocks found in the cache, or that had to be read
+        uint32_t block_hits = 0;
+        uint32_t block_misses = 0;
+
+        // Blocks loaded by read-ahead, and how many of those were then used
+        uint32_t read_ahead_blocks = 0;
+        uint32_t read_ahead_used = 0;
+
+        // Bytes requested by the caller, and read from the file
+        uint64_t bytes_requested = 0;
+        uint64_t bytes_read = 0;
+
+        Stats& operator+=(const Stats &other);
+    };
+
+    /**
+     * Read count bytes at offset from the source file into buffer
+     * Returns the number of bytes read.
+     */
+    typedef size_t (*ReadFunc)(void* source, uint32_t offset, uint8_t* buffer, size_t count);
+
+    BlockCache(const Settings &settings, ReadFunc read_func, void* source, uint32_t file_size);
+    ~BlockCache();
+
+    /**
+     * Read from the file, using cached blocks where possible
+     * Returns the number of bytes read, which is short at the end of the file.
+     */
+    size_t read(uint32_t offset, uint8_t* buffer, size_t count);
+
+    inline const Stats& stats() const { return m_stats; }
+
+    /**
+     * Heap held for cached blocks
+     */
+    inline size_t memoryUsed() const { return m_num_blocks * (m_block_size + sizeof(Slot)); }
+
+    /**
+     * Print totals for a set of caches
+     */
+    static void printStats(const Stats &stats);
+
+private:
+
+    struct Slot {
+        // Block number held, or kNoBlock
+        uint32_t block;
+
+        // Valid bytes (short for the last block of the file)
+        uint32_t length;
+
+        // Value of m_clock when last used
+        uint32_t last_used;
+
+        // Loaded by read-ahead and not used yet
+        bool read_ahead;
+    };
+
+    static const uint32_t kNoBlock = UINT32_MAX;
+
+    /**
+     * Find the slot holding a block, or nullptr if it isn't cached
+     */
+    Slot* find(uint32_t block);
+
+    /**
+     * Read a block into the least recently used slot
+     * Returns nullptr if nothing could be read.
+     */
+    Slot* load(uint32_t block);
+
+    inline uint8_t* data(const Slot* slot) const
+    {
+        return m_data + ((slot - m_slots) * m_block_size);
+    }
+
+private:
+    uint32_t m_block_size;
+    uint32_t m_num_blocks;
+    const bool m_read_ahead;
+
+    ReadFunc m_read_func;
+    void* m_source;
+    const uint32_t m_file_size;
+
+    Slot* m_slots;
+    uint8_t* m_data;
+
+    // Incremented for each use, to order slots by how recently they were used
+    uint32_t m_clock;
+
+    // Last block read from the file, to detect sequential reads
+    uint32_t m_last_loaded;
+
+    Stats m_stats;
+};
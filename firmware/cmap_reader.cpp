@@ -0,0 +1,494 @@
+#include "cmap_reader.hh"
+#include "filesystem.hh"
+
+// C
+#include <stdio.h>
+
+
+// Table tags and sfnt versions
+static const uint32_t kTag_cmap = 0x636D6170; // 'cmap'
+static const uint32_t kTag_maxp = 0x6D617870; // 'maxp'
+static const uint32_t kTag_ttcf = 0x74746366; // 'ttcf'
+static const uint32_t kTag_OTTO = 0x4F54544F; // 'OTTO'
+static const uint32_t kTag_true = 0x74727565; // 'true'
+static const uint32_t kVersion_TrueType = 0x00010000;
+
+/**
+ * Buffered big-endian reads from a font file
+ *
+ * Reads past the end of the file (or any filesystem error) return zeros and
+ * set a sticky failure flag, so errors only need to be checked once a
+ * structure has been read.
+ */
+class FontReader {
+public:
+    FontReader(fs::File* file)
+        : m_file(file),
+          m_base(0),
+          m_pos(0),
+          m_length(0),
+          m_failed(false) {}
+
+    void seek(uint32_t offset)
+    {
+        if (offset >= m_base && offset < m_base + m_length) {
+            // Already buffered
+            m_pos = offset - m_base;
+            return;
+        }
+
+        m_base = offset;
+        m_pos = 0;
+        m_length = 0;
+
+        if (!fs::seek(m_file, offset)) {
+            m_failed = true;
+        }
+    }
+
+    void skip(uint32_t count)
+    {
+        seek(m_base + m_pos + count);
+    }
+
+    uint8_t u8()
+    {
+        if (m_pos == m_length) {
+            if (m_failed) {
+                return 0;
+            }
+
+            m_base += m_length;
+            m_pos = 0;
+            m_length = fs::read(m_file, m_buffer, sizeof(m_buffer));
+
+            if (m_length == 0) {
+                m_failed = true;
+                return 0;
+            }
+        }
+
+        return m_buffer[m_pos++];
+    }
+
+    uint16_t u16()
+    {
+        const uint16_t high = u8();
+        return (high << 8) | u8();
+    }
+
+    uint32_t u32()
+    {
+        const uint32_t high = u16();
+        return (high << 16) | u16();
+    }
+
+    inline bool failed()
+    {
+        return m_failed;
+    }
+
+private:
+    fs::File* m_file;
+
+    // File offset of the start of m_buffer
+    uint32_t m_base;
+
+    uint8_t m_buffer[256];
+    uint32_t m_pos;
+    uint32_t m_length;
+    bool m_failed;
+};
+
+/**
+ * Collects ascending codepoints into contiguous ranges
+ */
+class RangeBuilder {
+public:
+    RangeBuilder(std::vector<CodepointRange> &ranges, const uint16_t id)
+        : m_ranges(ranges),
+          m_id(id) {}
+
+    /**
+     * Add an inclusive run of codepoints
+     * Returns false if the run isn't after all previous runs
+     */
+    bool add(uint32_t first, uint32_t last)
+    {
+        if (m_ranges.empty()) {
+            m_ranges.emplace_back(first, last, m_id);
+            return true;
+        }
+
+        CodepointRange &previous = m_ranges.back();
+
+        if (first <= previous.end) {
+            return false;
+        }
+
+        if (first == previous.end + 1) {
+            previous.end = last;
+        } else {
+            m_ranges.emplace_back(first, last, m_id);
+        }
+
+        return true;
+    }
+
+private:
+    std::vector<CodepointRange> &m_ranges;
+    const uint16_t m_id;
+};
+
+/**
+ * Check if a cmap encoding record is treated as Unicode by FreeType
+ */
+static bool is_unicode(uint16_t platform_id, uint16_t encoding_id)
+{
+    switch (platform_id) {
+        case 0: // Unicode (any encoding)
+        case 2: // ISO (deprecated)
+            return true;
+
+        case 3: // Microsoft: Unicode BMP or full repertoire
+            return encoding_id == 1 || encoding_id == 10;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * Check if a cmap encoding record covers the full Unicode repertoire (UCS-4)
+ */
+static bool is_ucs4(uint16_t platform_id, uint16_t encoding_id)
+{
+    return (platform_id == 3 && encoding_id == 10) || (platform_id == 0 && encoding_id == 4);
+}
+
+/**
+ * Check if FreeType would create a charmap for a subtable format
+ */
+static bool is_supported_format(uint16_t format)
+{
+    switch (format) {
+        case 0: case 2: case 4: case 6: case 8: case 10: case 12: case 13: case 14:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * Read a segment mapping subtable (format 4)
+ * The subtable has at most `limit` bytes before the end of the cmap table.
+ */
+static bool read_format4(FontReader &reader, uint32_t offset, uint32_t limit, uint16_t num_glyphs, RangeBuilder &builder)
+{
+    reader.seek(offset + 6);
+    const uint16_t seg_count = reader.u16() / 2;
+
+    // The four arrays and their padding follow a 14 byte header, and must be within the table
+    if (limit < 16 || seg_count > (limit - 16) / 8) {
+        return false;
+    }
+
+    // endCode, reservedPad, startCode, idDelta and idRangeOffset arrays
+    std::vector<uint16_t> segments(seg_count * 4);
+
+    reader.seek(offset + 14);
+    for (uint32_t i = 0; i < seg_count; i++) {
+        segments[i * 4 + 1] = reader.u16();
+    }
+
+    reader.skip(2);
+    for (uint32_t i = 0; i < seg_count; i++) {
+        segments[i * 4] = reader.u16();
+    }
+
+    for (uint32_t i = 0; i < seg_count; i++) {
+        segments[i * 4 + 2] = reader.u16();
+    }
+
+    for (uint32_t i = 0; i < seg_count; i++) {
+        segments[i * 4 + 3] = reader.u16();
+    }
+
+    if (reader.failed()) {
+        return false;
+    }
+
+    const uint32_t range_offsets = offset + 16 + (seg_count * 6);
+
+    for (uint32_t i = 0; i < seg_count; i++) {
+        const uint32_t start = segments[i * 4];
+        const uint16_t delta = segments[i * 4 + 2];
+        const uint16_t range_offset = segments[i * 4 + 3];
+
+        // FreeType never maps 0xFFFF, which is only used for the end marker segment
+        const uint32_t end = std::min<uint32_t>(segments[i * 4 + 1], 0xFFFE);
+
+        if (start > segments[i * 4 + 1]) {
+            // Malformed segment
+            return false;
+        }
+
+        if (range_offset == 0xFFFF) {
+            // Broken segment that FreeType ignores
+            continue;
+        }
+
+        if (range_offset != 0) {
+            // Glyph ids are in glyphIdArray, relative to this segment's idRangeOffset entry
+            reader.seek(range_offsets + (i * 2) + range_offset);
+        }
+
+        uint32_t run_start = 0;
+        bool in_run = false;
+
+        for (uint32_t codepoint = start; codepoint <= end; codepoint++) {
+            uint16_t glyph;
+
+            if (range_offset == 0) {
+                glyph = codepoint + delta;
+            } else {
+                glyph = reader.u16();
+                glyph = glyph == 0 ? 0 : glyph + delta;
+            }
+
+            const bool present = glyph != 0 && glyph < num_glyphs;
+
+            if (present && !in_run) {
+                run_start = codepoint;
+                in_run = true;
+
+            } else if (!present && in_run) {
+                if (!builder.add(run_start, codepoint - 1)) {
+                    return false;
+                }
+
+                in_run = false;
+            }
+        }
+
+        if (in_run && !builder.add(run_start, end)) {
+            return false;
+        }
+    }
+
+    return !reader.failed();
+}
+
+/**
+ * Read a segmented or many-to-one coverage subtable (format 12 or 13)
+ * The subtable has at most `limit` bytes before the end of the cmap table.
+ */
+static bool read_format12_13(FontReader &reader, uint32_t offset, uint32_t limit, uint16_t format, uint16_t num_glyphs,
+                             RangeBuilder &builder)
+{
+    reader.seek(offset + 12);
+    const uint32_t num_groups = reader.u32();
+
+    // Each 12 byte group follows a 16 byte header, and must be within the table
+    if (limit < 16 || num_groups > (limit - 16) / 12) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_groups; i++) {
+        const uint32_t start = reader.u32();
+        const uint32_t end = reader.u32();
+        const uint32_t glyph = reader.u32();
+
+        if (reader.failed() || start > end) {
+            return false;
+        }
+
+        uint32_t first = start;
+        uint32_t last = end;
+
+        if (format == 13) {
+            // Every codepoint in the group maps to the same glyph
+            if (glyph == 0 || glyph >= num_glyphs) {
+                continue;
+            }
+
+        } else {
+            // Glyph ids increase from the start of the group
+            if (glyph >= num_glyphs) {
+                continue;
+            }
+
+            if (glyph == 0) {
+                first++;
+            }
+
+            last = std::min<uint64_t>(end, (uint64_t) start + (num_glyphs - 1 - glyph));
+        }
+
+        if (first <= last && !builder.add(first, last)) {
+            return false;
+        }
+    }
+
+    return !reader.failed();
+}
+
+static bool read_font(FontReader &reader, const uint16_t id, std::vector<CodepointRange> &ranges)
+{
+    uint32_t font_offset = 0;
+    uint32_t version = reader.u32();
+
+    if (version == kTag_ttcf) {
+        // Collection: FreeType opens the first font by default
+        reader.skip(8);
+        font_offset = reader.u32();
+
+        reader.seek(font_offset);
+        version = reader.u32();
+    }
+
+    if (version != kVersion_TrueType && version != kTag_OTTO && version != kTag_true) {
+        // Not an sfnt font
+        return false;
+    }
+
+    // Find the tables needed from the table directory
+    uint32_t cmap_offset = 0;
+    uint32_t cmap_length = 0;
+    uint32_t maxp_offset = 0;
+    {
+        const uint16_t num_tables = reader.u16();
+        reader.seek(font_offset + 12);
+
+        for (uint32_t i = 0; i < num_tables; i++) {
+            const uint32_t tag = reader.u32();
+            reader.skip(4);
+            const uint32_t offset = reader.u32();
+            const uint32_t length = reader.u32();
+
+            if (tag == kTag_cmap) {
+                cmap_offset = offset;
+                cmap_length = length;
+            } else if (tag == kTag_maxp) {
+                maxp_offset = offset;
+            }
+        }
+    }
+
+    if (reader.failed() || cmap_offset == 0 || maxp_offset == 0) {
+        return false;
+    }
+
+    reader.seek(maxp_offset + 4);
+    const uint16_t num_glyphs = reader.u16();
+
+    // Choose the subtable FreeType would select as the default charmap:
+    // the last full-repertoire Unicode subtable, otherwise the last Unicode subtable
+    uint32_t subtable_offset = 0;
+    uint32_t subtable_limit = 0;
+    uint16_t subtable_format = 0;
+    {
+        reader.seek(cmap_offset + 2);
+        const uint16_t num_subtables = reader.u16();
+
+        // The 8 byte encoding records follow a 4 byte header, and must be within the table
+        if (cmap_length < 4 || num_subtables > (cmap_length - 4) / 8) {
+            return false;
+        }
+
+        struct Record {
+            uint16_t platform_id;
+            uint16_t encoding_id;
+
+            // Offset from the start of the cmap table
+            uint32_t offset;
+        };
+
+        std::vector<Record> records(num_subtables);
+
+        for (Record &record : records) {
+            record.platform_id = reader.u16();
+            record.encoding_id = reader.u16();
+            record.offset = reader.u32();
+        }
+
+        std::vector<uint16_t> formats(num_subtables);
+
+        for (uint32_t i = 0; i < num_subtables; i++) {
+            if (records[i].offset > cmap_length - 2) {
+                // FreeType skips subtables that start outside the table
+                formats[i] = std::numeric_limits<uint16_t>::max();
+                continue;
+            }
+
+            reader.seek(cmap_offset + records[i].offset);
+            formats[i] = reader.u16();
+        }
+
+        if (reader.failed()) {
+            return false;
+        }
+
+        for (int pass = 0; pass < 2 && subtable_offset == 0; pass++) {
+            for (int i = num_subtables - 1; i >= 0; i--) {
+                const Record &record = records[i];
+
+                if (!is_supported_format(formats[i]) || !is_unicode(record.platform_id, record.encoding_id)) {
+                    continue;
+                }
+
+                if (pass == 0 && !is_ucs4(record.platform_id, record.encoding_id)) {
+                    continue;
+                }
+
+                subtable_offset = cmap_offset + record.offset;
+                subtable_limit = cmap_length - record.offset;
+                subtable_format = formats[i];
+                break;
+            }
+        }
+    }
+
+    if (subtable_offset == 0) {
+        // No Unicode charmap
+        return false;
+    }
+
+    RangeBuilder builder(ranges, id);
+
+    switch (subtable_format) {
+        case 4:
+            return read_format4(reader, subtable_offset, subtable_limit, num_glyphs, builder);
+
+        case 12:
+        case 13:
+            return read_format12_13(reader, subtable_offset, subtable_limit, subtable_format, num_glyphs, builder);
+
+        default:
+            return false;
+    }
+}
+
+namespace cmap_reader {
+
+bool read_ranges(const char* path, const uint16_t id, std::vector<CodepointRange> &ranges)
+{
+    fs::File* file = fs::open(path);
+    if (file == nullptr) {
+        return false;
+    }
+
+    FontReader reader(file);
+    const bool success = read_font(reader, id, ranges);
+
+    fs::close(file);
+
+    if (!success) {
+        ranges.clear();
+    }
+
+    return success;
+}
+
+}; // namespace cmap_reader
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "font_indexer.hh"
+
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * Minimal reader for the character map of TrueType/OpenType fonts
+ *
+ * Indexing a font through FreeType means opening a complete face, which loads
+ * and validates many tables that aren't needed, then walking the charmap one
+ * codepoint at a time. This instead locates the Unicode cmap subtable directly
+ * and decodes its segments into codepoint ranges with a handful of small reads.
+ *
+ * The subtable is chosen the same way FreeType picks its default charmap, and
+ * glyph ids are checked against the glyph count in the same way, so the ranges
+ * produced match FontIndexer::indexFace() for the same file.
+ *
+ * Only formats 4, 12 and 13 are decoded. Anything else, or any font data that
+ * looks inconsistent, is reported as a failure so the caller can use FreeType.
+ */
+namespace cmap_reader {
+
+/**
+ * Read the ranges of codepoints that the font at path has glyphs for
+ *
+ * Ranges are ordered and tagged with the passed id, ready for FontIndexer::indexRanges().
+ * Returns false if the font couldn't be parsed, in which case ranges is left empty.
+ */
+bool read_ranges(const char* path, const uint16_t id, std::vector<CodepointRange> &ranges);
+
+}; // namespace cmap_reader
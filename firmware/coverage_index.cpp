@@ -0,0 +1,342 @@
+#include "coverage_index.hh"
+#include "font_indexer.hh"
+#include "util.hh"
+
+// C++
+#include <algorithm>
+#include <functional>
+
+// C
+#include <stdio.h>
+#include <string.h>
+
+
+// Size of a page bitmap in bytes
+static const uint32_t kBitmapBytes = 256 / 8;
+
+/**
+ * Visit the coverage bitmap of each page that has any codepoints, in order
+ */
+static void for_each_page(const std::vector<CodepointRange> &ranges,
+                          const std::function<void(uint32_t page, const uint8_t* bitmap)> &callback)
+{
+    const uint32_t kMaxCodepoint = (CoverageIndex::kNumPlanes << 16) - 1;
+
+    uint8_t bitmap[kBitmapBytes];
+    uint32_t current_page = std::numeric_limits<uint32_t>::max();
+
+    for (const CodepointRange &range : ranges) {
+        if (range.start > kMaxCodepoint) {
+            break;
+        }
+
+        const uint32_t end = std::min(range.end, kMaxCodepoint);
+
+        for (uint32_t page = range.start >> 8; page <= (end >> 8); page++) {
+            if (page != current_page) {
+                if (current_page != std::numeric_limits<uint32_t>::max()) {
+                    callback(current_page, bitmap);
+                }
+
+                current_page = page;
+                memset(bitmap, 0, sizeof(bitmap));
+            }
+
+            // Set bits for the part of the range inside this page
+            const uint32_t first = std::max(range.start, page << 8) & 0xFF;
+            const uint32_t last = std::min(end, (page << 8) | 0xFF) & 0xFF;
+
+            for (uint32_t i = first; i <= last; i++) {
+                bitmap[i >> 3] |= 1 << (i & 7);
+            }
+        }
+    }
+
+    if (current_page != std::numeric_limits<uint32_t>::max()) {
+        callback(current_page, bitmap);
+    }
+}
+
+static inline bool test_bit(const uint8_t* bitmap, uint32_t index)
+{
+    return (bitmap[index >> 3] >> (index & 7)) & 1;
+}
+
+/**
+ * Count codepoints and contiguous runs of codepoints in a page bitmap
+ */
+static void measure_page(const uint8_t* bitmap, uint32_t &count, uint32_t &runs)
+{
+    count = 0;
+    runs = 0;
+
+    bool previous = false;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        const bool current = test_bit(bitmap, i);
+
+        count += current;
+        runs += current && !previous;
+
+        previous = current;
+    }
+}
+
+/**
+ * Size of the smallest container that can store a page
+ */
+static uint32_t page_cost(uint32_t count, uint32_t runs)
+{
+    if (count == 256) {
+        return 0;
+    }
+
+    return std::min({runs * 2, count, kBitmapBytes});
+}
+
+CoverageIndex::CoverageIndex()
+{
+    for (uint16_t &offset : m_planes) {
+        offset = kNoPageTable;
+    }
+}
+
+void CoverageIndex::build(const std::vector<CodepointRange> &ranges, uint32_t budget_bytes)
+{
+    m_pages.clear();
+    m_data.clear();
+
+    if (budget_bytes == 0 || ranges.empty()) {
+        // Index disabled
+        shrinkContainer(m_pages);
+        shrinkContainer(m_data);
+        return;
+    }
+
+    // Measure the cost of storing each page with coverage
+    std::vector<uint32_t> page_numbers;
+    std::vector<uint32_t> costs;
+    bool plane_used[kNumPlanes] = {};
+
+    for_each_page(ranges, [&](uint32_t page, const uint8_t* bitmap) {
+        uint32_t count, runs;
+        measure_page(bitmap, count, runs);
+
+        page_numbers.push_back(page);
+        costs.push_back(page_cost(count, runs));
+        plane_used[page >> 8] = true;
+    });
+
+    // Allocate page entries for each plane with coverage (initially all empty)
+    uint32_t num_tables = 0;
+    for (uint32_t plane = 0; plane < kNumPlanes; plane++) {
+        if (plane_used[plane]) {
+            m_planes[plane] = num_tables * kPagesPerPlane;
+            num_tables++;
+        } else {
+            m_planes[plane] = kNoPageTable;
+        }
+    }
+
+    m_pages.resize(num_tables * kPagesPerPlane, makeEntry(kPage_Empty, 1, 0));
+
+    // Choose which pages to store within the budget, preferring the cheapest
+    // This maximises the number of pages that can be answered exactly.
+    std::vector<bool> keep(page_numbers.size(), true);
+    {
+        const uint32_t fixed_bytes = memoryUsage();
+        uint32_t total = 0;
+
+        for (uint32_t cost : costs) {
+            total += cost;
+        }
+
+        if (fixed_bytes + total > budget_bytes) {
+            std::vector<uint32_t> order(costs.size());
+            for (uint32_t i = 0; i < order.size(); i++) {
+                order[i] = i;
+            }
+
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return costs[a] < costs[b];
+            });
+
+            uint32_t used = fixed_bytes;
+
+            for (uint32_t i : order) {
+                if (used + costs[i] > budget_bytes) {
+                    keep[i] = false;
+                } else {
+                    used += costs[i];
+                }
+            }
+        }
+    }
+
+    // Store the chosen container for each page
+    uint32_t index = 0;
+    uint32_t num_unknown = 0;
+
+    for_each_page(ranges, [&](uint32_t page, const uint8_t* bitmap) {
+        uint32_t &entry = m_pages[m_planes[page >> 8] + (page & 0xFF)];
+
+        if (!keep[index++]) {
+            entry = makeEntry(kPage_Unknown, 1, 0);
+            num_unknown++;
+            return;
+        }
+
+        uint32_t count, runs;
+        measure_page(bitmap, count, runs);
+
+        const uint32_t offset = m_data.size();
+        const uint32_t cost = page_cost(count, runs);
+
+        if (count == 256) {
+            entry = makeEntry(kPage_Full, 1, 0);
+
+        } else if (cost == runs * 2) {
+            // Store the first and last low byte of each run
+            for (uint32_t i = 0; i < 256; i++) {
+                if (test_bit(bitmap, i) && (i == 0 || !test_bit(bitmap, i - 1))) {
+                    m_data.push_back(i);
+                }
+
+                if (test_bit(bitmap, i) && (i == 255 || !test_bit(bitmap, i + 1))) {
+                    m_data.push_back(i);
+                }
+            }
+
+            entry = makeEntry(kPage_Runs, runs, offset);
+
+        } else if (cost == count) {
+            // Store the low byte of each codepoint
+            for (uint32_t i = 0; i < 256; i++) {
+                if (test_bit(bitmap, i)) {
+                    m_data.push_back(i);
+                }
+            }
+
+            entry = makeEntry(kPage_Array, count, offset);
+
+        } else {
+            m_data.insert(m_data.end(), bitmap, bitmap + kBitmapBytes);
+            entry = makeEntry(kPage_Bitmap, 1, offset);
+        }
+    });
+
+    shrinkContainer(m_data);
+
+    printf("Coverage index: %u of %u pages exact, using %u bytes\n",
+        (unsigned) (page_numbers.size() - num_unknown),
+        (unsigned) page_numbers.size(),
+        memoryUsage());
+}
+
+CoverageIndex::Result CoverageIndex::test(uint32_t codepoint) const
+{
+    if (m_pages.empty()) {
+        // No index built
+        return kUnknown;
+    }
+
+    const uint32_t plane = codepoint >> 16;
+    if (plane >= kNumPlanes || m_planes[plane] == kNoPageTable) {
+        return kAbsent;
+    }
+
+    const uint32_t entry = m_pages[m_planes[plane] + ((codepoint >> 8) & 0xFF)];
+    const uint32_t count = ((entry >> 20) & 0xFF) + 1;
+    const uint8_t* data = m_data.data() + (entry & 0xFFFFF);
+    const uint8_t low = codepoint & 0xFF;
+
+    switch (entry >> 28) {
+        case kPage_Empty:
+            return kAbsent;
+
+        case kPage_Full:
+            return kPresent;
+
+        case kPage_Runs:
+            for (uint32_t i = 0; i < count; i++) {
+                if (low < data[i * 2]) {
+                    // Runs are ordered, so no later run can contain the codepoint
+                    break;
+                }
+
+                if (low <= data[i * 2 + 1]) {
+                    return kPresent;
+                }
+            }
+
+            return kAbsent;
+
+        case kPage_Array:
+            for (uint32_t i = 0; i < count; i++) {
+                if (data[i] == low) {
+                    return kPresent;
+                }
+            }
+
+            return kAbsent;
+
+        case kPage_Bitmap:
+            return test_bit(data, low) ? kPresent : kAbsent;
+
+        default:
+            return kUnknown;
+    }
+}
+
+uint32_t CoverageIndex::memoryUsage() const
+{
+    return sizeof(m_planes) + (m_pages.size() * sizeof(uint32_t)) + m_data.size();
+}
+
+bool CoverageIndex::restore(const uint16_t planes[kNumPlanes], std::vector<uint32_t> &pages, std::vector<uint8_t> &data)
+{
+    // test() reads these without any checks, so they must all be in bounds
+    for (uint32_t plane = 0; plane < kNumPlanes; plane++) {
+        if (planes[plane] != kNoPageTable && planes[plane] + kPagesPerPlane > pages.size()) {
+            return false;
+        }
+    }
+
+    for (const uint32_t entry : pages) {
+        const uint32_t count = ((entry >> 20) & 0xFF) + 1;
+        uint32_t size;
+
+        switch (entry >> 28) {
+            case kPage_Empty:
+            case kPage_Full:
+            case kPage_Unknown:
+                size = 0;
+                break;
+
+            case kPage_Runs:
+                size = count * 2;
+                break;
+
+            case kPage_Array:
+                size = count;
+                break;
+
+            case kPage_Bitmap:
+                size = kBitmapBytes;
+                break;
+
+            default:
+                return false;
+        }
+
+        if (size != 0 && (entry & 0xFFFFF) + size > data.size()) {
+            return false;
+        }
+    }
+
+    memcpy(m_planes, planes, sizeof(m_planes));
+    m_pages = std::move(pages);
+    m_data = std::move(data);
+
+    return true;
+}
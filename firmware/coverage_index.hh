@@ -0,0 +1,107 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include <stdint.h>
+
+struct CodepointRange;
+
+/**
+ * Exact set of codepoints that any indexed font has a glyph for
+ *
+ * FontIndexer::compressRanges() trades accuracy for memory by merging gaps into
+ * neighbouring ranges, so the range table can't say if a codepoint really exists.
+ * This keeps a compact record of the real coverage so that missing codepoints can
+ * be rejected without loading a font from the SD card.
+ *
+ * Codepoints are split into pages of 256, with each page stored as whichever of
+ * these is smallest:
+ *
+ *  - Empty or full: no storage
+ *  - Runs: 2 bytes per contiguous run of codepoints (first and last low byte)
+ *  - Array: 1 byte per codepoint (low byte)
+ *  - Bitmap: 32 bytes
+ *
+ * A memory budget limits the size of the stored containers. When the budget is
+ * exceeded, the most expensive pages are left out and reported as unknown, so
+ * the caller must fall back to checking the font itself.
+ */
+class CoverageIndex
+{
+public:
+    enum Result {
+        kAbsent,
+        kPresent,
+
+        // Page wasn't stored due to the memory budget (or no index was built)
+        kUnknown,
+    };
+
+    CoverageIndex();
+
+    /**
+     * Build from ordered, non-overlapping ranges (ie. before compression)
+     * A budget of zero disables the index, making every test return kUnknown.
+     */
+    void build(const std::vector<CodepointRange> &ranges, uint32_t budget_bytes);
+
+    /**
+     * Check if a codepoint is covered by any font
+     */
+    Result test(uint32_t codepoint) const;
+
+    /**
+     * Total memory used by the index in bytes
+     */
+    uint32_t memoryUsage() const;
+
+    inline bool isEmpty() const
+    {
+        return m_pages.empty();
+    }
+
+    // Raw tables for saving and restoring the index
+    static const uint32_t kNumPlanes = 17;
+
+    inline const uint16_t* planes() const { return m_planes; }
+    inline const std::vector<uint32_t>& pages() const { return m_pages; }
+    inline const std::vector<uint8_t>& data() const { return m_data; }
+
+    /**
+     * Replace the index with tables previously read from planes(), pages() and data()
+     * The passed vectors are consumed by this call, unless a plane or page entry points
+     * outside the tables. That returns false and leaves the index unchanged.
+     */
+    bool restore(const uint16_t planes[kNumPlanes], std::vector<uint32_t> &pages, std::vector<uint8_t> &data);
+
+private:
+
+    enum PageType {
+        kPage_Empty = 0,
+        kPage_Full,
+        kPage_Runs,
+        kPage_Array,
+        kPage_Bitmap,
+        kPage_Unknown,
+    };
+
+    // Page entries pack the container type, item count and data offset into 32 bits:
+    // [31..28] type, [27..20] item count - 1, [19..0] offset into m_data
+    static inline uint32_t makeEntry(PageType type, uint32_t count, uint32_t offset)
+    {
+        return (type << 28) | (((count - 1) & 0xFF) << 20) | (offset & 0xFFFFF);
+    }
+
+    static const uint32_t kPagesPerPlane = 256;
+    static const uint16_t kNoPageTable = std::numeric_limits<uint16_t>::max();
+
+    // Offset into m_pages of each plane's page entries, or kNoPageTable
+    uint16_t m_planes[kNumPlanes];
+
+    // Entries for each page in planes that have any coverage
+    std::vector<uint32_t> m_pages;
+
+    // Container storage referenced by page entries
+    std::vector<uint8_t> m_data;
+};
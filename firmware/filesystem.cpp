@@ -1,4 +1,6 @@
 #include "filesystem.hh"
+#include "block_cache.hh"
+#include "io_trace.hh"
 
 // FatFS
 #include "f_util.h"
@@ -9,58 +11,208 @@
 #include "string.h"
 
 
+// Initial size of a cluster link map in DWORDs
+// This fits a file in up to 7 fragments, which covers most files on a card that
+// hasn't been heavily rewritten. More fragmented files get a table sized to fit.
+static const UINT kLinkMapSize = 16;
+
+// Block cache settings for fonts opened after fs::set_read_cache()
+static BlockCache::Settings s_cache_settings = {1024, 4, false};
+
+// Read cache totals from closed fonts
+static BlockCache::Stats s_cache_stats;
+
+// Seek totals from closed fonts (see FontFile)
+static uint32_t s_seeks = 0;
+static uint32_t s_links_followed = 0;
+static uint32_t s_links_without_map = 0;
+
+// Heap held for fonts that are open
+static size_t s_open_font_bytes = 0;
+
+/**
+ * Font file opened for FreeType
+ */
+struct FontFile {
+    FIL fil;
+
+    // Cluster link map for seeking without walking the FAT, or nullptr if unavailable
+    DWORD* link_map;
+
+    // Recently read blocks, which most of FreeType's small reads land in
+    BlockCache* cache;
+
+    // Font id in the I/O trace, if tracing
+    uint16_t trace_id;
+
+    // Heap held for this file, its stream and cache
+    size_t heap_bytes;
+
+    // Seeks made, and the FAT entries they followed or would have without a link map
+    uint32_t seeks;
+    uint32_t links_followed;
+    uint32_t links_without_map;
+};
+
+/**
+ * Build a cluster link map for fast seeking in a file opened for reading
+ * Returns nullptr if the map couldn't be built, in which case seeks walk the FAT as normal.
+ * Otherwise size is set to the number of entries allocated.
+ */
+static DWORD* create_link_map(FIL* fp, UINT &size)
+{
+    size = kLinkMapSize;
+
+    // FatFs reports the size needed if the table is too small
+    for (int attempt = 0; attempt < 2; attempt++) {
+        DWORD* map = new DWORD[size];
+        map[0] = size;
+
+        fp->cltbl = map;
+        const FRESULT fr = f_lseek(fp, CREATE_LINKMAP);
+
+        if (fr == FR_OK) {
+            return map;
+        }
+
+        fp->cltbl = nullptr;
+        size = map[0];
+        delete[] map;
+
+        if (fr != FR_NOT_ENOUGH_CORE) {
+            printf("Failed to create cluster link map: %s (%d)\n", FRESULT_str(fr), fr);
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Count the FAT entries f_lseek follows to move between offsets without a link map
+ * A forward seek continues from the current cluster, but any other seek starts over
+ * from the beginning of the cluster chain.
+ */
+static uint32_t count_chain_links(FIL* fp, FSIZE_t from, FSIZE_t to)
+{
+    const FSIZE_t cluster_bytes = (FSIZE_t) fp->obj.fs->csize * FF_MAX_SS;
+
+    if (to == 0) {
+        return 0;
+    }
+
+    if (from > 0 && to > from) {
+        return ((to - 1) / cluster_bytes) - ((from - 1) / cluster_bytes);
+    }
+
+    return (to - 1) / cluster_bytes;
+}
+
+/**
+ * Read from a font file at an absolute offset
+ * This is what the block cache reads through to.
+ */
+static size_t read_font_file(void* source, uint32_t offset, uint8_t* buffer, size_t count)
+{
+    FontFile* file = (FontFile*) source;
+    FIL* fp = &file->fil;
+
+    if (f_tell(fp) != offset) {
+        const uint32_t links = count_chain_links(fp, f_tell(fp), offset);
+
+        file->seeks++;
+        file->links_without_map += links;
+
+        if (file->link_map == nullptr) {
+            file->links_followed += links;
+        }
+
+        FRESULT fr = f_lseek(fp, offset);
+        if (fr != FR_OK) {
+            printf("f_lseek to %u failed: %s (%d)\n", (unsigned) offset, FRESULT_str(fr), fr);
+            return 0;
+        }
+    }
+
+    UINT bytes_read = 0;
+
+    FRESULT fr = f_read(fp, buffer, count, &bytes_read);
+    if (fr != FR_OK) {
+        printf("f_read of %u bytes at %u failed: %s (%d)\n", (unsigned) count, (unsigned) offset, FRESULT_str(fr), fr);
+    }
+
+    return bytes_read;
+}
+
 // FreeType custom stream handlers
 static unsigned long _read_stream(FT_Stream stream,
                                   unsigned long offset,
                                   unsigned char* buffer,
                                   unsigned long count)
 {
-    FRESULT fr;
-    FIL* fp = (FIL*) stream->descriptor.pointer;
+    FontFile* file = (FontFile*) stream->descriptor.pointer;
+
+    io_trace::read(file->trace_id, offset, count);
 
     // FreeType normally does a seek (count=0) followed by a separate read at the same
     // offset, however a few functions use FT_STREAM_READ_AT which expects a combined seek
-    // and read, so we need to handle seek in both cases.
-    if (f_tell(fp) != offset) {
-        fr = f_lseek(fp, offset);
-        if (fr != FR_OK) {
-            printf("f_lseek to %lu failed on slot %d: %s (%d)\n",
-                offset, stream->descriptor.value, FRESULT_str(fr), fr);
-        }
-    }
-
+    // and read. Reads always pass their offset through to the file, so a seek only needs
+    // to check the offset is valid.
     if (count == 0) {
         // Seek only. Return value is treated as an error code (non-zero is failure)
-        return fr;
-    }
-
-    size_t bytes_read = 0;
-
-    fr = f_read(fp, buffer, count, &bytes_read);
-    if (fr != FR_OK) {
-        printf("f_read of %lu bytes at %lu failed on slot %d: %s (%d)\n",
-            count, offset, stream->descriptor.value, FRESULT_str(fr), fr);
+        return offset > stream->size;
     }
 
-    return bytes_read;
+    return file->cache->read(offset, buffer, count);
 }
 
 static void _close_stream(FT_Stream stream)
 {
-    FIL* fp = (FIL*) stream->descriptor.pointer;
+    FontFile* file = (FontFile*) stream->descriptor.pointer;
 
-    FRESULT fr = f_close(fp);
+    // Fonts are closed often while browsing, so their stats are only reported in total
+    s_cache_stats += file->cache->stats();
+    s_seeks += file->seeks;
+    s_links_followed += file->links_followed;
+    s_links_without_map += file->links_without_map;
+
+    s_open_font_bytes -= file->heap_bytes;
+
+    io_trace::close(file->trace_id);
+
+    FRESULT fr = f_close(&file->fil);
     if (fr != FR_OK) {
         printf("f_close error on slot %d: %s (%d)\n", stream->descriptor.value, FRESULT_str(fr), fr);
     }
 
-    delete fp;
+    delete file->cache;
+    delete[] file->link_map;
+    delete file;
     delete stream;
 }
 
 
 namespace fs {
 
+struct File {
+    FIL fil;
+};
+
+void set_read_cache(const BlockCache::Settings &settings)
+{
+    s_cache_settings = settings;
+}
+
+void print_stats()
+{
+    BlockCache::printStats(s_cache_stats);
+
+    printf("Font seeks: %u seeks followed %u FAT entries (%u without the cluster link map)\n",
+        (unsigned) s_seeks,
+        (unsigned) s_links_followed,
+        (unsigned) s_links_without_map);
+}
+
 int mount()
 {
     sd_card_t* sdcard = sd_get_by_num(0);
@@ -88,7 +240,7 @@ bool is_dir(const char* path)
     return f_opendir(&dir, path) == FR_OK;
 }
 
-void walkdir(const char* dirpath, const std::function<void(const char* abspath, uint8_t progress)> &callback)
+void walkdir(const char* dirpath, const std::function<void(const char* abspath, const FileInfo &info, uint8_t progress)> &callback)
 {
     uint32_t total = 0;
     uint32_t current = 0;
@@ -125,34 +277,146 @@ void walkdir(const char* dirpath, const std::function<void(const char* abspath,
         char fontpath[256];
         sprintf((char*) &fontpath, "%s/%s", dirpath, info.fname);
 
+        // FAT timestamps are packed date and time fields, which compare fine as one number
+        FileInfo fileinfo;
+        fileinfo.size = info.fsize;
+        fileinfo.mtime = (info.fdate << 16) | info.ftime;
+
         // Process the file
-        callback((char*) &fontpath, fp_progress(++current, total));
+        callback((char*) &fontpath, fileinfo, fp_progress(++current, total));
     }
 
     f_closedir(&dir);
 }
 
+File* open(const char* path, bool write)
+{
+    File* file = new File;
+
+    const BYTE mode = write ? (FA_WRITE | FA_CREATE_ALWAYS) : FA_READ;
+
+    FRESULT fr = f_open(&file->fil, path, mode);
+    if (fr != FR_OK) {
+        printf("f_open error on %s: %s (%d)\n", path, FRESULT_str(fr), fr);
+        delete file;
+        return nullptr;
+    }
+
+    return file;
+}
+
+size_t read(File* file, void* buffer, size_t count)
+{
+    UINT bytes_read = 0;
+
+    FRESULT fr = f_read(&file->fil, buffer, count, &bytes_read);
+    if (fr != FR_OK) {
+        printf("f_read of %u bytes failed: %s (%d)\n", count, FRESULT_str(fr), fr);
+    }
+
+    return bytes_read;
+}
+
+size_t write(File* file, const void* buffer, size_t count)
+{
+    UINT bytes_written = 0;
+
+    FRESULT fr = f_write(&file->fil, buffer, count, &bytes_written);
+    if (fr != FR_OK) {
+        printf("f_write of %u bytes failed: %s (%d)\n", count, FRESULT_str(fr), fr);
+    }
+
+    return bytes_written;
+}
+
+bool seek(File* file, uint32_t offset)
+{
+    FRESULT fr = f_lseek(&file->fil, offset);
+    if (fr != FR_OK) {
+        printf("f_lseek to %lu failed: %s (%d)\n", offset, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    return true;
+}
+
+bool close(File* file)
+{
+    FRESULT fr = f_close(&file->fil);
+    if (fr != FR_OK) {
+        printf("f_close error: %s (%d)\n", FRESULT_str(fr), fr);
+    }
+
+    delete file;
+
+    return fr == FR_OK;
+}
+
+bool rename(const char* from, const char* to)
+{
+    // FatFs won't rename over an existing file
+    FRESULT fr = f_unlink(to);
+    if (fr != FR_OK && fr != FR_NO_FILE) {
+        printf("f_unlink error on %s: %s (%d)\n", to, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    fr = f_rename(from, to);
+    if (fr != FR_OK) {
+        printf("f_rename error on %s: %s (%d)\n", from, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    return true;
+}
+
+bool remove(const char* path)
+{
+    FRESULT fr = f_unlink(path);
+    if (fr != FR_OK) {
+        printf("f_unlink error on %s: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    return true;
+}
+
 FT_Error load_face(const char* path, FT_Library library, FT_Face* face)
 {
     printf("== Loading font %s ==\n", path);
 
-	FIL* fp = new FIL;
+	FontFile* file = new FontFile();
     FT_Stream stream = new FT_StreamRec;
 
-    FRESULT fr = f_open(fp, path, FA_READ);
+    FRESULT fr = f_open(&file->fil, path, FA_READ);
     if (fr != FR_OK) {
         printf("f_read error: %s (%d)\n", FRESULT_str(fr), fr);
 
-        delete fp;
+        delete file;
         delete stream;
 
         return FT_Err_Cannot_Open_Resource;
     }
 
+    // Map the cluster chain once, so seeks anywhere in the font don't have to walk the FAT
+    // This stays with the stream, which lives as long as the face.
+    UINT link_map_size;
+    file->link_map = create_link_map(&file->fil, link_map_size);
+    file->cache = new BlockCache(s_cache_settings, &read_font_file, file, f_size(&file->fil));
+    file->trace_id = io_trace::open(path, f_size(&file->fil));
+
+    file->heap_bytes = sizeof(FontFile) + sizeof(FT_StreamRec) + sizeof(BlockCache) + file->cache->memoryUsed();
+
+    if (file->link_map != nullptr) {
+        file->heap_bytes += link_map_size * sizeof(DWORD);
+    }
+
+    s_open_font_bytes += file->heap_bytes;
+
     stream->base = NULL;
-    stream->size = f_size(fp);
+    stream->size = f_size(&file->fil);
     stream->pos = 0;
-    stream->descriptor.pointer = fp;
+    stream->descriptor.pointer = file;
     stream->pathname.pointer = (char*) path;
     stream->read = &_read_stream;
     stream->close = &_close_stream;
@@ -173,4 +437,9 @@ FT_Error load_face(const char* path, FT_Library library, FT_Face* face)
     return FT_Open_Face(library, &args, 0, face);
 }
 
+size_t open_font_bytes()
+{
+    return s_open_font_bytes;
+}
+
 }; // namespace fs
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "block_cache.hh"
+
 #include "ft2build.h"
 #include FT_FREETYPE_H
 
@@ -11,12 +13,37 @@
 
 namespace fs {
 
+/**
+ * Size and modification time of a file on disk
+ * Used to detect when files have changed since they were last seen.
+ */
+struct FileInfo {
+    uint32_t size;
+    uint32_t mtime;
+};
+
+/**
+ * Handle to an open file (the underlying type is platform specific)
+ */
+struct File;
+
 /**
  * Prepare the filesystem for access
  * Returns non-zero if the operation failed
  */
 int mount();
 
+/**
+ * Set the block cache used for reads of fonts opened after this
+ */
+void set_read_cache(const BlockCache::Settings &settings);
+
+/**
+ * Print read cache statistics for fonts closed so far
+ * On the device, this includes the seeks made and the FAT entries they followed.
+ */
+void print_stats();
+
 /**
  * Load the font at the given path
  *
@@ -25,6 +52,12 @@ int mount();
  */
 FT_Error load_face(const char* path, FT_Library library, FT_Face* face);
 
+/**
+ * Heap held for reading fonts opened with load_face (file handles and read caches)
+ * This isn't allocated through FreeType, so it's reported here to be budgeted for.
+ */
+size_t open_font_bytes();
+
 /**
  * Check if a path is a directory on disk
  */
@@ -34,7 +67,51 @@ bool is_dir(const char* path);
  * Visit each file in the passed directory
  */
 void walkdir(const char* dirpath,
-             const std::function<void(const char* abspath, uint8_t progress)> &callback);
+             const std::function<void(const char* abspath, const FileInfo &info, uint8_t progress)> &callback);
+
+/**
+ * Open a file for reading, or for writing if write is true
+ *
+ * Opening for writing creates the file or truncates any existing contents.
+ * Returns nullptr if the file could not be opened.
+ */
+File* open(const char* path, bool write = false);
+
+/**
+ * Read up to count bytes from the current position in a file
+ * Returns the number of bytes actually read
+ */
+size_t read(File* file, void* buffer, size_t count);
+
+/**
+ * Write count bytes at the current position in a file
+ * Returns the number of bytes actually written
+ */
+size_t write(File* file, const void* buffer, size_t count);
+
+/**
+ * Move the read/write position of a file to an absolute offset
+ * Returns false if the seek failed
+ */
+bool seek(File* file, uint32_t offset);
+
+/**
+ * Close a file opened with fs::open, flushing any pending writes
+ * Returns false if pending writes couldn't be flushed.
+ */
+bool close(File* file);
+
+/**
+ * Rename a file, replacing any existing file at the new path
+ * Returns false if the rename failed.
+ */
+bool rename(const char* from, const char* to);
+
+/**
+ * Delete a file
+ * Returns false if the file couldn't be deleted.
+ */
+bool remove(const char* path);
 
 /**
  * Calculate percentage (value/max) as a full 8-bit range, where 0x0=0% and 0xFF=100%
@@ -2,12 +2,25 @@
 #include "util.hh"
 
 #include <algorithm>
-#include <iterator>
+
+#include <stdio.h>
 
 // Flag for marking ranges for deletion
 static const uint32_t kDeleteThis = std::numeric_limits<uint32_t>::max();
 
-void FontIndexer::indexFace(const uint8_t id, FT_Face face)
+// Threshold for FontIndexer::mergeGaps() that merges every gap
+static const uint32_t kMaxGap = std::numeric_limits<uint32_t>::max();
+
+void FontIndexer::indexFace(const uint16_t id, FT_Face face)
+{
+    std::vector<CodepointRange> face_ranges;
+    faceRanges(id, face, face_ranges);
+
+    // Merge this font's ranges into the global range table
+    mergeRanges(face_ranges);
+}
+
+void FontIndexer::faceRanges(const uint16_t id, FT_Face face, std::vector<CodepointRange> &face_ranges)
 {
     FT_ULong  charcode;
     FT_UInt   gindex;
@@ -17,41 +30,87 @@ void FontIndexer::indexFace(const uint8_t id, FT_Face face)
     uint32_t start = kInvalid;
     uint32_t previous = kInvalid;
 
-    std::vector<CodepointRange> face_ranges;
-
     charcode = FT_Get_First_Char( face, &gindex );
     while ( gindex != 0 )
     {
-        charcode = FT_Get_Next_Char( face, charcode, &gindex );
-
         if (previous == kInvalid) {
             // First codepoint in font
             start = charcode;
+            previous = charcode;
 
         } else if (charcode < previous) {
-            // Probably the end of cmap marker
-            continue;
+            // Probably the end of cmap marker: ignore
 
-        } else if ((charcode - previous) > 1) {
-            face_ranges.emplace_back(start, previous, id);
-            start = charcode;
+        } else {
+            if ((charcode - previous) > 1) {
+                face_ranges.emplace_back(start, previous, id);
+                start = charcode;
+            }
+
+            previous = charcode;
         }
 
-        previous = charcode;
+        charcode = FT_Get_Next_Char( face, charcode, &gindex );
     }
 
     // Capture the last range
-    face_ranges.emplace_back(start, previous, id);
+    if (previous != kInvalid) {
+        face_ranges.emplace_back(start, previous, id);
+    }
+}
 
-    // Merge this font's ranges into the global range table
-    mergeRanges(face_ranges);
+void FontIndexer::indexRanges(std::vector<CodepointRange> &ranges)
+{
+    mergeRanges(ranges);
+}
+
+uint16_t FontIndexer::find(const uint32_t codepoint)
+{
+    CodepointRange range;
+
+    if (!findRange(codepoint, range)) {
+        return FontIndexer::kCodepointNotFound;
+    }
+
+    return range.id;
+}
+
+bool FontIndexer::findRange(const uint32_t codepoint, CodepointRange &range)
+{
+    if (m_packed.empty()) {
+        // Not compressed yet
+        const CodepointRange* found = findBySearch(codepoint);
+
+        if (found == nullptr) {
+            return false;
+        }
+
+        range = *found;
+        return true;
+    }
+
+    // Lookups tend to be for the same or neighbouring codepoints, which are usually
+    // in the last range found: check that before decoding anything
+    if (m_has_last_range && codepoint - m_last_range.start <= m_last_range.end - m_last_range.start) {
+        range = m_last_range;
+        return true;
+    }
+
+    if (!m_packed.find(codepoint, range)) {
+        return false;
+    }
+
+    m_last_range = range;
+    m_has_last_range = true;
+
+    return true;
 }
 
 /**
  * Perform a binary search to locate the range containing the passed codepoint
- * Returns the ID associated with that codepoint, if any
+ * Returns the range with that codepoint, if any
  */
-uint16_t FontIndexer::find(const uint32_t codepoint)
+const CodepointRange* FontIndexer::findBySearch(const uint32_t codepoint)
 {
     int32_t left = 0;
     int32_t right = m_ranges.size() - 1;
@@ -61,10 +120,10 @@ uint16_t FontIndexer::find(const uint32_t codepoint)
         uint32_t mid = left + (right - left)/2;
 
         // Test if codepoint is at the mid-point
-        const CodepointRange &range = m_ranges.at(mid);
+        const CodepointRange &range = m_ranges[mid];
 
         if (codepoint >= range.start && codepoint <= range.end) {
-            return range.id;
+            return &range;
         }
 
         if (left == right) {
@@ -82,7 +141,7 @@ uint16_t FontIndexer::find(const uint32_t codepoint)
     }
 
     // Failed to find a range with the codepoint
-    return FontIndexer::kCodepointNotFound;
+    return nullptr;
 }
 
 uint32_t FontIndexer::countCodepoints()
@@ -113,6 +172,19 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
         return;
     }
 
+    // Both lists are ordered, so they can be merged in a single pass: each range is
+    // written out as soon as nothing later can overlap it. The output buffer is kept
+    // between calls and swapped with m_ranges to avoid reallocating on every font.
+    std::vector<CodepointRange> &merged = m_merge_buffer;
+    merged.clear();
+    merged.reserve(m_ranges.size() + incoming_ranges.size());
+
+    auto emit = [&](const CodepointRange &range) {
+        if (range.start != kDeleteThis) {
+            merged.push_back(range);
+        }
+    };
+
     auto existing_iter = m_ranges.begin();
 
     // Adjust incoming ranges to fit into existing pool
@@ -126,6 +198,8 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
 
             if (start > existing.end) {
                 // Haven't reached any overlaps yet: keep searching existing ranges
+                // Later incoming ranges start even further on, so this one is final
+                emit(existing);
                 ++existing_iter;
                 continue;
             }
@@ -139,6 +213,7 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
             if (start >= existing.start && end <= existing.end) {
                 // Incoming range is contained by an existing range
                 // The existing range wins, so mark this incoming range as deleted
+                existing.fallback = addFallback(existing.fallback, incoming.id);
                 incoming.start = kDeleteThis;
 
                 // Move onto the next incoming range
@@ -147,8 +222,9 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
 
             if (existing.start >= start && existing.end <= end) {
                 // Existing range is a subset of the incoming range
-                // New range is larger so it wins: mark the existing range as deleted
-                existing.start = kDeleteThis;
+                // New range is larger so it wins: drop the existing range
+                incoming.fallback = addFallback(incoming.fallback, existing.id);
+                incoming.fallback = joinFallbacks(incoming.fallback, existing.fallback);
                 ++existing_iter;
 
                 // Keep checking if the incoming range overlaps with other existing ranges
@@ -159,6 +235,13 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
             const uint32_t incoming_size = (end - start) + 1;
             const uint32_t existing_size = (existing.end - existing.start) + 1;
 
+            // Whichever range keeps the overlap can fall back to the other for it
+            if (incoming_size > existing_size) {
+                incoming.fallback = addFallback(incoming.fallback, existing.id);
+            } else {
+                existing.fallback = addFallback(existing.fallback, incoming.id);
+            }
+
             if (start <= existing.start && end >= existing.start) {
                 // Incoming range overlaps and existing range from the left
                 // The larger range keeps the overlap
@@ -184,61 +267,256 @@ void FontIndexer::mergeRanges(std::vector<CodepointRange> &incoming_ranges)
             continue;
         }
 
-        // Early exit if there are no more existing ranges to compare against
-        if (existing_iter == m_ranges.end()) {
-            break;
-        }
+        // Anything left of this range comes before the current existing range
+        emit(incoming);
     }
 
-    // Move any incoming ranges into the global store
-    m_ranges.insert(
-        m_ranges.end(),
-        std::make_move_iterator(incoming_ranges.begin()),
-        std::make_move_iterator(incoming_ranges.end())
-    );
+    // Remaining existing ranges are after all incoming ranges
+    while (existing_iter != m_ranges.end()) {
+        emit(*existing_iter);
+        ++existing_iter;
+    }
 
-    orderRanges();
+    m_ranges.swap(merged);
 }
 
-void FontIndexer::compressRanges()
+void FontIndexer::compressRanges(const IndexSettings &settings)
 {
+    m_settings = settings;
+
     // Cache actual codepoint count before the information is destroyed
     m_cached_count = countCodepoints();
 
+    // Record exact coverage before gaps are merged away
+    m_coverage.build(m_ranges, settings.coverage_budget);
+
+    if (m_fallbacks_dropped != 0) {
+        printf("Font fallback table is full (%u lists): %u fallback fonts were not recorded\n",
+            (unsigned) m_fallbacks.size(), (unsigned) m_fallbacks_dropped);
+    }
+
+    // Find the gaps to merge: the smallest first, until the ranges fit the budget.
+    // Merging more gaps makes the packed ranges smaller, so the largest gap size that
+    // needs merging can be found with a binary search, then how many gaps of that size
+    // are needed. Every choice made is measured to fit. Empty gaps don't add any false
+    // positives, so are always merged.
+    const uint32_t budget = settings.range_budget;
+    const uint32_t range_count = m_ranges.size();
+    uint32_t threshold = 1;
+    uint32_t ties = 0;
+    uint32_t false_positives;
+
+    if (budget == 0) {
+        // Merge everything
+        threshold = kMaxGap;
+
+    } else if (mergeGaps(threshold, ties, false, false_positives) > budget) {
+        if (mergeGaps(kMaxGap, 0, false, false_positives) > budget) {
+            printf("Font index doesn't fit in %u bytes even with all gaps merged\n", (unsigned) budget);
+            threshold = kMaxGap;
+
+        } else {
+            // Smallest threshold that fits
+            uint32_t low = threshold + 1;
+            uint32_t high = kMaxGap;
+
+            while (low < high) {
+                const uint32_t mid = low + (high - low) / 2;
+
+                if (mergeGaps(mid, 0, false, false_positives) <= budget) {
+                    high = mid;
+                } else {
+                    low = mid + 1;
+                }
+            }
+
+            // Gaps one smaller than that are all merged: find how many of them are needed
+            threshold = low - 1;
+            low = 1;
+            high = range_count;
+
+            while (low < high) {
+                const uint32_t mid = low + (high - low) / 2;
+
+                if (mergeGaps(threshold, mid, false, false_positives) <= budget) {
+                    high = mid;
+                } else {
+                    low = mid + 1;
+                }
+            }
+
+            ties = low;
+        }
+    }
+
+    mergeGaps(threshold, ties, true, false_positives);
+
+    // Delete all ranges marked with kDeleteThis, keeping the remaining order
+    m_ranges.erase(
+        std::remove_if(m_ranges.begin(), m_ranges.end(), [](const CodepointRange &range) {
+            return range.start == kDeleteThis;
+        }),
+        m_ranges.end()
+    );
+
+    // No more merging happens once compressed: move to the packed store
+    m_packed.pack(m_ranges);
+    m_has_last_range = false;
+
+    m_ranges.clear();
+    shrinkContainer(m_ranges);
+
+    m_merge_buffer.clear();
+    shrinkContainer(m_merge_buffer);
+
+    // Swapped out as clearing a map keeps its buckets
+    std::unordered_map<FallbackSet, uint16_t, FallbackSet::Hash>().swap(m_fallback_lookup);
+
+    printf("Font index compressed from %u to %u ranges: %u unclaimed codepoints now map to a font\n",
+        (unsigned) range_count, (unsigned) m_packed.size(), (unsigned) false_positives);
+
+    printUsage();
+}
+
+uint32_t FontIndexer::mergeGaps(const uint32_t threshold, const uint32_t ties, const bool apply, uint32_t &false_positives)
+{
+    PackedRanges::Layout layout;
+
+    // Range being merged into, and how it looks with the merges so far
     CodepointRange* target = nullptr;
+    CodepointRange merged;
+
+    uint32_t ties_left = ties;
+    false_positives = 0;
 
     for (CodepointRange &range : m_ranges) {
-        if (target == nullptr || target->id != range.id) {
-            target = &range;
-            continue;
+        if (target != nullptr && target->id == range.id) {
+            // Number of codepoints between the ranges, which no font claims
+            const uint32_t gap = range.start - merged.end - 1;
+            bool merge = gap < threshold;
+
+            if (gap == threshold && ties_left != 0) {
+                ties_left--;
+                merge = true;
+            }
+
+            if (merge) {
+                false_positives += gap;
+                merged.end = range.end;
+
+                if (apply) {
+                    target->end = range.end;
+                    target->fallback = joinFallbacks(target->fallback, range.fallback);
+                    range.start = kDeleteThis;
+                } else if (merged.fallback == 0) {
+                    // Only whether there's a fallback list affects the size
+                    merged.fallback = range.fallback;
+                }
+
+                continue;
+            }
         }
 
-        // Absorb this into the current range if it's not too far away
-        // The distance here is somewhat arbitrary: a smaller numbers means more memory use
-        if (range.start - target->end <= 255) {
-            target->end = range.end;
-            range.start = kDeleteThis;
+        if (target != nullptr) {
+            layout.add(merged, nullptr);
         }
+
+        target = &range;
+        merged = range;
     }
 
-    // Delete all ranges marked with kDeleteThis
-    orderRanges();
+    if (target != nullptr) {
+        layout.add(merged, nullptr);
+    }
 
-    // Re-allocate to actually free up the space from the deleted items
+    return layout.memoryUsage();
+}
+
+void FontIndexer::restore(PackedRanges &ranges, std::vector<FallbackSet> &fallbacks,
+                          uint32_t codepoint_count, const IndexSettings &settings)
+{
+    m_packed = std::move(ranges);
+    m_has_last_range = false;
+    m_ranges.clear();
     shrinkContainer(m_ranges);
+
+    m_fallbacks = std::move(fallbacks);
+    m_cached_count = codepoint_count;
+    m_settings = settings;
+
+    printUsage();
 }
 
-void FontIndexer::orderRanges()
+void FontIndexer::printUsage()
 {
-    // Sort new ranges into order by start position
-    sort(m_ranges.begin(), m_ranges.end(), CodepointRange::compare_starts);
+    printf("Font index: %u ranges packed into %u bytes (%u unpacked), page table using %u bytes, %u fallback lists using %u bytes\n",
+        (unsigned) m_packed.size(),
+        (unsigned) m_packed.memoryUsage(),
+        (unsigned) (m_packed.size() * sizeof(CodepointRange)),
+        (unsigned) m_packed.pageTableUsage(),
+        (unsigned) m_fallbacks.size(),
+        (unsigned) (m_fallbacks.size() * sizeof(FallbackSet)));
+}
 
-    // Remove any ranges marked for deletion, which are now at the end of the vector after sorting
-    for (size_t i = m_ranges.size() - 1; i != 0; --i) {
-        if (m_ranges.at(i).start != kDeleteThis) {
-            break;
+bool FontIndexer::isReferenced(const uint16_t id)
+{
+    for (const CodepointRange &range : m_ranges) {
+        const FallbackSet &set = m_fallbacks[range.fallback];
+
+        if (range.id == id || std::find(set.ids, set.ids + set.count, id) != set.ids + set.count) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint16_t FontIndexer::addFallback(uint16_t index, uint16_t id)
+{
+    FallbackSet set = m_fallbacks[index];
+
+    if (set.count == FallbackSet::kMaxFonts || std::find(set.ids, set.ids + set.count, id) != set.ids + set.count) {
+        return index;
+    }
+
+    set.ids[set.count++] = id;
+
+    // Lists are unique, so the lookup is missing some if it's a different size to the table
+    // (eg. it was freed after compressing, or the table was restored)
+    if (m_fallback_lookup.size() != m_fallbacks.size()) {
+        m_fallback_lookup.clear();
+
+        for (size_t i = 0; i < m_fallbacks.size(); i++) {
+            m_fallback_lookup.emplace(m_fallbacks[i], i);
         }
+    }
+
+    // Reuse an identical list if one exists
+    const auto existing = m_fallback_lookup.find(set);
+    if (existing != m_fallback_lookup.end()) {
+        return existing->second;
+    }
+
+    if (m_fallbacks.size() > std::numeric_limits<uint16_t>::max()) {
+        // Table is full: drop the new fallback rather than growing the range struct
+        m_fallbacks_dropped++;
+        return index;
+    }
+
+    m_fallbacks.push_back(set);
+    m_fallback_lookup.emplace(set, m_fallbacks.size() - 1);
+
+    return m_fallbacks.size() - 1;
+}
 
-        m_ranges.pop_back();
+uint16_t FontIndexer::joinFallbacks(uint16_t a, uint16_t b)
+{
+    // Copy as the table may be reallocated while adding
+    const FallbackSet other = m_fallbacks[b];
+
+    for (uint32_t i = 0; i < other.count; i++) {
+        a = addFallback(a, other.ids[i]);
     }
-}
\ No newline at end of file
+
+    return a;
+}
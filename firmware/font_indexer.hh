@@ -1,9 +1,14 @@
 #pragma once
 
+#include "coverage_index.hh"
+#include "packed_ranges.hh"
+
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#include <algorithm>
 #include <limits>
+#include <unordered_map>
 #include <vector>
 
 #include <stdint.h>
@@ -12,7 +17,11 @@
 struct CodepointRange {
     uint32_t start;
     uint32_t end;
-    uint8_t id;
+    uint16_t id;
+
+    // Other fonts that may have glyphs in this range, as an index into
+    // FontIndexer's fallback table (see FontIndexer::fallbacks())
+    uint16_t fallback;
 
     static bool compare_starts(const CodepointRange &a, const CodepointRange &b)
     {
@@ -22,12 +31,63 @@ struct CodepointRange {
     CodepointRange()
         : start(std::numeric_limits<uint32_t>::max()),
           end(std::numeric_limits<uint32_t>::max()),
-          id(0) {}
+          id(0),
+          fallback(0) {}
 
-    CodepointRange(const uint32_t &_start, const uint32_t &_end, const uint8_t &_id)
+    CodepointRange(const uint32_t &_start, const uint32_t &_end, const uint16_t &_id)
         : start(_start),
           end(_end),
-          id(_id) {}
+          id(_id),
+          fallback(0) {}
+};
+
+/**
+ * Ordered list of alternative font IDs for a range
+ */
+struct FallbackSet {
+    static const uint32_t kMaxFonts = 3;
+
+    uint8_t count;
+    uint16_t ids[kMaxFonts];
+
+    inline bool operator==(const FallbackSet &other) const
+    {
+        return count == other.count && std::equal(ids, ids + count, other.ids);
+    }
+
+    /**
+     * Hash of the ids in the list, for looking up identical lists
+     */
+    struct Hash {
+        inline size_t operator()(const FallbackSet &set) const
+        {
+            size_t hash = set.count;
+
+            for (uint32_t i = 0; i < set.count; i++) {
+                hash = (hash * 31) + set.ids[i];
+            }
+
+            return hash;
+        }
+    };
+};
+
+/**
+ * Options used when compressing the index
+ * A saved index is only reused if it was built with the same settings.
+ */
+struct IndexSettings {
+    // Memory allowed for the exact coverage index in bytes (zero disables it)
+    uint32_t coverage_budget = 0;
+
+    // Memory allowed for the compressed ranges in bytes (see FontIndexer::compressRanges())
+    // Zero merges every gap, using as little memory as possible.
+    uint32_t range_budget = 0;
+
+    inline bool operator==(const IndexSettings &other) const
+    {
+        return coverage_budget == other.coverage_budget && range_budget == other.range_budget;
+    }
 };
 
 /**
@@ -38,7 +98,15 @@ struct CodepointRange {
  * memory for a microcontroller, but it's ~50KB instead of ~250KB for the full
  * set of Noto Regular fonts (228 fonts with 51511 unique codepoints).
  *
- * Currently uses heap allocation to store codepoint range objects.
+ * Ranges are held as an array of CodepointRange objects on the heap while fonts
+ * are being indexed. Once compressed, they're moved into a PackedRanges store of
+ * blocks with a page table to speed up lookups, which is less than half the size.
+ *
+ * Each range only maps to one font, but many fonts share codepoints. Fonts that
+ * lose an overlap to another are kept as fallbacks for the winning range, so a
+ * glyph can still be found if the chosen font turns out not to have it or can't
+ * be loaded. Fallback lists are deduplicated into a table shared between ranges,
+ * costing one or two bytes per range that has any plus 8 bytes per unique list.
  */
 class FontIndexer
 {
@@ -50,13 +118,28 @@ public:
     /**
      * Associates codepoints in the passed font with the passed ID
      *
-     * IDs are 8-bit to minimise the storage requirement.
+     * IDs are 16-bit, and must be less than kCodepointNotFound.
      *
      * Note the order fonts are indexed matters: a codepoint is associated with
      * the first font that contains it. This association will stick unless a
      * font has an longer sequence of codepoints overlapping an existing one.
+     * The losing font in an overlap is recorded as a fallback of the winner.
+     */
+    void indexFace(const uint16_t id, FT_Face face);
+
+    /**
+     * Read the ranges of codepoints in a face without adding them to the index
+     * This doesn't touch any indexer state, so it can be used from worker threads.
      */
-    void indexFace(const uint8_t id, FT_Face face);
+    static void faceRanges(const uint16_t id, FT_Face face, std::vector<CodepointRange> &ranges);
+
+    /**
+     * Associates codepoints with a font using pre-computed ranges (eg. from cmap_reader)
+     *
+     * The ranges must be ordered, non-overlapping and all have the same ID.
+     * This behaves exactly like indexFace() and the passed vector is consumed.
+     */
+    void indexRanges(std::vector<CodepointRange> &ranges);
 
     /**
      * Compress ranges to save memory
@@ -65,12 +148,30 @@ public:
      * ranges of each font to be collapsed together. This significantly reduces
      * memory consumption, with the trade off that false-positve matches will be
      * found and that font must be loaded to know if a glyph actually exists.
+     *
+     * Gaps are merged smallest first until the packed ranges fit in the range
+     * budget from the passed settings, so each merge costs as few false positives
+     * as possible. The number of codepoints that became false positives is printed
+     * along with the resulting number of ranges.
      * 
      * All calls to indexFace() must be made before calling compressRanges(). Once
      * compressed, new fonts will be unable to merge as all codepoints will appear
      * to be claimed by other fonts.
+     *
+     * The exact coverage index is built from the uncompressed ranges here, if
+     * enabled in the passed settings. The ranges are then packed (see PackedRanges).
      */
-    void compressRanges();
+    void compressRanges(const IndexSettings &settings);
+
+    /**
+     * Replace the index with ranges computed earlier (eg. loaded from disk)
+     *
+     * The ranges must already be compressed by compressRanges().
+     * The passed ranges and fallbacks are consumed by this call. The coverage index
+     * is restored separately through coverage().
+     */
+    void restore(PackedRanges &ranges, std::vector<FallbackSet> &fallbacks,
+                 uint32_t codepoint_count, const IndexSettings &settings);
 
     /**
      * Find the ID associated with the passed codepoint
@@ -78,27 +179,138 @@ public:
      */
     uint16_t find(const uint32_t codepoint);
 
+    /**
+     * Find the range containing the passed codepoint
+     * Returns false if not in the index
+     */
+    bool findRange(const uint32_t codepoint, CodepointRange &range);
+
+    /**
+     * Get the fallback fonts for a range, in the order they should be tried
+     */
+    inline const FallbackSet& fallbacks(const CodepointRange &range)
+    {
+        return m_fallbacks[range.fallback];
+    }
+
+    inline const std::vector<FallbackSet>& fallbackTable()
+    {
+        return m_fallbacks;
+    }
+
+    /**
+     * Check if any range uses the passed font ID, either directly or as a fallback
+     * This is only valid while indexing, before the ranges are compressed.
+     */
+    bool isReferenced(const uint16_t id);
+
     /**
      * Count the number of unique codepoints in the index
      */
     uint32_t countCodepoints();
 
+    /**
+     * Ranges being indexed, in order
+     * This is only populated while indexing, before the ranges are compressed.
+     */
     inline const std::vector<CodepointRange>& ranges()
     {
         return m_ranges;
     }
 
+    /**
+     * Compressed ranges
+     * This is only populated after compressRanges() or restore().
+     */
+    inline const PackedRanges& packedRanges()
+    {
+        return m_packed;
+    }
+
+    /**
+     * Exact record of which codepoints exist in any font (see CoverageIndex)
+     * This is only populated after compressRanges() or restore().
+     */
+    inline CoverageIndex& coverage()
+    {
+        return m_coverage;
+    }
+
+    inline const IndexSettings& settings()
+    {
+        return m_settings;
+    }
+
 private:
     /**
      * Merge a list of codepoint ranges into the main index
      */
     void mergeRanges(std::vector<CodepointRange> &incoming_ranges);
 
-    void orderRanges();
+    /**
+     * Get the fallback table index for the passed list with another font appended
+     * The list is returned unchanged if it's full or already contains the font, or
+     * if the table is full (which is reported when the ranges are compressed).
+     */
+    uint16_t addFallback(uint16_t index, uint16_t id);
+
+    /**
+     * Get the fallback table index for the union of two lists
+     */
+    uint16_t joinFallbacks(uint16_t a, uint16_t b);
+
+    /**
+     * Merge gaps between neighbouring ranges of the same font
+     *
+     * Every gap smaller than the threshold is merged, along with the first `ties`
+     * gaps of exactly that size. Ranges are only changed if apply is set, so this
+     * can be used to measure the result first. Returns the packed size of the merged
+     * ranges, and the number of unclaimed codepoints the merges cover.
+     */
+    uint32_t mergeGaps(uint32_t threshold, uint32_t ties, bool apply, uint32_t &false_positives);
+
+    /**
+     * Print the memory used by the compressed index
+     */
+    void printUsage();
+
+    /**
+     * Binary search of all ranges, used before the index is compressed
+     */
+    const CodepointRange* findBySearch(const uint32_t codepoint);
 
     // Cache of actual codepoint code to use after compressRanges is called
     // Zero indicates codepoints must to be counted (no cached value)
     uint32_t m_cached_count = 0;
 
+    // Ranges while indexing (emptied once compressed into m_packed)
     std::vector<CodepointRange> m_ranges;
+
+    // Ranges after compression
+    PackedRanges m_packed;
+
+    // Result of the last lookup in m_packed
+    CodepointRange m_last_range;
+    bool m_has_last_range = false;
+
+    // Output of mergeRanges(), swapped with m_ranges after each merge
+    // This keeps its capacity between fonts to avoid reallocating during indexing.
+    std::vector<CodepointRange> m_merge_buffer;
+
+    // Unique fallback lists referenced by ranges
+    // Entry zero is always the empty list.
+    std::vector<FallbackSet> m_fallbacks = {FallbackSet{0, {}}};
+
+    // Index of each list in m_fallbacks, so merging doesn't search the table for every overlap
+    // This is only needed while indexing, so it's freed once the ranges are compressed.
+    std::unordered_map<FallbackSet, uint16_t, FallbackSet::Hash> m_fallback_lookup;
+
+    // Fallbacks that weren't recorded as the table was full
+    uint32_t m_fallbacks_dropped = 0;
+
+    // Exact coverage, as m_packed over-reports after compression
+    CoverageIndex m_coverage;
+
+    // Settings the index was compressed with
+    IndexSettings m_settings;
 };
\ No newline at end of file
@@ -0,0 +1,197 @@
+/**
+ * Microbenchmark of blending text spans into a line buffer
+ *
+ * Compares working out the pen/background blend for every span, as the pen's raster
+ * callbacks used to, with looking the pixel up in a BlendTable. Spans are generated to
+ * look like those FreeType produces for small UI text: mostly short runs, with solid
+ * coverage in the middle of strokes.
+ *
+ * Usage: blend_bench [draws]
+ */
+
+#include "ui/blend_table.hh"
+
+// C++
+#include <chrono>
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const uint32_t kLineWidth = 240;
+
+// Spans in one draw: roughly a line of 16px text
+static const uint32_t kSpansPerDraw = 600;
+
+struct Span {
+    uint16_t x;
+    uint16_t len;
+    uint8_t coverage;
+};
+
+// Pen and background pairs used by the UI
+static const uint32_t kColourPairs[][2] = {
+    {0xffffff, 0x000000},
+    {0xa8a8a8, 0x000000},
+    {0xf02708, 0x000000},
+    {0x1b202d, 0x000000},
+    {0x00bcff, 0x000000},
+    {0xff8c00, 0x000000},
+    {0xffffff, 0xf02708},
+    {0x000000, 0x636363},
+};
+
+static_assert(sizeof(kColourPairs) / sizeof(kColourPairs[0]) > BlendTable::kCachedTables,
+              "Benchmark needs more colour pairs than the table cache holds");
+
+static uint32_t s_random = 1;
+
+static uint32_t next_random()
+{
+    s_random = s_random * 1103515245 + 12345;
+    return s_random >> 16;
+}
+
+static void generate_spans(Span* spans, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        Span &span = spans[i];
+
+        // Stroke edges are single pixels of partial coverage; stroke middles are solid
+        const bool solid = (next_random() % 3) == 0;
+
+        span.len = solid ? 1 + (next_random() % 4) : 1;
+        span.coverage = solid ? 255 : 1 + (next_random() % 254);
+        span.x = next_random() % (kLineWidth - span.len);
+    }
+}
+
+/**
+ * Blend each span with multiplies, as raster_pen_line did before blend tables
+ */
+static void blend_multiply(uint8_t* line, const Span* spans, uint32_t count, uint32_t colour, uint32_t background)
+{
+    const uint8_t pen_r = colour >> 16;
+    const uint8_t pen_g = colour >> 8;
+    const uint8_t pen_b = colour;
+
+    const uint8_t bg_r = background >> 16;
+    const uint8_t bg_g = background >> 8;
+    const uint8_t bg_b = background;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const Span &span = spans[i];
+        const uint8_t coverage = span.coverage;
+
+        const uint8_t r = ((coverage * pen_r) + ((255 - coverage) * bg_r)) >> 8;
+        const uint8_t g = ((coverage * pen_g) + ((255 - coverage) * bg_g)) >> 8;
+        const uint8_t b = ((coverage * pen_b) + ((255 - coverage) * bg_b)) >> 8;
+
+        uint8_t* out = line + (span.x * 3);
+
+        for (uint32_t k = 0; k < span.len; k++) {
+            *(out++) = r;
+            *(out++) = g;
+            *(out++) = b;
+        }
+    }
+}
+
+/**
+ * Blend each span by looking up its pixel, as the pen's raster callbacks do now
+ */
+static void blend_table(uint8_t* line, const Span* spans, uint32_t count, uint32_t colour, uint32_t background)
+{
+    const BlendTable &table = BlendTable::get(colour, background);
+
+    for (uint32_t i = 0; i < count; i++) {
+        const Span &span = spans[i];
+        const uint8_t* rgb = table.pixel(span.coverage);
+
+        const uint8_t r = rgb[0];
+        const uint8_t g = rgb[1];
+        const uint8_t b = rgb[2];
+
+        uint8_t* out = line + (span.x * 3);
+
+        for (uint32_t k = 0; k < span.len; k++) {
+            *(out++) = r;
+            *(out++) = g;
+            *(out++) = b;
+        }
+    }
+}
+
+typedef void (*BlendFunc)(uint8_t* line, const Span* spans, uint32_t count, uint32_t colour, uint32_t background);
+
+/**
+ * Time blending a number of draws, cycling through the colour pairs
+ * Returns nanoseconds per span, and a checksum of the output in sum.
+ */
+static double run(BlendFunc blend, const Span* spans, uint32_t draws, uint32_t pairs, uint32_t &sum)
+{
+    static uint8_t line[kLineWidth * 3];
+    memset(line, 0, sizeof(line));
+
+    sum = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t draw = 0; draw < draws; draw++) {
+        const uint32_t* pair = kColourPairs[draw % pairs];
+        blend(line, spans + ((draw % 16) * kSpansPerDraw), kSpansPerDraw, pair[0], pair[1]);
+
+        sum = (sum * 31) + line[draw % sizeof(line)];
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    for (uint8_t value : line) {
+        sum = (sum * 31) + value;
+    }
+
+    return ns / ((double) draws * kSpansPerDraw);
+}
+
+int main(int argc, const char* argv[])
+{
+    const uint32_t draws = argc >= 2 ? strtoul(argv[1], nullptr, 10) : 20000;
+
+    if (draws == 0) {
+        printf("Usage:\n  %s [draws]\n", argv[0]);
+        return 1;
+    }
+
+    // Draws cycle through 16 different sets of spans
+    static Span spans[16 * kSpansPerDraw];
+    generate_spans(spans, 16 * kSpansPerDraw);
+
+    printf("Blending %u draws of %u spans into a %u pixel line\n",
+        (unsigned) draws, (unsigned) kSpansPerDraw, (unsigned) kLineWidth);
+
+    // Colour pairs that all fit in the table cache, then one more than it holds, so every
+    // draw has to build its table
+    const uint32_t pair_counts[] = {1, BlendTable::kCachedTables, BlendTable::kCachedTables + 1};
+
+    for (uint32_t pairs : pair_counts) {
+        uint32_t multiply_sum;
+        uint32_t table_sum;
+
+        const double multiply_ns = run(blend_multiply, spans, draws, pairs, multiply_sum);
+        const double table_ns = run(blend_table, spans, draws, pairs, table_sum);
+
+        printf("%u colour pairs: %.2f ns per span multiplying, %.2f ns with a blend table (%.2fx)%s\n",
+            (unsigned) pairs,
+            multiply_ns,
+            table_ns,
+            multiply_ns / table_ns,
+            multiply_sum == table_sum ? "" : " OUTPUT DIFFERS");
+    }
+
+    BlendTable::printStats();
+
+    return 0;
+}
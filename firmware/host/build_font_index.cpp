@@ -0,0 +1,59 @@
+/**
+ * Build the saved font index for a font directory ahead of time
+ *
+ * Indexing a full set of fonts takes a while on the device, so this writes the
+ * index file into the directory before it's copied to an SD card. Fonts are
+ * registered and the index saved by the same code the firmware runs on its first
+ * boot, so the file is exactly what the device would write for itself.
+ *
+ * Usage: build_font_index path/to/fonts/
+ */
+
+#include "index_cache.hh"
+#include "ui/font.hh"
+#include "util.hh"
+
+// C++
+#include <string>
+
+// C
+#include <stdio.h>
+
+
+int main(int argc, const char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n  %s path/to/fonts/\n", argv[0]);
+        return 1;
+    }
+
+    // Paths are stored relative to the directory, which must not end with a separator
+    std::string fontdir = argv[1];
+    while (fontdir.size() > 1 && fontdir.back() == '/') {
+        fontdir.pop_back();
+    }
+
+    if (!fs::is_dir(fontdir.c_str())) {
+        printf("Font directory '%s' not found!\n", fontdir.c_str());
+        return 1;
+    }
+
+    const std::string index_path = fontdir + "/" + index_cache::kFileName;
+    const std::vector<IndexedFile> fontfiles = index_cache::list_files(fontdir.c_str());
+
+    const uint32_t start_time = timestamp_us();
+
+    FontStore store;
+    store.registerFonts(fontfiles, [](uint8_t) {});
+    store.optimise(index_cache::kSettings);
+
+    printf("Indexed %u fonts in %u ms\n", (unsigned) fontfiles.size(), (timestamp_us() - start_time) / 1000);
+
+    if (!store.saveIndex(index_path.c_str(), fontdir.c_str(), fontfiles)) {
+        return 1;
+    }
+
+    printf("Saved font index to %s\n", index_path.c_str());
+
+    return 0;
+}
@@ -1,54 +1,117 @@
 #include "filesystem.hh"
+#include "io_trace.hh"
 
-#include <string>
+#include <chrono>
 #include <filesystem>
+#include <mutex>
+#include <string>
 
 
 #include <stdlib.h>
 
+/**
+ * Font file opened for FreeType
+ */
+struct FontFile {
+    FILE* fp;
+
+    // Recently read blocks, as on the device, so hit rates can be measured here
+    BlockCache* cache;
+
+    // Font id in the I/O trace, if tracing
+    uint16_t trace_id;
+
+    // Heap held for this file, its stream and cache
+    size_t heap_bytes;
+};
+
+// Block cache settings for fonts opened after fs::set_read_cache()
+static BlockCache::Settings s_cache_settings = {1024, 4, false};
+
+// Read cache totals from closed fonts, and heap held for fonts that are open
+// Fonts can be opened and closed on indexing threads, so these are locked.
+static BlockCache::Stats s_cache_stats;
+static size_t s_open_font_bytes = 0;
+static std::mutex s_cache_stats_mutex;
+
+static size_t read_font_file(void* source, uint32_t offset, uint8_t* buffer, size_t count)
+{
+    FILE* fp = ((FontFile*) source)->fp;
+
+    if (ftell(fp) != offset) {
+        fseek(fp, offset, SEEK_SET);
+    }
+
+    return fread(buffer, 1, count, fp);
+}
+
 static unsigned long _read_stream(FT_Stream stream,
                                   unsigned long offset,
                                   unsigned char* buffer,
                                   unsigned long count)
 {
-    FILE* fp = (FILE*) stream->descriptor.pointer;
+    FontFile* file = (FontFile*) stream->descriptor.pointer;
 
-    // FreeType can call this function with a count of zero to seek only
-    if (ftell(fp) != offset) {
-        fseek(fp, offset, SEEK_SET);
-    }
+    io_trace::read(file->trace_id, offset, count);
 
+    // FreeType can call this function with a count of zero to seek only
+    // Reads always pass their offset through, so there's nothing to do but check it.
     if (count == 0) {
-        // Seek only
-        return 0;
+        return offset > stream->size;
     }
 
-    return fread(buffer, 1, count, fp);
+    return file->cache->read(offset, buffer, count);
 }
 
 static void _close_stream(FT_Stream stream)
 {
-    FILE* fp = (FILE*) stream->descriptor.pointer;
-    fclose(fp);
+    FontFile* file = (FontFile*) stream->descriptor.pointer;
+
+    {
+        std::lock_guard<std::mutex> lock(s_cache_stats_mutex);
+        s_cache_stats += file->cache->stats();
+        s_open_font_bytes -= file->heap_bytes;
+    }
+
+    io_trace::close(file->trace_id);
 
+    fclose(file->fp);
+
+    delete file->cache;
+    delete file;
     delete stream;
 }
 
 
 namespace fs {
 
+struct File {
+    FILE* fp;
+};
+
 int mount()
 {
     // No action required
     return 0;
 }
 
+void set_read_cache(const BlockCache::Settings &settings)
+{
+    s_cache_settings = settings;
+}
+
+void print_stats()
+{
+    std::lock_guard<std::mutex> lock(s_cache_stats_mutex);
+    BlockCache::printStats(s_cache_stats);
+}
+
 bool is_dir(const char* path)
 {
     return std::filesystem::is_directory(path);
 }
 
-void walkdir(const char* dirpath, const std::function<void(const char* abspath, uint8_t progress)> &callback)
+void walkdir(const char* dirpath, const std::function<void(const char* abspath, const FileInfo &info, uint8_t progress)> &callback)
 {
     uint32_t total = 0;
     uint32_t current = 0;
@@ -63,11 +126,61 @@ void walkdir(const char* dirpath, const std::function<void(const char* abspath,
     // Process files
     for (const auto & entry : std::filesystem::directory_iterator(dirpath)) {
         if (entry.is_regular_file()) {
-            callback(entry.path().c_str(), fp_progress(++current, total));
+            const auto mtime = entry.last_write_time().time_since_epoch();
+
+            FileInfo info;
+            info.size = entry.file_size();
+            info.mtime = std::chrono::duration_cast<std::chrono::seconds>(mtime).count();
+
+            callback(entry.path().c_str(), info, fp_progress(++current, total));
         }
     }
 }
 
+File* open(const char* path, bool write)
+{
+    FILE* fp = fopen(path, write ? "wb" : "rb");
+    if (fp == NULL) {
+        printf("Failed to open file %s\n", path);
+        return nullptr;
+    }
+
+    return new File{fp};
+}
+
+size_t read(File* file, void* buffer, size_t count)
+{
+    return fread(buffer, 1, count, file->fp);
+}
+
+size_t write(File* file, const void* buffer, size_t count)
+{
+    return fwrite(buffer, 1, count, file->fp);
+}
+
+bool seek(File* file, uint32_t offset)
+{
+    return fseek(file->fp, offset, SEEK_SET) == 0;
+}
+
+bool close(File* file)
+{
+    const bool success = fclose(file->fp) == 0;
+    delete file;
+
+    return success;
+}
+
+bool rename(const char* from, const char* to)
+{
+    return ::rename(from, to) == 0;
+}
+
+bool remove(const char* path)
+{
+    return ::remove(path) == 0;
+}
+
 FT_Error load_face(const char* path, FT_Library library, FT_Face* face)
 {
     printf("== Loading font %s ==\n", path);
@@ -83,9 +196,20 @@ FT_Error load_face(const char* path, FT_Library library, FT_Face* face)
     size_t sz = ftell(fp);
     fseek(fp, 0L, SEEK_SET);
 
+    FontFile* file = new FontFile;
+    file->fp = fp;
+    file->cache = new BlockCache(s_cache_settings, &read_font_file, file, sz);
+    file->trace_id = io_trace::open(path, sz);
+    file->heap_bytes = sizeof(FontFile) + sizeof(FT_StreamRec) + sizeof(BlockCache) + file->cache->memoryUsed();
+
+    {
+        std::lock_guard<std::mutex> lock(s_cache_stats_mutex);
+        s_open_font_bytes += file->heap_bytes;
+    }
+
     FT_Stream stream = new FT_StreamRec;
     stream->size = sz;
-    stream->descriptor.pointer = fp;
+    stream->descriptor.pointer = file;
     stream->read = &_read_stream;
     stream->close = &_close_stream;
 
@@ -96,4 +220,10 @@ FT_Error load_face(const char* path, FT_Library library, FT_Face* face)
     return FT_Open_Face(library, &args, 0, face);
 }
 
+size_t open_font_bytes()
+{
+    std::lock_guard<std::mutex> lock(s_cache_stats_mutex);
+    return s_open_font_bytes;
+}
+
 }; // namespace fs
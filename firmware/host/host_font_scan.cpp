@@ -0,0 +1,83 @@
+#include "filesystem.hh"
+#include "ui/font.hh"
+
+// C++
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Parallel font registration for the desktop build
+// Emscripten uses the serial version in ui/font.cpp, as it only has one worker thread.
+#ifndef EMSCRIPTEN
+
+void FontStore::registerFonts(const std::vector<IndexedFile> &files, const std::function<void(uint8_t progress)> &progress)
+{
+    if (files.empty()) {
+        return;
+    }
+
+    const size_t num_workers = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, files.size());
+
+    // Results are filled in by workers in any order, then registered here in list order
+    std::vector<FontScan> scans(files.size());
+    std::vector<bool> done(files.size(), false);
+
+    std::mutex mutex;
+    std::condition_variable scan_finished;
+    std::atomic<size_t> next_file(0);
+
+    auto worker = [&]() {
+        // FreeType libraries aren't thread safe, so each worker needs its own
+        FT_Library library;
+        const bool has_library = FT_Init_FreeType(&library) == FT_Err_Ok;
+
+        for (size_t i = next_file++; i < files.size(); i = next_file++) {
+            if (has_library) {
+                scanFont(files[i].path.c_str(), library, scans[i]);
+            } else {
+                scans[i].error = FT_Err_Out_Of_Memory;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done[i] = true;
+            }
+
+            scan_finished.notify_one();
+        }
+
+        if (has_library) {
+            FT_Done_FreeType(library);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        workers.emplace_back(worker);
+    }
+
+    // Merge on this thread so the index and progress updates happen exactly as in serial loading
+    for (size_t i = 0; i < files.size(); i++) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            scan_finished.wait(lock, [&]() { return done[i]; });
+        }
+
+        registerScan(files[i].path.c_str(), scans[i]);
+
+        // Release the ranges now they've been merged
+        scans[i] = FontScan();
+
+        progress(fs::fp_progress(i + 1, files.size()));
+    }
+
+    for (std::thread &thread : workers) {
+        thread.join();
+    }
+
+    printf("Read %u fonts using %u threads\n", (unsigned) files.size(), (unsigned) num_workers);
+}
+
+#endif
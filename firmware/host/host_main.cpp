@@ -1,3 +1,4 @@
+#include "io_trace.hh"
 #include "st7789.h"
 #include "ui/main_ui.hh"
 #include "util.hh"
@@ -21,6 +22,7 @@ static SDL_TimerID shift_pending = 0;
 static MainUI* app = nullptr;
 static bool is_app_valid = false;
 static bool needs_render = true;
+static std::atomic_bool needs_tick = false;
 static SDL_Rect vscreen_dest;
 
 const char* s_font_path = nullptr;
@@ -280,6 +282,19 @@ void main_loop()
             handle_event(event);
         }
     }
+
+    if (!is_app_valid) {
+        return;
+    }
+
+    if (needs_tick) {
+        needs_tick = false;
+        app->tick();
+
+    } else {
+        // Prepare for likely input in the time until the next tick, like the device main loop
+        app->prefetch();
+    }
 }
 
 int main(int argc, const char* argv[])
@@ -290,11 +305,25 @@ int main(int argc, const char* argv[])
     emscripten_set_main_loop(main_loop, 0, 0);
 #else
     if (argc < 2) {
-        printf("Usage:\n  %s <fonts-dir>\n", argv[0]);
+        printf("Usage:\n  %s <fonts-dir> [io-trace-file]\n", argv[0]);
         return 1;
     }
 
     s_font_path = argv[1];
+
+    // Optionally log font file reads for replay with scripts/replay-io-trace.py
+    FILE* trace_file = nullptr;
+
+    if (argc >= 3) {
+        trace_file = fopen(argv[2], "w");
+
+        if (trace_file == nullptr) {
+            fprintf(stderr, "Could not open trace file %s\n", argv[2]);
+            return 1;
+        }
+
+        io_trace::start(trace_file);
+    }
 #endif
 
     const uint32_t kDisplayScaling = 2;
@@ -342,8 +371,10 @@ int main(int argc, const char* argv[])
     }, &needs_render);
 
     // Make the application do any periodic updates
+    // SDL timers run on their own thread, so this only flags the tick for the main loop,
+    // where input is also handled. That keeps every call into the app on one thread.
     SDL_AddTimer(1000/30 /* milliseconds */, [](Uint32 interval, void *param) -> Uint32 {
-        if (is_app_valid) app->tick();
+        needs_tick = true;
         return interval;
     }, nullptr);
 
@@ -371,6 +402,15 @@ int main(int argc, const char* argv[])
     // Wait for any background task that's still running
     load_thread.join();
 
+    if (is_app_valid) {
+        app->print_stats();
+    }
+
+    if (trace_file != nullptr) {
+        io_trace::stop();
+        fclose(trace_file);
+    }
+
     SDL_DestroyWindow(screen);
     SDL_Quit();
 
@@ -0,0 +1,295 @@
+/**
+ * Check of FontIndexer::mergeRanges() against the merge it replaced
+ *
+ * Indexes every font in a directory, in the same name order the firmware uses, with
+ * both FontIndexer and a copy of the old merge that appended each font's ranges and
+ * re-sorted the table. After each font, the ranges and their fallback lists must be
+ * identical. The time spent merging with each is printed at the end.
+ *
+ * Usage: merge_check path/to/fonts/
+ * Exits non-zero if the outputs differ or no fonts could be read.
+ */
+
+#include "font_indexer.hh"
+
+// C++
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iterator>
+#include <string>
+
+// C
+#include <stdio.h>
+
+
+// Flag for marking ranges for deletion
+static const uint32_t kDeleteThis = std::numeric_limits<uint32_t>::max();
+
+/**
+ * FontIndexer's merge as it was before it became a single pass
+ *
+ * Fallback lists are handled as FontIndexer does them, so both should build the
+ * same table in the same order.
+ */
+class SortedMerge
+{
+public:
+    void mergeRanges(std::vector<CodepointRange> &incoming_ranges)
+    {
+        if (incoming_ranges.empty()) {
+            return;
+        }
+
+        if (m_ranges.empty()) {
+            m_ranges = std::move(incoming_ranges);
+            return;
+        }
+
+        auto existing_iter = m_ranges.begin();
+
+        for (CodepointRange &incoming : incoming_ranges) {
+
+            const auto &start = incoming.start;
+            const auto &end = incoming.end;
+
+            while (existing_iter != m_ranges.end()) {
+                CodepointRange &existing = *existing_iter;
+
+                if (start > existing.end) {
+                    ++existing_iter;
+                    continue;
+                }
+
+                if (end < existing.start) {
+                    break;
+                }
+
+                if (start >= existing.start && end <= existing.end) {
+                    existing.fallback = addFallback(existing.fallback, incoming.id);
+                    incoming.start = kDeleteThis;
+                    break;
+                }
+
+                if (existing.start >= start && existing.end <= end) {
+                    incoming.fallback = addFallback(incoming.fallback, existing.id);
+                    incoming.fallback = joinFallbacks(incoming.fallback, existing.fallback);
+                    existing.start = kDeleteThis;
+                    ++existing_iter;
+                    continue;
+                }
+
+                const uint32_t incoming_size = (end - start) + 1;
+                const uint32_t existing_size = (existing.end - existing.start) + 1;
+
+                if (incoming_size > existing_size) {
+                    incoming.fallback = addFallback(incoming.fallback, existing.id);
+                } else {
+                    existing.fallback = addFallback(existing.fallback, incoming.id);
+                }
+
+                if (start <= existing.start && end >= existing.start) {
+                    if (incoming_size > existing_size) {
+                        existing.start = incoming.end + 1;
+                    } else {
+                        incoming.end = existing.start - 1;
+                    }
+
+                } else if (start <= existing.end && end >= existing.end) {
+                    if (incoming_size > existing_size) {
+                        existing.end = incoming.start - 1;
+                    } else {
+                        incoming.start = existing.end + 1;
+                    }
+                }
+
+                continue;
+            }
+
+            if (existing_iter == m_ranges.end()) {
+                break;
+            }
+        }
+
+        m_ranges.insert(
+            m_ranges.end(),
+            std::make_move_iterator(incoming_ranges.begin()),
+            std::make_move_iterator(incoming_ranges.end())
+        );
+
+        // Sort into order, then drop the deleted ranges which are now at the end
+        std::sort(m_ranges.begin(), m_ranges.end(), CodepointRange::compare_starts);
+
+        for (size_t i = m_ranges.size() - 1; i != 0; --i) {
+            if (m_ranges.at(i).start != kDeleteThis) {
+                break;
+            }
+
+            m_ranges.pop_back();
+        }
+    }
+
+    inline const std::vector<CodepointRange>& ranges() const
+    {
+        return m_ranges;
+    }
+
+    inline const FallbackSet& fallbacks(const CodepointRange &range) const
+    {
+        return m_fallbacks[range.fallback];
+    }
+
+private:
+    uint16_t addFallback(uint16_t index, uint16_t id)
+    {
+        FallbackSet set = m_fallbacks[index];
+
+        if (set.count == FallbackSet::kMaxFonts || std::find(set.ids, set.ids + set.count, id) != set.ids + set.count) {
+            return index;
+        }
+
+        set.ids[set.count++] = id;
+
+        const auto existing = std::find(m_fallbacks.begin(), m_fallbacks.end(), set);
+        if (existing != m_fallbacks.end()) {
+            return existing - m_fallbacks.begin();
+        }
+
+        if (m_fallbacks.size() > std::numeric_limits<uint16_t>::max()) {
+            return index;
+        }
+
+        m_fallbacks.push_back(set);
+        return m_fallbacks.size() - 1;
+    }
+
+    uint16_t joinFallbacks(uint16_t a, uint16_t b)
+    {
+        const FallbackSet other = m_fallbacks[b];
+
+        for (uint32_t i = 0; i < other.count; i++) {
+            a = addFallback(a, other.ids[i]);
+        }
+
+        return a;
+    }
+
+    std::vector<CodepointRange> m_ranges;
+    std::vector<FallbackSet> m_fallbacks = {FallbackSet{0, {}}};
+};
+
+/**
+ * Print the first difference between the two indexes
+ * Returns false if they differ.
+ */
+static bool compare(FontIndexer &indexer, const SortedMerge &reference, const std::string &name)
+{
+    const std::vector<CodepointRange> &actual = indexer.ranges();
+    const std::vector<CodepointRange> &expected = reference.ranges();
+
+    if (actual.size() != expected.size()) {
+        printf("%s: merged into %u ranges, expected %u\n", name.c_str(), (unsigned) actual.size(), (unsigned) expected.size());
+        return false;
+    }
+
+    for (size_t i = 0; i < actual.size(); i++) {
+        const CodepointRange &a = actual[i];
+        const CodepointRange &b = expected[i];
+
+        if (a.start != b.start || a.end != b.end || a.id != b.id) {
+            printf("%s: range %u is U+%04X-U+%04X in font %u, expected U+%04X-U+%04X in font %u\n",
+                name.c_str(), (unsigned) i,
+                (unsigned) a.start, (unsigned) a.end, (unsigned) a.id,
+                (unsigned) b.start, (unsigned) b.end, (unsigned) b.id);
+            return false;
+        }
+
+        if (!(indexer.fallbacks(a) == reference.fallbacks(b))) {
+            printf("%s: range %u (U+%04X-U+%04X) has different fallback fonts\n",
+                name.c_str(), (unsigned) i, (unsigned) a.start, (unsigned) a.end);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc != 2 || !std::filesystem::is_directory(argv[1])) {
+        printf("Usage:\n  %s path/to/fonts/\n", argv[0]);
+        return 1;
+    }
+
+    // The firmware indexes fonts in path order
+    std::vector<std::string> paths;
+    for (const auto &entry : std::filesystem::directory_iterator(argv[1])) {
+        if (entry.is_regular_file()) {
+            paths.push_back(entry.path().string());
+        }
+    }
+
+    std::sort(paths.begin(), paths.end());
+
+    FT_Library library;
+    if (FT_Init_FreeType(&library) != FT_Err_Ok) {
+        printf("Failed to initialise FreeType\n");
+        return 1;
+    }
+
+    FontIndexer indexer;
+    SortedMerge reference;
+
+    uint32_t fonts = 0;
+    double indexer_ns = 0;
+    double reference_ns = 0;
+
+    for (const std::string &path : paths) {
+        if (fonts >= FontIndexer::kCodepointNotFound) {
+            printf("Stopping at %u fonts, as there are no more font ids\n", (unsigned) fonts);
+            break;
+        }
+
+        FT_Face face;
+        if (FT_New_Face(library, path.c_str(), 0, &face) != FT_Err_Ok) {
+            // Not a font: the firmware skips these too
+            continue;
+        }
+
+        std::vector<CodepointRange> ranges;
+        FontIndexer::faceRanges(fonts, face, ranges);
+        FT_Done_Face(face);
+
+        std::vector<CodepointRange> reference_ranges = ranges;
+        fonts++;
+
+        const auto start = std::chrono::steady_clock::now();
+        indexer.indexRanges(ranges);
+        const auto middle = std::chrono::steady_clock::now();
+        reference.mergeRanges(reference_ranges);
+        const auto end = std::chrono::steady_clock::now();
+
+        indexer_ns += std::chrono::duration<double, std::nano>(middle - start).count();
+        reference_ns += std::chrono::duration<double, std::nano>(end - middle).count();
+
+        if (!compare(indexer, reference, path)) {
+            FT_Done_FreeType(library);
+            return 1;
+        }
+    }
+
+    FT_Done_FreeType(library);
+
+    if (fonts == 0) {
+        printf("No fonts found in %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("%u fonts merged into %u identical ranges with %u fallback lists\n",
+        (unsigned) fonts, (unsigned) indexer.ranges().size(), (unsigned) indexer.fallbackTable().size());
+
+    printf("Merge time: %.3f ms single pass, %.3f ms sorting (%.2fx)\n",
+        indexer_ns / 1e6, reference_ns / 1e6, reference_ns / indexer_ns);
+
+    return 0;
+}
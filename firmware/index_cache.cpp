@@ -0,0 +1,607 @@
+#include "index_cache.hh"
+
+// C++
+#include <algorithm>
+
+// C
+#include <string.h>
+
+// zlib
+#include "zlib.h"
+
+
+// File identifier and layout version
+// The version must be incremented whenever the layout below changes.
+static const char kMagic[4] = {'U', 'I', 'F', 'X'};
+static const uint16_t kVersion = 8;
+
+//
+// File layout:
+//
+// Paths are relative to the font directory, so the same file works on the device
+// and the host. Copying files to the SD card may not preserve timestamps, so a file
+// with a different mtime still matches if its fingerprint (see file_fingerprint())
+// is the same.
+//
+//   char[4]    magic
+//   uint16     version
+//   uint32     coverage budget (IndexSettings)
+//   uint32     range budget (IndexSettings)
+//   uint32     file count
+//   (per file) uint16 path length, char[] path, uint32 size, uint32 mtime, uint32 fingerprint
+//   uint32     font table count
+//   (per font) uint16 path length, char[] path
+//   uint32     codepoint count (before compression)
+//   uint32     range count
+//   uint32     packed range data length
+//   uint8[]    packed range data (see PackedRanges)
+//   uint32     fallback list count
+//   (per list) uint8 count, uint16[FallbackSet::kMaxFonts] ids
+//   uint16[17] coverage plane offsets
+//   uint32     coverage page count
+//   uint32[]   coverage page entries
+//   uint32     coverage data length
+//   uint8[]    coverage data
+//   uint32     CRC-32 of everything above
+//
+
+/**
+ * Buffered sequential reads from a file
+ * This avoids a call into the filesystem for every small field read.
+ */
+class CacheReader {
+public:
+    CacheReader(fs::File* file, uint32_t size)
+        : m_file(file),
+          m_pos(0),
+          m_length(0),
+          m_remaining(size),
+          m_crc(crc32(0, Z_NULL, 0)) {}
+
+    bool read(void* out, size_t count)
+    {
+        uint8_t* dest = (uint8_t*) out;
+
+        if (count > m_remaining) {
+            // Past the end of the file
+            return false;
+        }
+
+        m_remaining -= count;
+
+        while (count != 0) {
+            if (m_pos == m_length) {
+                m_length = fs::read(m_file, m_buffer, sizeof(m_buffer));
+                m_pos = 0;
+
+                if (m_length == 0) {
+                    // Unexpected end of file
+                    return false;
+                }
+            }
+
+            const size_t chunk = std::min(count, m_length - m_pos);
+            memcpy(dest, m_buffer + m_pos, chunk);
+            m_crc = crc32(m_crc, dest, chunk);
+
+            m_pos += chunk;
+            dest += chunk;
+            count -= chunk;
+        }
+
+        return true;
+    }
+
+    template<typename T> bool read(T &value)
+    {
+        return read(&value, sizeof(T));
+    }
+
+    bool read(std::string &value)
+    {
+        uint16_t length;
+        if (!read(length)) {
+            return false;
+        }
+
+        if (length > m_remaining) {
+            return false;
+        }
+
+        value.resize(length);
+        return read(&value[0], length);
+    }
+
+    /**
+     * Check the rest of the file could hold count items of the passed size
+     * Counts read from the file must pass this before being used to size anything.
+     */
+    inline bool fits(uint32_t count, uint32_t item_size) const
+    {
+        return count <= m_remaining / item_size;
+    }
+
+    /**
+     * Read the stored checksum and compare it with the data read so far
+     */
+    bool verify()
+    {
+        const uint32_t expected = m_crc;
+        uint32_t stored;
+
+        return read(stored) && stored == expected;
+    }
+
+private:
+    fs::File* m_file;
+
+    uint8_t m_buffer[512];
+    size_t m_pos;
+    size_t m_length;
+
+    // Bytes left in the file after those read so far
+    uint32_t m_remaining;
+
+    // Running checksum of all data read
+    uint32_t m_crc;
+};
+
+/**
+ * Buffered sequential writes to a file
+ * Any write failure is sticky, so errors only need to be checked at the end.
+ */
+class CacheWriter {
+public:
+    CacheWriter(fs::File* file)
+        : m_file(file),
+          m_length(0),
+          m_failed(false),
+          m_crc(crc32(0, Z_NULL, 0)) {}
+
+    void write(const void* data, size_t count)
+    {
+        const uint8_t* src = (const uint8_t*) data;
+        m_crc = crc32(m_crc, src, count);
+
+        while (count != 0) {
+            if (m_length == sizeof(m_buffer)) {
+                flush();
+            }
+
+            const size_t chunk = std::min(count, sizeof(m_buffer) - m_length);
+            memcpy(m_buffer + m_length, src, chunk);
+
+            m_length += chunk;
+            src += chunk;
+            count -= chunk;
+        }
+    }
+
+    template<typename T> void write(const T &value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    void write(const std::string &value)
+    {
+        write((uint16_t) value.size());
+        write(value.c_str(), value.size());
+    }
+
+    /**
+     * Append the checksum of everything written so far
+     */
+    void writeChecksum()
+    {
+        const uint32_t crc = m_crc;
+        write(crc);
+    }
+
+    /**
+     * Write out any buffered data
+     * Returns false if any write so far has failed
+     */
+    bool flush()
+    {
+        if (m_length != 0 && !m_failed) {
+            m_failed = fs::write(m_file, m_buffer, m_length) != m_length;
+        }
+
+        m_length = 0;
+
+        return !m_failed;
+    }
+
+private:
+    fs::File* m_file;
+
+    uint8_t m_buffer[512];
+    size_t m_length;
+    bool m_failed;
+
+    // Running checksum of all data written
+    uint32_t m_crc;
+};
+
+// Bytes at the start of a file covered by its fingerprint
+// This holds a font's table directory, which has a checksum of each table.
+static const uint32_t kFingerprintBytes = 1024;
+
+/**
+ * CRC-32 of the start of a file, to recognise it when its mtime has changed
+ *
+ * Any change to a font's tables changes their checksums in its table directory,
+ * so this identifies its contents without reading the whole file.
+ * Returns zero if the file can't be read.
+ */
+static uint32_t file_fingerprint(const std::string &path)
+{
+    fs::File* file = fs::open(path.c_str());
+    if (file == nullptr) {
+        return 0;
+    }
+
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    uint8_t buffer[256];
+
+    for (uint32_t offset = 0; offset < kFingerprintBytes; offset += sizeof(buffer)) {
+        const size_t length = fs::read(file, buffer, sizeof(buffer));
+        crc = crc32(crc, buffer, length);
+
+        if (length != sizeof(buffer)) {
+            break;
+        }
+    }
+
+    fs::close(file);
+
+    return crc;
+}
+
+/**
+ * Check the CRC-32 at the end of a file against everything before it
+ * This passes the file size out and leaves the file at the start on success.
+ */
+static bool verify_file(fs::File* file, uint32_t &size)
+{
+    // Read after the last four bytes seen, which are only checksummed once more data follows
+    uint8_t buffer[sizeof(uint32_t) + 512];
+    size_t held = 0;
+
+    uint32_t crc = crc32(0, Z_NULL, 0);
+    size = 0;
+
+    while (true) {
+        const size_t length = fs::read(file, buffer + held, sizeof(buffer) - held);
+        if (length == 0) {
+            break;
+        }
+
+        size += length;
+        held += length;
+
+        if (held > sizeof(uint32_t)) {
+            const size_t data = held - sizeof(uint32_t);
+            crc = crc32(crc, buffer, data);
+            memmove(buffer, buffer + data, sizeof(uint32_t));
+            held = sizeof(uint32_t);
+        }
+    }
+
+    uint32_t stored;
+    if (held != sizeof(uint32_t)) {
+        return false;
+    }
+
+    memcpy(&stored, buffer, sizeof(stored));
+
+    return stored == crc && fs::seek(file, 0);
+}
+
+/**
+ * Get a path relative to the font directory
+ */
+static std::string relative_path(const std::string &path, const std::string &fontdir)
+{
+    const std::string prefix = fontdir + "/";
+
+    if (path.compare(0, prefix.size(), prefix) == 0) {
+        return path.substr(prefix.size());
+    }
+
+    return path;
+}
+
+
+static bool load_from(CacheReader &reader, const std::string &fontdir, const std::vector<IndexedFile> &files,
+                      const IndexSettings &settings, FontIndexer &indexer, std::vector<std::string> &font_table,
+                      bool &times_changed)
+{
+    // Check this is a cache file in the format we understand
+    {
+        char magic[4];
+        uint16_t version;
+
+        if (!reader.read(magic) || memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+            printf("Font index cache is not recognised\n");
+            return false;
+        }
+
+        if (!reader.read(version) || version != kVersion) {
+            printf("Font index cache is version %u (expected %u)\n", version, kVersion);
+            return false;
+        }
+
+        IndexSettings saved;
+        if (!reader.read(saved.coverage_budget) || !reader.read(saved.range_budget) || !(saved == settings)) {
+            printf("Font index cache is stale: index settings changed\n");
+            return false;
+        }
+    }
+
+    // Check the font files are the same as when the cache was written
+    {
+        uint32_t count;
+        if (!reader.read(count) || count != files.size()) {
+            printf("Font index cache is stale: number of font files changed\n");
+            return false;
+        }
+
+        std::string path;
+        fs::FileInfo info;
+        uint32_t fingerprint;
+
+        for (const IndexedFile &file : files) {
+            if (!reader.read(path) || !reader.read(info.size) || !reader.read(info.mtime) || !reader.read(fingerprint)) {
+                return false;
+            }
+
+            bool same = path == relative_path(file.path, fontdir) && info.size == file.info.size;
+
+            if (same && info.mtime != file.info.mtime) {
+                // Only the time differs, as happens when files are copied: check the contents
+                same = file_fingerprint(file.path) == fingerprint;
+                times_changed = true;
+            }
+
+            if (!same) {
+                printf("Font index cache is stale: %s changed\n", file.path.c_str());
+                return false;
+            }
+        }
+    }
+
+    // Table of font paths by id
+    std::vector<std::string> table;
+    {
+        uint32_t count;
+        if (!reader.read(count) || !reader.fits(count, sizeof(uint16_t))) {
+            return false;
+        }
+
+        table.resize(count);
+
+        for (std::string &path : table) {
+            if (!reader.read(path)) {
+                return false;
+            }
+
+            path = fontdir + "/" + path;
+        }
+    }
+
+    // Codepoint ranges
+    uint32_t codepoint_count;
+    PackedRanges ranges;
+    {
+        uint32_t count, length;
+        if (!reader.read(codepoint_count) || !reader.read(count) || !reader.read(length) || !reader.fits(length, 1)) {
+            return false;
+        }
+
+        std::vector<uint8_t> data(length);
+        if (!reader.read(data.data(), length)) {
+            return false;
+        }
+
+        if (!ranges.restore(data, count)) {
+            printf("Font index cache is corrupt: bad range data\n");
+            return false;
+        }
+    }
+
+    // Fallback font lists referenced by ranges
+    std::vector<FallbackSet> fallbacks;
+    {
+        uint32_t count;
+        if (!reader.read(count) || count == 0 || !reader.fits(count, sizeof(uint8_t) + sizeof(FallbackSet::ids))) {
+            return false;
+        }
+
+        fallbacks.resize(count);
+
+        for (FallbackSet &set : fallbacks) {
+            if (!reader.read(set.count) || !reader.read(set.ids) || set.count > FallbackSet::kMaxFonts) {
+                return false;
+            }
+        }
+
+        bool valid = true;
+
+        ranges.forEach([&](const CodepointRange &range) {
+            valid = valid && range.fallback < count;
+        });
+
+        if (!valid) {
+            printf("Font index cache is corrupt: bad fallback list\n");
+            return false;
+        }
+    }
+
+    // Exact coverage
+    uint16_t coverage_planes[CoverageIndex::kNumPlanes];
+    std::vector<uint32_t> coverage_pages;
+    std::vector<uint8_t> coverage_data;
+    {
+        uint32_t count;
+        if (!reader.read(coverage_planes) || !reader.read(count) || !reader.fits(count, sizeof(uint32_t))) {
+            return false;
+        }
+
+        coverage_pages.resize(count);
+        if (!reader.read(coverage_pages.data(), count * sizeof(uint32_t))) {
+            return false;
+        }
+
+        if (!reader.read(count) || !reader.fits(count, 1)) {
+            return false;
+        }
+
+        coverage_data.resize(count);
+        if (!reader.read(coverage_data.data(), count)) {
+            return false;
+        }
+    }
+
+    if (!reader.verify()) {
+        printf("Font index cache is corrupt: checksum mismatch\n");
+        return false;
+    }
+
+    // Everything was read successfully: take the loaded data
+    // Coverage goes first, as it's only taken if its tables are consistent.
+    if (!indexer.coverage().restore(coverage_planes, coverage_pages, coverage_data)) {
+        printf("Font index cache is corrupt: bad coverage tables\n");
+        return false;
+    }
+
+    indexer.restore(ranges, fallbacks, codepoint_count, settings);
+    font_table = std::move(table);
+
+    return true;
+}
+
+namespace index_cache {
+
+const char* const kFileName = "font-index.bin";
+
+// Added to the index path while it's being written
+static const char* const kTempSuffix = ".tmp";
+
+const IndexSettings kSettings = {
+    16 * 1024, // coverage_budget: enough for nearly all lookups with the full Noto set to be exact
+    24 * 1024, // range_budget: larger means fewer faces loaded for codepoints they don't have
+};
+
+std::vector<IndexedFile> list_files(const char* fontdir)
+{
+    const std::string index_suffix = std::string("/") + kFileName;
+    const std::string temp_suffix = index_suffix + kTempSuffix;
+    std::vector<IndexedFile> files;
+
+    fs::walkdir(fontdir, [&](const char* path, const fs::FileInfo &info, uint8_t) {
+        // A temporary index is left behind if writing it was interrupted
+        if (!fs::ends_with(path, index_suffix) && !fs::ends_with(path, temp_suffix)) {
+            files.push_back({path, info});
+        }
+    });
+
+    std::sort(files.begin(), files.end(), [](const IndexedFile &a, const IndexedFile &b) {
+        return a.path < b.path;
+    });
+
+    return files;
+}
+
+bool load(const char* path, const char* fontdir, const std::vector<IndexedFile> &files,
+          const IndexSettings &settings, FontIndexer &indexer, std::vector<std::string> &font_table,
+          bool &times_changed)
+{
+    times_changed = false;
+
+    fs::File* file = fs::open(path);
+    if (file == nullptr) {
+        return false;
+    }
+
+    // Check the whole file first, so nothing read from a corrupt one is used to size allocations
+    uint32_t size;
+    if (!verify_file(file, size)) {
+        printf("Font index cache is corrupt: checksum mismatch\n");
+        fs::close(file);
+        return false;
+    }
+
+    CacheReader reader(file, size);
+    const bool success = load_from(reader, fontdir, files, settings, indexer, font_table, times_changed);
+
+    fs::close(file);
+
+    return success;
+}
+
+bool save(const char* path, const char* fontdir, const std::vector<IndexedFile> &files,
+          FontIndexer &indexer, const std::vector<std::string> &font_table)
+{
+    // Write alongside the existing index, which is only replaced once this is complete
+    const std::string temp_path = std::string(path) + kTempSuffix;
+
+    fs::File* file = fs::open(temp_path.c_str(), true);
+    if (file == nullptr) {
+        return false;
+    }
+
+    CacheWriter writer(file);
+
+    writer.write(kMagic);
+    writer.write(kVersion);
+    writer.write(indexer.settings().coverage_budget);
+    writer.write(indexer.settings().range_budget);
+
+    writer.write((uint32_t) files.size());
+    for (const IndexedFile &file : files) {
+        writer.write(relative_path(file.path, fontdir));
+        writer.write(file.info.size);
+        writer.write(file.info.mtime);
+        writer.write(file_fingerprint(file.path));
+    }
+
+    writer.write((uint32_t) font_table.size());
+    for (const std::string &font_path : font_table) {
+        writer.write(relative_path(font_path, fontdir));
+    }
+
+    const PackedRanges &ranges = indexer.packedRanges();
+    writer.write(indexer.countCodepoints());
+    writer.write(ranges.size());
+    writer.write((uint32_t) ranges.data().size());
+    writer.write(ranges.data().data(), ranges.data().size());
+
+    writer.write((uint32_t) indexer.fallbackTable().size());
+    for (const FallbackSet &set : indexer.fallbackTable()) {
+        writer.write(set.count);
+        writer.write(set.ids);
+    }
+
+    const CoverageIndex &coverage = indexer.coverage();
+    writer.write(coverage.planes(), sizeof(uint16_t) * CoverageIndex::kNumPlanes);
+    writer.write((uint32_t) coverage.pages().size());
+    writer.write(coverage.pages().data(), coverage.pages().size() * sizeof(uint32_t));
+    writer.write((uint32_t) coverage.data().size());
+    writer.write(coverage.data().data(), coverage.data().size());
+
+    writer.writeChecksum();
+
+    bool success = writer.flush();
+    success = fs::close(file) && success;
+    success = success && fs::rename(temp_path.c_str(), path);
+
+    if (!success) {
+        printf("Failed to write font index cache to %s\n", path);
+        fs::remove(temp_path.c_str());
+    }
+
+    return success;
+}
+
+}; // namespace index_cache
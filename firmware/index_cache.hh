@@ -0,0 +1,86 @@
+#pragma once
+
+#include "filesystem.hh"
+#include "font_indexer.hh"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/**
+ * A font file found in the font directory, as used to build the index
+ */
+struct IndexedFile {
+    std::string path;
+    fs::FileInfo info;
+};
+
+/**
+ * Persistent copy of the font index, stored in the font directory
+ *
+ * Building the index requires opening every font with FreeType, which takes
+ * around 30 seconds on the device with the full Noto set. The finished index is
+ * saved to disk so that later boots only need to list the font directory to
+ * check nothing has changed, then read a few tens of KB back into memory.
+ *
+ * The file records the path, size, timestamp and a fingerprint of the contents of
+ * every font file it was built from, and the settings used to compress the index:
+ * if any of these differ the cache is considered stale and is ignored. Files with
+ * a different timestamp are only read to check their fingerprint, which is only
+ * needed after copying them (eg. onto an SD card). A checksum guards against partial
+ * writes and corruption.
+ *
+ * The same file can be generated offline with the build_font_index host tool when
+ * preparing an SD card, so the first boot doesn't need to scan fonts either. The
+ * tool is built from this code, so its output is exactly what the device writes.
+ *
+ * All values are stored little-endian (native on both the Pico and x86 hosts).
+ */
+namespace index_cache {
+
+/**
+ * Name of the saved index in the font directory
+ */
+extern const char* const kFileName;
+
+/**
+ * Settings the index is compressed with on the device and by the host tool
+ * A saved index built with any other settings is treated as stale.
+ */
+extern const IndexSettings kSettings;
+
+/**
+ * List the font files in a directory (everything except the saved index)
+ *
+ * Files are in name order rather than directory order, which is the order they
+ * must be indexed in. This makes the index predictable, so it can also be
+ * generated offline.
+ */
+std::vector<IndexedFile> list_files(const char* fontdir);
+
+/**
+ * Load a saved index if it was built from exactly the passed files and settings
+ *
+ * Paths in the file are relative to fontdir.
+ * The indexer and font table are only modified if loading succeeds.
+ * Returns false if the cache is missing, unreadable or stale.
+ *
+ * times_changed is set if any file only matched by its contents. Saving the index
+ * again then records the current times, so later loads don't need to read the files.
+ */
+bool load(const char* path, const char* fontdir, const std::vector<IndexedFile> &files,
+          const IndexSettings &settings, FontIndexer &indexer, std::vector<std::string> &font_table,
+          bool &times_changed);
+
+/**
+ * Save a compressed index and font table, along with the files they were built from
+ *
+ * Paths are stored relative to fontdir. The index is written to a temporary file
+ * that replaces any existing one once complete, so a failed save leaves the old
+ * index in place. Returns false if the file could not be written.
+ */
+bool save(const char* path, const char* fontdir, const std::vector<IndexedFile> &files,
+          FontIndexer &indexer, const std::vector<std::string> &font_table);
+
+}; // namespace index_cache
@@ -0,0 +1,101 @@
+#include "io_trace.hh"
+
+// C++
+#include <string>
+#include <vector>
+
+#if !PICO_ON_DEVICE
+// Fonts are opened and read on indexing threads on the host
+#include <mutex>
+#endif
+
+
+// Stream events are logged to, or nullptr when not tracing
+static FILE* s_out = nullptr;
+
+// Paths by font id
+static std::vector<std::string> s_fonts;
+
+// Codepoint reads are currently made for
+static uint32_t s_codepoint = io_trace::kNoCodepoint;
+
+#if !PICO_ON_DEVICE
+static std::mutex s_fonts_mutex;
+#endif
+
+namespace io_trace {
+
+void start(FILE* out)
+{
+    s_out = out;
+}
+
+void stop()
+{
+    if (s_out != nullptr) {
+        fflush(s_out);
+        s_out = nullptr;
+    }
+
+    s_fonts.clear();
+    s_fonts.shrink_to_fit();
+}
+
+uint16_t open(const char* path, uint32_t size)
+{
+    if (s_out == nullptr) {
+        return kNoFont;
+    }
+
+#if !PICO_ON_DEVICE
+    std::lock_guard<std::mutex> lock(s_fonts_mutex);
+#endif
+
+    uint16_t font = 0;
+
+    while (font < s_fonts.size() && s_fonts[font] != path) {
+        font++;
+    }
+
+    if (font == s_fonts.size()) {
+        if (font == kNoFont) {
+            // Out of ids
+            return kNoFont;
+        }
+
+        s_fonts.push_back(path);
+    }
+
+    fprintf(s_out, "@io open %u %u %s\n", (unsigned) font, (unsigned) size, path);
+
+    return font;
+}
+
+void read(uint16_t font, uint32_t offset, uint32_t count)
+{
+    if (s_out == nullptr || font == kNoFont) {
+        return;
+    }
+
+    if (s_codepoint == kNoCodepoint) {
+        fprintf(s_out, "@io read %u %u %u -\n", (unsigned) font, (unsigned) offset, (unsigned) count);
+    } else {
+        fprintf(s_out, "@io read %u %u %u %X\n", (unsigned) font, (unsigned) offset, (unsigned) count, (unsigned) s_codepoint);
+    }
+}
+
+void close(uint16_t font)
+{
+    if (s_out == nullptr || font == kNoFont) {
+        return;
+    }
+
+    fprintf(s_out, "@io close %u\n", (unsigned) font);
+}
+
+void set_codepoint(uint32_t codepoint)
+{
+    s_codepoint = codepoint;
+}
+
+}; // namespace io_trace
@@ -0,0 +1,62 @@
+#pragma once
+
+// C
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Opt-in log of every read FreeType makes from a font file
+ *
+ * Reads are logged where FreeType requests them, before the block cache, so the log
+ * shows the access pattern any cache in front of the storage would see. Each read is
+ * tagged with the codepoint being drawn at the time. The log is meant to be replayed
+ * offline with scripts/replay-io-trace.py to compare caching choices.
+ *
+ * Each event is one line of text, prefixed so it can be picked out of a serial log:
+ *
+ *   @io open <font> <size> <path>
+ *   @io read <font> <offset> <count> <codepoint>
+ *   @io close <font>
+ *
+ * Font ids are assigned in the order paths are first opened, and stay the same if the
+ * font is closed and opened again. A read with a count of zero is a seek only. The
+ * codepoint is hex, or "-" when reads aren't for drawing a glyph (eg. indexing).
+ */
+namespace io_trace {
+
+static const uint16_t kNoFont = UINT16_MAX;
+static const uint32_t kNoCodepoint = UINT32_MAX;
+
+/**
+ * Start logging events to the passed stream
+ * The stream must stay open until stop() is called.
+ */
+void start(FILE* out);
+
+/**
+ * Stop logging, flushing anything written so far
+ */
+void stop();
+
+/**
+ * Log a font file being opened
+ * Returns the id to log its other events with, or kNoFont when not tracing.
+ */
+uint16_t open(const char* path, uint32_t size);
+
+/**
+ * Log a read from an open font file (count of zero for a seek only)
+ */
+void read(uint16_t font, uint32_t offset, uint32_t count);
+
+/**
+ * Log a font file being closed
+ */
+void close(uint16_t font);
+
+/**
+ * Set the codepoint that following reads are made for, or kNoCodepoint
+ */
+void set_codepoint(uint32_t codepoint);
+
+}; // namespace io_trace
@@ -1,3 +1,4 @@
+#include "io_trace.hh"
 #include "st7789.h"
 #include "ui/main_ui.hh"
 #include "usb.h"
@@ -36,6 +37,10 @@ struct st7789_config display_config ={
     .gpio_bl = PIN_DISP_BKLGHT
 };
 
+// Log every font file read to the serial console, for replay with scripts/replay-io-trace.py
+// This slows down anything that reads fonts considerably, so it's off unless measuring.
+static const bool kTraceFontIO = false;
+
 static volatile bool needs_render = true;
 struct repeating_timer render_timer;
 
@@ -336,6 +341,10 @@ int main()
     // Scroll so 0,0 in memory is actually rendered in the top-left corner
     st7789_vertical_scroll(300);
 
+    if (kTraceFontIO) {
+        io_trace::start(stdout);
+    }
+
     // Start the application (blocking until loaded)
     app.load("fonts");
 
@@ -395,6 +404,12 @@ int main()
             }
 
             app.tick();
+
+        } else if (get_input_byte() == last_input) {
+            // Prepare for likely input in the time until the next frame
+            // Once a switch moves, the neighbours being prepared are stale, so this stops until
+            // the frame reads the input. Waiting for the frame also gives the switch time to settle.
+            app.prefetch();
         }
     }
 }
@@ -0,0 +1,428 @@
+#include "packed_ranges.hh"
+#include "font_indexer.hh"
+#include "util.hh"
+
+// C++
+#include <algorithm>
+
+// C
+#include <stdio.h>
+
+
+// Last codepoint that can be looked up
+static const uint32_t kMaxCodepoint = 0x10FFFF;
+
+// Codepoints per page are 1 << kPageBits
+static const uint32_t kPageBits = 8;
+
+// Size of a block before its records
+static const uint32_t kHeaderBytes = 5;
+
+/**
+ * Bytes needed to store a font id or fallback list index
+ */
+static inline uint32_t field_bytes(uint32_t value)
+{
+    return value <= 0xFF ? 1 : 2;
+}
+
+/**
+ * Read a little-endian field of 1 or 2 bytes
+ */
+static inline uint32_t read_field(const uint8_t* pos, uint32_t bytes)
+{
+    return bytes == 1 ? pos[0] : pos[0] | (pos[1] << 8);
+}
+
+/**
+ * Sizes decoded from the start of a block
+ */
+struct BlockHeader {
+    uint32_t count;
+    uint32_t id_bytes;
+    uint32_t fallback_bytes;
+
+    // Bytes per record
+    uint32_t stride;
+
+    // Page the first range starts in, and the one every range ends in
+    uint32_t start_page;
+    uint32_t end_page;
+};
+
+/**
+ * Decode a block header, returning a pointer to the first record
+ */
+static inline const uint8_t* read_header(const uint8_t* pos, BlockHeader &header)
+{
+    header.count = (pos[0] & 0x0F) + 1;
+    header.id_bytes = ((pos[0] >> 4) & 0x1) + 1;
+    header.fallback_bytes = (pos[0] >> 5) & 0x3;
+    header.stride = 2 + header.id_bytes + header.fallback_bytes;
+    header.start_page = pos[1] | (pos[2] << 8);
+    header.end_page = pos[3] | (pos[4] << 8);
+
+    return pos + kHeaderBytes;
+}
+
+/**
+ * Decode the range in a record
+ */
+static inline void read_record(const uint8_t* records, uint32_t index, const BlockHeader &header, CodepointRange &range)
+{
+    const uint8_t* ends = records;
+    const uint8_t* starts = ends + header.count;
+    const uint8_t* ids = starts + header.count;
+    const uint8_t* fallbacks = ids + (header.count * header.id_bytes);
+
+    range.start = ((index == 0 ? header.start_page : header.end_page) << kPageBits) | starts[index];
+    range.end = (header.end_page << kPageBits) | ends[index];
+    range.id = read_field(ids + (index * header.id_bytes), header.id_bytes);
+    range.fallback = header.fallback_bytes != 0 ? read_field(fallbacks + (index * header.fallback_bytes), header.fallback_bytes) : 0;
+}
+
+PackedRanges::Layout::Layout()
+    : m_block_length(0),
+      m_max_id(0),
+      m_max_fallback(0),
+      m_bytes(0),
+      m_blocks(0) {}
+
+bool PackedRanges::Layout::add(const CodepointRange &range, std::vector<uint8_t>* out)
+{
+    if (range.start > kMaxCodepoint) {
+        // Ranges beyond the last Unicode plane can never be looked up
+        return false;
+    }
+
+    const uint32_t end = std::min(range.end, kMaxCodepoint);
+
+    if (m_block_length != 0 && ((end >> kPageBits) != (m_block[0].end >> kPageBits) || m_block_length == kBlockSize)) {
+        flush(out);
+    }
+
+    if (m_block_length == 0) {
+        m_blocks++;
+    }
+
+    m_block[m_block_length++] = {range.start, end, range.id, range.fallback};
+
+    m_max_id = std::max<uint32_t>(m_max_id, range.id);
+    m_max_fallback = std::max<uint32_t>(m_max_fallback, range.fallback);
+
+    return true;
+}
+
+void PackedRanges::Layout::flush(std::vector<uint8_t>* out)
+{
+    if (m_block_length == 0) {
+        return;
+    }
+
+    if (out != nullptr) {
+        const uint32_t id_bytes = field_bytes(m_max_id);
+        const uint32_t fallback_bytes = m_max_fallback != 0 ? field_bytes(m_max_fallback) : 0;
+        const uint32_t start_page = m_block[0].start >> kPageBits;
+        const uint32_t end_page = m_block[0].end >> kPageBits;
+
+        out->push_back((m_block_length - 1) | ((id_bytes - 1) << 4) | (fallback_bytes << 5));
+        out->push_back(start_page);
+        out->push_back(start_page >> 8);
+        out->push_back(end_page);
+        out->push_back(end_page >> 8);
+
+        for (uint32_t i = 0; i < m_block_length; i++) {
+            out->push_back(m_block[i].end);
+        }
+
+        for (uint32_t i = 0; i < m_block_length; i++) {
+            out->push_back(m_block[i].start);
+        }
+
+        for (uint32_t i = 0; i < m_block_length; i++) {
+            for (uint32_t k = 0; k < id_bytes; k++) {
+                out->push_back(m_block[i].id >> (k * 8));
+            }
+        }
+
+        for (uint32_t i = 0; i < m_block_length; i++) {
+            for (uint32_t k = 0; k < fallback_bytes; k++) {
+                out->push_back(m_block[i].fallback >> (k * 8));
+            }
+        }
+    }
+
+    m_bytes += blockBytes();
+    m_block_length = 0;
+    m_max_id = 0;
+    m_max_fallback = 0;
+}
+
+uint32_t PackedRanges::Layout::blockBytes() const
+{
+    if (m_block_length == 0) {
+        return 0;
+    }
+
+    const uint32_t fallback_bytes = m_max_fallback != 0 ? field_bytes(m_max_fallback) : 0;
+
+    return kHeaderBytes + (m_block_length * (2 + field_bytes(m_max_id) + fallback_bytes));
+}
+
+uint32_t PackedRanges::Layout::memoryUsage() const
+{
+    return m_bytes + blockBytes() + (m_blocks * sizeof(uint32_t));
+}
+
+PackedRanges::PackedRanges()
+    : m_count(0)
+{
+    for (uint16_t &offset : m_planes) {
+        offset = kNoPageTable;
+    }
+}
+
+void PackedRanges::pack(const std::vector<CodepointRange> &ranges)
+{
+    clear();
+
+    Layout layout;
+
+    for (const CodepointRange &range : ranges) {
+        if (!layout.add(range, &m_data)) {
+            break;
+        }
+
+        m_count++;
+    }
+
+    layout.flush(&m_data);
+
+    shrinkContainer(m_data);
+    buildTables();
+}
+
+bool PackedRanges::restore(std::vector<uint8_t> &data, uint32_t count)
+{
+    clear();
+
+    m_data = std::move(data);
+    m_count = count;
+
+    if (!buildTables()) {
+        clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool PackedRanges::buildTables()
+{
+    m_blocks.clear();
+    m_pages.clear();
+    for (uint16_t &offset : m_planes) {
+        offset = kNoPageTable;
+    }
+
+    // Validate every block, noting where they start and which planes have ranges
+    bool plane_used[kNumPlanes] = {};
+    {
+        const uint8_t* pos = m_data.data();
+        const uint8_t* end = pos + m_data.size();
+        uint32_t base = 0;
+        uint32_t count = 0;
+
+        while (pos != end) {
+            if ((uint32_t) (end - pos) < kHeaderBytes || (*pos & 0x80) != 0) {
+                return false;
+            }
+
+            m_blocks.push_back(pos - m_data.data());
+
+            BlockHeader header;
+            const uint8_t* record = read_header(pos, header);
+
+            if (header.fallback_bytes > 2 || header.end_page > (kMaxCodepoint >> kPageBits) ||
+                (uint32_t) (end - record) < header.count * header.stride) {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < header.count; i++) {
+                CodepointRange range;
+                read_record(record, i, header, range);
+
+                if (range.start < base || range.end < range.start || range.end > kMaxCodepoint) {
+                    // Overlapping, out of order or out of range
+                    return false;
+                }
+
+                if (range.id >= FontIndexer::kCodepointNotFound) {
+                    return false;
+                }
+
+                for (uint32_t plane = range.start >> 16; plane <= range.end >> 16; plane++) {
+                    plane_used[plane] = true;
+                }
+
+                base = range.end + 1;
+            }
+
+            pos = record + (header.count * header.stride);
+            count += header.count;
+        }
+
+        if (count != m_count) {
+            return false;
+        }
+    }
+
+    shrinkContainer(m_blocks);
+
+    if (m_data.size() >= kNoPageTable) {
+        // Block offsets don't fit in the table: lookups will search the skip index instead
+        printf("Too many ranges for a page table (%u)\n", (unsigned) m_count);
+        return true;
+    }
+
+    uint32_t num_tables = 0;
+    for (uint32_t plane = 0; plane < kNumPlanes; plane++) {
+        if (plane_used[plane]) {
+            m_planes[plane] = num_tables * kPagesPerPlane;
+            num_tables++;
+        }
+    }
+
+    // Pages after the last range point past the last block, where nothing is found
+    m_pages.resize(num_tables * kPagesPerPlane, m_data.size());
+
+    // Point each page at the first block ending in or after it
+    // Both pages and blocks are ordered, so this is a single pass over the blocks.
+    uint32_t next_page = 0;
+
+    for (uint32_t offset : m_blocks) {
+        BlockHeader header;
+        read_header(m_data.data() + offset, header);
+
+        for (; next_page <= header.end_page; next_page++) {
+            const uint32_t plane = next_page / kPagesPerPlane;
+
+            if (plane_used[plane]) {
+                m_pages[m_planes[plane] + (next_page % kPagesPerPlane)] = offset;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool PackedRanges::find(uint32_t codepoint, CodepointRange &range) const
+{
+    const uint32_t plane = codepoint >> 16;
+
+    if (plane < kNumPlanes && m_planes[plane] != kNoPageTable) {
+        const uint32_t page = (codepoint >> kPageBits) & (kPagesPerPlane - 1);
+        return findFrom(m_pages[m_planes[plane] + page], codepoint, range);
+    }
+
+    // Either there are no ranges in this plane, or no page table at all
+    return m_pages.empty() && findBySearch(codepoint, range);
+}
+
+bool PackedRanges::findBySearch(uint32_t codepoint, CodepointRange &range) const
+{
+    // Find the first block that starts after the codepoint
+    uint32_t left = 0;
+    uint32_t right = m_blocks.size();
+
+    while (left < right) {
+        const uint32_t mid = left + (right - left) / 2;
+
+        BlockHeader header;
+        const uint8_t* record = read_header(m_data.data() + m_blocks[mid], header);
+        const uint32_t start = (header.start_page << kPageBits) | record[header.count];
+
+        if (start <= codepoint) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+
+    if (left == 0) {
+        // Before the first range
+        return false;
+    }
+
+    return findFrom(m_blocks[left - 1], codepoint, range);
+}
+
+bool PackedRanges::findFrom(uint32_t offset, uint32_t codepoint, CodepointRange &range) const
+{
+    const uint8_t* pos = m_data.data() + offset;
+    const uint8_t* end = m_data.data() + m_data.size();
+
+    // Blocks for the same page follow each other if it has more than kBlockSize ranges
+    while (pos != end) {
+        BlockHeader header;
+        const uint8_t* record = read_header(pos, header);
+
+        // Ranges are ordered, so the first one ending at or after the codepoint is the
+        // only one that can contain it. That's the first range if the codepoint is in an
+        // earlier page, and none if it's in a later one.
+        const uint32_t page_start = header.end_page << kPageBits;
+        const uint32_t low = std::min(std::max(codepoint, page_start) - page_start, (uint32_t) 0x100);
+
+        for (uint32_t i = 0; i < header.count; i++) {
+            if (record[i] >= low) {
+                read_record(record, i, header, range);
+                return range.start <= codepoint;
+            }
+        }
+
+        pos = record + (header.count * header.stride);
+    }
+
+    return false;
+}
+
+void PackedRanges::forEach(const std::function<void(const CodepointRange &range)> &callback) const
+{
+    CodepointRange range;
+
+    for (uint32_t offset : m_blocks) {
+        BlockHeader header;
+        const uint8_t* record = read_header(m_data.data() + offset, header);
+
+        for (uint32_t i = 0; i < header.count; i++) {
+            read_record(record, i, header, range);
+            callback(range);
+        }
+    }
+}
+
+void PackedRanges::clear()
+{
+    m_data.clear();
+    m_blocks.clear();
+    m_pages.clear();
+    m_count = 0;
+
+    shrinkContainer(m_data);
+    shrinkContainer(m_blocks);
+    shrinkContainer(m_pages);
+
+    for (uint16_t &offset : m_planes) {
+        offset = kNoPageTable;
+    }
+}
+
+uint32_t PackedRanges::memoryUsage() const
+{
+    return m_data.size() + (m_blocks.size() * sizeof(uint32_t));
+}
+
+uint32_t PackedRanges::pageTableUsage() const
+{
+    return (m_pages.size() * sizeof(uint16_t)) + sizeof(m_planes);
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include <stdint.h>
+
+struct CodepointRange;
+
+/**
+ * Compact read-only storage for an ordered list of codepoint ranges
+ *
+ * FontIndexer builds its index as an array of CodepointRange structs, which is
+ * simple to merge but costs 12 bytes per range once padded. After compression
+ * the ranges never change, so they're stored here in blocks of up to kBlockSize
+ * ranges that all end in the same page of 256 codepoints:
+ *
+ *   uint8   number of ranges - 1 (bits 0-3), font id bytes - 1 (bit 4),
+ *           fallback list index bytes (bits 5-6, zero if no range has one)
+ *   uint16  page the first range starts in
+ *   uint16  page every range in the block ends in
+ *   uint8   low byte of the end of each range
+ *   uint8   low byte of the start of each range (ranges after the first start
+ *           in the end page)
+ *   uint8[] font id of each range
+ *   uint8[] fallback list index of each range (0 for none)
+ *
+ * Multi-byte values are little-endian. Most ranges pack into 3 or 4 bytes, and font
+ * ids only take a second byte in blocks that need one.
+ *
+ * Every field in a block is a fixed size, so lookups scan the end bytes for the first
+ * range ending at or after the codepoint and read only that range, instead of
+ * decoding the ranges before it. A skip index holds the offset of each block.
+ *
+ * Lookups use a two-level page table: each Unicode plane that contains ranges
+ * gets a table with one entry per page, holding the offset of the first block with ranges
+ * ending in or after that page. Lookups then only need to check the one or two
+ * ranges around a page instead of searching all of them. This costs 512 bytes per
+ * plane in use (typically 2KB for the Noto set).
+ */
+class PackedRanges
+{
+public:
+    // Maximum number of ranges in a block
+    static const uint32_t kBlockSize = 16;
+
+    /**
+     * Lays out blocks in order, as pack() does
+     *
+     * This can be used without an output to find what a list of ranges would cost
+     * to pack before building it (see FontIndexer::compressRanges()).
+     */
+    class Layout
+    {
+    public:
+        Layout();
+
+        /**
+         * Add the next range, appending the block before it to out (if not null) when
+         * the range starts a new block
+         * Returns false if the range is beyond the last codepoint and can't be stored.
+         */
+        bool add(const CodepointRange &range, std::vector<uint8_t>* out);
+
+        /**
+         * Encode the block still being built, appending it to out if not null
+         * This must be called after the last range is added.
+         */
+        void flush(std::vector<uint8_t>* out);
+
+        /**
+         * The memoryUsage() of the ranges added so far
+         */
+        uint32_t memoryUsage() const;
+
+    private:
+
+        /**
+         * Size of the block being built in bytes
+         */
+        uint32_t blockBytes() const;
+
+        struct Record {
+            uint32_t start;
+            uint32_t end;
+            uint32_t id;
+            uint32_t fallback;
+        };
+
+        // Ranges in the block being built, which all end in the same page
+        Record m_block[kBlockSize];
+        uint32_t m_block_length;
+
+        // Widest font id and fallback list index in the block being built
+        uint32_t m_max_id;
+        uint32_t m_max_fallback;
+
+        // Size of the blocks already encoded, and the number of blocks including the current one
+        uint32_t m_bytes;
+        uint32_t m_blocks;
+    };
+
+    PackedRanges();
+
+    /**
+     * Replace the contents with the passed ordered, non-overlapping ranges
+     */
+    void pack(const std::vector<CodepointRange> &ranges);
+
+    /**
+     * Replace the contents with data previously read from data()
+     *
+     * The data is fully decoded to rebuild the skip index and page table. Returns
+     * false (leaving this empty) if it doesn't decode to exactly the passed number
+     * of ordered ranges. The passed vector is consumed by this call.
+     */
+    bool restore(std::vector<uint8_t> &data, uint32_t count);
+
+    /**
+     * Find the range containing a codepoint
+     * Returns false if no range contains the codepoint
+     */
+    bool find(uint32_t codepoint, CodepointRange &range) const;
+
+    /**
+     * Decode every range in order
+     */
+    void forEach(const std::function<void(const CodepointRange &range)> &callback) const;
+
+    /**
+     * Free all storage
+     */
+    void clear();
+
+    inline uint32_t size() const
+    {
+        return m_count;
+    }
+
+    inline bool empty() const
+    {
+        return m_count == 0;
+    }
+
+    inline const std::vector<uint8_t>& data() const
+    {
+        return m_data;
+    }
+
+    /**
+     * Memory used by the records and skip index in bytes
+     */
+    uint32_t memoryUsage() const;
+
+    /**
+     * Memory used by the page table in bytes
+     */
+    uint32_t pageTableUsage() const;
+
+private:
+
+    /**
+     * Validate m_data, record the start of each block and build the page table
+     * Returns false if the data doesn't decode to m_count ordered ranges.
+     */
+    bool buildTables();
+
+    /**
+     * Search the skip index for the last block starting at or before a codepoint
+     * This is only used if there are too many blocks for the page table.
+     */
+    bool findBySearch(uint32_t codepoint, CodepointRange &range) const;
+
+    /**
+     * Find the range containing a codepoint, searching from the block at an offset
+     * into m_data
+     */
+    bool findFrom(uint32_t offset, uint32_t codepoint, CodepointRange &range) const;
+
+    // Number of Unicode planes, and the pages of 256 codepoints they're split into
+    static const uint32_t kNumPlanes = 17;
+    static const uint32_t kPagesPerPlane = 256;
+
+    // Marker for planes with no page table, as they have no ranges
+    static const uint16_t kNoPageTable = std::numeric_limits<uint16_t>::max();
+
+    // Encoded ranges
+    std::vector<uint8_t> m_data;
+    uint32_t m_count;
+
+    // Offset into m_data of the first record in each block
+    std::vector<uint32_t> m_blocks;
+
+    // Offset into m_pages of each plane's table, or kNoPageTable
+    uint16_t m_planes[kNumPlanes];
+
+    // Page tables for each plane that has ranges: offset into m_data of the first
+    // block with ranges that end in or after each page (or its size if none do).
+    std::vector<uint16_t> m_pages;
+};
@@ -0,0 +1,70 @@
+#include "ui/blend_table.hh"
+
+// C
+#include <stdio.h>
+
+
+static BlendTable s_tables[BlendTable::kCachedTables];
+
+// Table to replace when the next colour pair is built
+static uint32_t s_next_table = 0;
+
+static struct {
+    // Tables requested, and tables that had to be built
+    uint32_t lookups = 0;
+    uint32_t builds = 0;
+} s_stats;
+
+const BlendTable& BlendTable::get(uint32_t colour, uint32_t background)
+{
+    colour &= 0xFFFFFF;
+    background &= 0xFFFFFF;
+
+    s_stats.lookups++;
+
+    for (const BlendTable &table : s_tables) {
+        if (table.m_valid && table.m_colour == colour && table.m_background == background) {
+            return table;
+        }
+    }
+
+    // Replace the oldest table
+    BlendTable &table = s_tables[s_next_table];
+    s_next_table = (s_next_table + 1) % kCachedTables;
+
+    table.build(colour, background);
+    s_stats.builds++;
+
+    return table;
+}
+
+void BlendTable::build(uint32_t colour, uint32_t background)
+{
+    const uint8_t pen_r = colour >> 16;
+    const uint8_t pen_g = colour >> 8;
+    const uint8_t pen_b = colour;
+
+    const uint8_t bg_r = background >> 16;
+    const uint8_t bg_g = background >> 8;
+    const uint8_t bg_b = background;
+
+    // Same blend the span rasterisers used to work out per span
+    for (uint32_t coverage = 0; coverage < 256; coverage++) {
+        m_pixels[coverage][0] = ((coverage * pen_r) + ((255 - coverage) * bg_r)) >> 8;
+        m_pixels[coverage][1] = ((coverage * pen_g) + ((255 - coverage) * bg_g)) >> 8;
+        m_pixels[coverage][2] = ((coverage * pen_b) + ((255 - coverage) * bg_b)) >> 8;
+    }
+
+    m_colour = colour;
+    m_background = background;
+    m_valid = true;
+}
+
+void BlendTable::printStats()
+{
+    printf("UI text blending: %u tables built for %u draws (%u colour pairs kept, %u bytes)\n",
+        (unsigned) s_stats.builds,
+        (unsigned) s_stats.lookups,
+        (unsigned) kCachedTables,
+        (unsigned) sizeof(s_tables));
+}
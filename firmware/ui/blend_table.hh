@@ -0,0 +1,48 @@
+#pragma once
+
+// C
+#include <stdint.h>
+
+/**
+ * Pen colour blended with a background colour at every level of coverage
+ *
+ * Antialiased text is drawn by blending the pen and background colours by each span's
+ * coverage, which is three multiply-adds per span or pixel. UI text only uses a few
+ * colour pairs, so the blend is worked out once for all 256 coverage values of a pair,
+ * and drawing looks up the finished pixel instead.
+ *
+ * Tables for the most recently used pairs are kept, so most draws don't build one.
+ */
+class BlendTable {
+public:
+
+    // Colour pairs kept at once
+    // The views each draw with up to about six, so switching views rebuilds a few.
+    static const uint32_t kCachedTables = 6;
+
+    /**
+     * Get the table for a pen and background colour (0xRRGGBB), building it if needed
+     * The table stays valid until tables for kCachedTables other colour pairs are built.
+     */
+    static const BlendTable& get(uint32_t colour, uint32_t background);
+
+    /**
+     * Blended RGB pixel (3 bytes) for a coverage value
+     */
+    inline const uint8_t* pixel(uint8_t coverage) const
+    {
+        return m_pixels[coverage];
+    }
+
+    static void printStats();
+
+private:
+
+    void build(uint32_t colour, uint32_t background);
+
+    uint32_t m_colour;
+    uint32_t m_background;
+    bool m_valid;
+
+    uint8_t m_pixels[256][3];
+};
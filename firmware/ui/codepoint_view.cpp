@@ -2,6 +2,13 @@
 
 #include "st7789.h"
 #include "unicode_db.hh"
+#include "util.hh"
+
+// Also render prefetched glyphs into spare glyph cache space, not just open their fonts
+static const bool kPrefetchGlyphs = true;
+
+// Number of input switches, each giving a neighbouring codepoint to prefetch
+static const uint8_t kNumSwitches = 8;
 
 CodepointView::CodepointView(FontStore& fontstore)
     : m_title_display(fontstore),
@@ -17,6 +24,10 @@ void CodepointView::set_low_byte(uint8_t value)
     m_codepoint |= value;
 
     m_dirty = true;
+
+    if (m_codepoint != previous) {
+        m_input_time = timestamp_us();
+    }
 }
 
 void CodepointView::shift()
@@ -76,10 +87,24 @@ void CodepointView::render() {
             const char* block_name = uc_get_block_name(m_codepoint);
             const char* codepoint_name = uc_get_codepoint_name(m_codepoint);
             const bool is_valid = block_name != nullptr;
+            const bool prefetched = was_prefetched();
             
             m_glyph_display.draw(m_codepoint, is_valid);
             m_title_display.update_labels(block_name, codepoint_name);
 
+            if (m_input_time != 0) {
+                const uint32_t latency = timestamp_us() - m_input_time;
+                m_input_time = 0;
+
+                if (prefetched) {
+                    m_prefetch_stats.hits++;
+                    m_prefetch_stats.hit_latency_us += latency;
+                } else {
+                    m_prefetch_stats.misses++;
+                    m_prefetch_stats.miss_latency_us += latency;
+                }
+            }
+
             m_last_codepoint = m_codepoint;
         }
 
@@ -179,4 +204,55 @@ void CodepointView::clear()
     m_mode_bar_draw.blank_and_invalidate();
 
     m_last_codepoint = kInvalidEncoding;
-}
\ No newline at end of file
+}
+
+bool CodepointView::prefetch()
+{
+    if (m_dirty) {
+        // Input is waiting to be drawn
+        return false;
+    }
+
+    if (m_prefetch_base != m_codepoint) {
+        // Start over around the new codepoint
+        m_prefetch_base = m_codepoint;
+        m_prefetch_bit = 0;
+        m_prefetch_done = 0;
+    }
+
+    if (m_prefetch_bit == kNumSwitches) {
+        return false;
+    }
+
+    const uint8_t mask = 1 << m_prefetch_bit++;
+
+    m_glyph_display.prefetch(m_codepoint ^ mask, kPrefetchGlyphs);
+    m_prefetch_done |= mask;
+    m_prefetch_stats.prefetched++;
+
+    return m_prefetch_bit != kNumSwitches;
+}
+
+bool CodepointView::was_prefetched() const
+{
+    const uint32_t flipped = m_codepoint ^ m_prefetch_base;
+
+    // Exactly one switch changed, and its neighbour was done
+    return flipped <= 0xFF && (flipped & (flipped - 1)) == 0 && (m_prefetch_done & flipped) != 0;
+}
+
+void CodepointView::print_stats()
+{
+    const PrefetchStats &stats = m_prefetch_stats;
+    const uint32_t total = stats.hits + stats.misses;
+
+    printf("Prefetch: %u neighbours prepared, %u of %u glyphs input were prefetched (%u%%)\n",
+        (unsigned) stats.prefetched,
+        (unsigned) stats.hits,
+        (unsigned) total,
+        (unsigned) (total != 0 ? (stats.hits * 100) / total : 0));
+
+    printf("Prefetch input-to-glyph latency: %u us average when prefetched, %u us otherwise\n",
+        (unsigned) (stats.hits != 0 ? stats.hit_latency_us / stats.hits : 0),
+        (unsigned) (stats.misses != 0 ? stats.miss_latency_us / stats.misses : 0));
+}
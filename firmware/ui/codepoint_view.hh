@@ -22,10 +22,17 @@ public:
     const std::vector<uint32_t> get_codepoints() override;
     std::vector<uint8_t> get_buffer() override;
     void clear() override;
+    bool prefetch() override;
+    void print_stats() override;
 
 private:
     void render_input_feedback();
 
+    /**
+     * Check if the current codepoint was prefetched before it was input
+     */
+    bool was_prefetched() const;
+
 private: // View state
 
     enum DisplayMode {
@@ -42,6 +49,33 @@ private: // View state
 
     DisplayMode m_mode = DisplayMode::kMode_Hex;
 
+private: // Prefetch state
+
+    struct PrefetchStats {
+        // Glyph changes from switch input where the new codepoint was prefetched, or wasn't
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+        // Total time from switch input to the glyph being drawn, in microseconds
+        uint64_t hit_latency_us = 0;
+        uint64_t miss_latency_us = 0;
+
+        // Neighbouring codepoints prepared
+        uint32_t prefetched = 0;
+    };
+
+    // Codepoint whose single-bit neighbours are being prefetched
+    uint32_t m_prefetch_base = kInvalidEncoding;
+
+    // Next switch to prefetch for, and the switches already done
+    uint8_t m_prefetch_bit = 0;
+    uint8_t m_prefetch_done = 0;
+
+    // Time of the last switch input that hasn't been drawn yet, or zero
+    uint32_t m_input_time = 0;
+
+    PrefetchStats m_prefetch_stats;
+
 private: // Drawing state
 
     CodepointTitle m_title_display;
@@ -3,6 +3,7 @@
 #include "st7789.h"
 #include "ui/font.hh"
 #include "unicode_db.hh"
+#include "util.hh"
 
 #include <algorithm>
 
@@ -112,8 +113,13 @@ void UIRect::diff_blank(UIRect &next, uint8_t fill)
 // ScrollingLabel
 //
 
+// Most memory a label's strip may use
+// This is about 500px of text at the title's size: longer text is drawn as it scrolls instead.
+static const uint32_t kMaxStripBytes = 12 * 1024;
+
 ScrollingLabel::ScrollingLabel()
-    : m_str(nullptr) {}
+    : m_str(nullptr),
+      m_strip_height(0) {}
 
 ScrollingLabel::ScrollingLabel(const char* text, int y, int padding)
     : m_str(text),
@@ -121,7 +127,8 @@ ScrollingLabel::ScrollingLabel(const char* text, int y, int padding)
       m_padding(padding),
       m_tick(0),
       m_next_tick(0),
-      m_state(ScrollingLabel::kState_New) {}
+      m_state(ScrollingLabel::kState_New),
+      m_strip_height(0) {}
 
 void ScrollingLabel::replace(const char* text)
 {
@@ -129,12 +136,19 @@ void ScrollingLabel::replace(const char* text)
     m_tick = 0;
     m_next_tick = 0;
     m_state = ScrollingLabel::kState_New;
+
+    // The new text is rasterised once it starts scrolling
+    m_strip.clear();
+    shrinkContainer(m_strip);
 }
 
 void ScrollingLabel::clear()
 {
     m_last_draw.blank_and_invalidate();
     m_str = nullptr;
+
+    m_strip.clear();
+    shrinkContainer(m_strip);
 }
 
 void ScrollingLabel::render(UIFontPen &pen)
@@ -175,6 +189,13 @@ void ScrollingLabel::render(UIFontPen &pen)
                 m_tick++;
             } else {
                 m_state = ScrollingLabel::kState_Animating;
+
+                // Text is often replaced before it starts moving, so it's only rasterised
+                // in full once it's certain to be scrolled
+                if (m_strip.empty()) {
+                    pen.move_to(m_x, m_y);
+                    m_strip_height = pen.render_strip(m_str, m_width, kMaxStripBytes, m_strip);
+                }
             }
 
             break;
@@ -226,11 +247,18 @@ void ScrollingLabel::render(UIFontPen &pen)
 
     if (needs_render) {
         pen.move_to(m_x, m_y);
-        UIRect rect(pen.draw(m_str, m_width));
 
-        m_last_draw.diff_blank(rect);
+        if (!m_strip.empty()) {
+            // Copy from the strip, blanking what's left of the last frame in the same write
+            m_last_draw = pen.draw_strip(m_strip, m_width, m_strip_height, m_last_draw);
 
-        m_last_draw = rect;
+        } else {
+            UIRect rect(pen.draw(m_str, m_width));
+
+            m_last_draw.diff_blank(rect);
+
+            m_last_draw = rect;
+        }
     }
 }
 
@@ -1,5 +1,9 @@
 #pragma once
 
+// C++
+#include <vector>
+
+// C
 #include <stdint.h>
 
 // Forward declarations
@@ -65,6 +69,9 @@ struct UIRect {
 
 /**
  * Line of text that automatically scrolls if too wide to fit on screen
+ *
+ * Text that scrolls is rasterised once into a strip in memory when it starts moving, so
+ * each frame of the animation only copies the visible part of the strip to screen.
  */
 class ScrollingLabel {
 public:
@@ -118,6 +125,11 @@ private:
     AnimationState m_state;
 
     UIRect m_last_draw;
+
+    // Coverage of the text when it scrolls (see UIFontPen::render_strip)
+    // This is empty if the text doesn't scroll or didn't fit in the memory allowed.
+    std::vector<uint8_t> m_strip;
+    uint16_t m_strip_height;
 };
 
 /**
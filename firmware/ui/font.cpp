@@ -1,9 +1,14 @@
+#include "cmap_reader.hh"
 #include "embeds.hh"
 #include "filesystem.hh"
 #include "font.hh"
 #include "st7789.h"
+#include "ui/blend_table.hh"
+#include "ui/frame_arena.hh"
 
 // FreeType
+#include <freetype/ftglyph.h>
+#include <freetype/ftmodapi.h>
 #include <freetype/ftoutln.h>
 #include <freetype/internal/ftobjs.h>
 #include <freetype/internal/ftstream.h>
@@ -13,6 +18,7 @@
 // C++
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -21,22 +27,101 @@
 #include <string.h>
 
 
-FontStore::FontStore()
-    : m_face(nullptr),
-      m_active_id(-1)
+// Cache face ids: registered fonts use their id + 1, as face ids can't be null, and
+// the embedded UI fonts are numbered after the largest possible font id
+static const uintptr_t kUIFontSans = (uintptr_t) FontIndexer::kCodepointNotFound + 1;
+static const uintptr_t kUIFontMono = kUIFontSans + 1;
+
+static inline FTC_FaceID font_face_id(uint32_t id)
+{
+    return (FTC_FaceID) (uintptr_t) (id + 1);
+}
+
+/**
+ * Stored in front of each FreeType allocation to track its size
+ * This keeps the alignment malloc would have given the allocation.
+ */
+union AllocationHeader {
+    size_t size;
+    std::max_align_t align;
+};
+
+FontStore::FontStore(uint32_t face_budget, uint32_t cache_budget, uint32_t resident_budget,
+                     uint32_t text_atlas_budget)
+    : m_heap_used(0),
+      m_heap_library(0),
+      m_cache_budget(cache_budget),
+      m_ui_heap_used(0),
+      m_face_budget(face_budget),
+      m_resident_budget(resident_budget),
+      m_resident_used(0),
+      m_text_atlas(text_atlas_budget)
 {
-    FT_Error error = FT_Init_FreeType(&m_ft_library);
+    for (ResolvedCodepoint &resolved : m_resolved) {
+        resolved.codepoint = std::numeric_limits<uint32_t>::max();
+    }
+
+    // Equivalent to FT_Init_FreeType, but with memory functions that track heap use
+    m_ft_memory.user = this;
+    m_ft_memory.alloc = &FontStore::ftAlloc;
+    m_ft_memory.free = &FontStore::ftFree;
+    m_ft_memory.realloc = &FontStore::ftRealloc;
+
+    FT_Error error = FT_New_Library(&m_ft_memory, &m_ft_library);
+    if (error) {
+        printf("FATAL (%s): FT_New_Library error: 0x%02X\n", __func__, error);
+        abort();
+    }
+
+    FT_Add_Default_Modules(m_ft_library);
+    FT_Set_Default_Properties(m_ft_library);
+
+    error = FTC_Manager_New(m_ft_library, kMaxCachedFaces, kMaxCachedSizes, cache_budget,
+                            &FontStore::requestFace, this, &m_cache);
+    if (error) {
+        printf("FATAL (%s): FTC_Manager_New error: 0x%02X\n", __func__, error);
+        abort();
+    }
+
+    error = FTC_ImageCache_New(m_cache, &m_images);
     if (error) {
-        printf("FATAL (%s): FT_Init_FreeType error: 0x%02X\n", __func__, error);
+        printf("FATAL (%s): FTC_ImageCache_New error: 0x%02X\n", __func__, error);
         abort();
     }
+
+    // Only memory used on top of this counts towards the budgets
+    m_heap_library = m_heap_used;
+
+    error = FTC_Manager_New(m_ft_library, kMaxUIFaces, kMaxUISizes, kUIGlyphCacheBudget,
+                            &FontStore::requestFace, this, &m_ui_cache);
+    if (error) {
+        printf("FATAL (%s): FTC_Manager_New error: 0x%02X\n", __func__, error);
+        abort();
+    }
+
+    error = FTC_ImageCache_New(m_ui_cache, &m_ui_images);
+    if (error) {
+        printf("FATAL (%s): FTC_ImageCache_New error: 0x%02X\n", __func__, error);
+        abort();
+    }
+
+    m_ui_heap_used = m_heap_used - m_heap_library;
 }
 
 FontStore::~FontStore()
 {
-    FT_Error error = FT_Done_FreeType(m_ft_library);
+    // Closes all faces and frees cached glyphs
+    FTC_Manager_Done(m_cache);
+    FTC_Manager_Done(m_ui_cache);
+
+    // Only safe to release once no face is reading from them
+    for (ResidentFont &font : m_resident) {
+        free(font.data);
+    }
+
+    FT_Error error = FT_Done_Library(m_ft_library);
     if (error) {
-        printf("FATAL (%s): FT_Done_FreeType error: 0x%02X\n", __func__, error);
+        printf("FATAL (%s): FT_Done_Library error: 0x%02X\n", __func__, error);
         abort();
     }
 }
@@ -48,87 +133,690 @@ void noop_destroy_func(void *user_data)
 
 FT_Face FontStore::loadFaceByCodepoint(uint32_t codepoint)
 {
-    uint32_t id = m_indexer.find(codepoint);
+    CodepointRange range;
 
-    if (id == 0xFFFF) {
+    if (!m_indexer.findRange(codepoint, range)) {
         // No glyph available
         return nullptr;
     }
 
-    return loadFace(id);
+    // The range table over-reports after compression, so check the exact coverage
+    // before paying for a font load that can't produce a glyph
+    switch (m_indexer.coverage().test(codepoint)) {
+        case CoverageIndex::kAbsent:
+            m_stats.coverage_absent++;
+
+            if (!isFaceOpen(range.id)) {
+                m_stats.loads_avoided++;
+            }
+
+            return nullptr;
+
+        case CoverageIndex::kPresent:
+            m_stats.coverage_present++;
+            break;
+
+        case CoverageIndex::kUnknown:
+            m_stats.coverage_unknown++;
+            break;
+    }
+
+    // Use the font found last time this codepoint was looked up, if any
+    ResolvedCodepoint &resolved = m_resolved[codepoint % kResolvedCacheSize];
+
+    if (resolved.codepoint == codepoint) {
+        if (resolved.id == FontIndexer::kCodepointNotFound) {
+            return nullptr;
+        }
+
+        return loadFace(resolved.id);
+    }
+
+    // Try the indexed font, then any fallbacks for the range until one has the glyph
+    uint16_t found_id = FontIndexer::kCodepointNotFound;
+    bool load_failed = false;
+
+    GlyphCheck check = checkGlyph(range.id, codepoint);
+
+    if (check == kGlyph_Present) {
+        found_id = range.id;
+
+    } else {
+        load_failed = check == kGlyph_LoadFailed;
+
+        const FallbackSet &fallbacks = m_indexer.fallbacks(range);
+
+        for (uint32_t i = 0; i < fallbacks.count; i++) {
+            if (fallbacks.ids[i] == range.id) {
+                continue;
+            }
+
+            check = checkGlyph(fallbacks.ids[i], codepoint);
+
+            if (check == kGlyph_Present) {
+                found_id = fallbacks.ids[i];
+                m_stats.fallbacks_used++;
+                break;
+            }
+
+            load_failed |= check == kGlyph_LoadFailed;
+        }
+    }
+
+    if (found_id == FontIndexer::kCodepointNotFound) {
+        if (load_failed) {
+            // A font that couldn't be opened may still have the glyph (eg. after running out
+            // of memory), so this isn't remembered and every font is tried again next time
+            m_stats.lookups_failed++;
+            return nullptr;
+        }
+
+        resolved.codepoint = codepoint;
+        resolved.id = FontIndexer::kCodepointNotFound;
+
+        m_stats.glyphs_missing++;
+        return nullptr;
+    }
+
+    resolved.codepoint = codepoint;
+    resolved.id = found_id;
+
+    return loadFace(found_id);
 }
 
-FT_Face FontStore::loadFace(uint32_t id)
+FontStore::GlyphCheck FontStore::checkGlyph(uint32_t id, uint32_t codepoint)
 {
-    if (id == m_active_id) {
-        // Already loaded: no action required
-        return m_face;
+    FT_Face face = loadFace(id);
+
+    if (face == nullptr) {
+        return kGlyph_LoadFailed;
     }
 
-    UIFontPen::unload_shared();
-    unloadFace();
+    return FT_Get_Char_Index(face, codepoint) != 0 ? kGlyph_Present : kGlyph_Absent;
+}
 
-    if (id > m_font_table.size()) {
+FT_Face FontStore::loadFace(uint32_t id)
+{
+    if (id >= m_font_table.size()) {
         printf("Error: request to load out of bounds font: id %d\n", id);
         return nullptr;
     }
 
-    const char* path = m_font_table.at(id).c_str();
+    // May read the font into memory, closing it first if it was opened from disk
+    trackUse(id);
+
+    const FTC_FaceID face_id = font_face_id(id);
+    const uint32_t misses = m_stats.face_misses + m_stats.resident_opens;
+
+    FT_Face face;
+    FT_Error error = FTC_Manager_LookupFace(m_cache, face_id, &face);
+
+    // Close other fonts to make room if there wasn't enough memory to open this one
+    // Fonts held in memory are allocated outside FreeType, so they're released next, with
+    // this font last as it can still be opened from disk with only a read cache.
+    while (error == FT_Err_Out_Of_Memory) {
+        if (evictFace(face_id, false)) {
+            m_stats.face_evictions_oom++;
+        } else if (dropLowestResident(face_id) || dropLowestResident(nullptr)) {
+            m_stats.resident_drops++;
+        } else {
+            break;
+        }
+
+        error = FTC_Manager_LookupFace(m_cache, face_id, &face);
+    }
+
+    const auto open = std::find(m_open_fonts.begin(), m_open_fonts.end(), id);
+    if (open != m_open_fonts.end()) {
+        m_open_fonts.erase(open);
+    }
 
-    FT_Error error = fs::load_face(path, m_ft_library, &m_face);
     if (error) {
-        printf("Error loading '%s': FreeType error 0x%02X\n", path, error);
-        m_face = nullptr;
+        // Already reported by requestFace()
+        return nullptr;
+    }
+
+    if (m_stats.face_misses + m_stats.resident_opens == misses) {
+        m_stats.face_hits++;
+    }
+
+    // Now the most recently used font
+    m_open_fonts.push_back(id);
+
+    if (m_open_fonts.size() > kMaxOpenFonts && evictFace(nullptr, true)) {
+        m_stats.face_evictions++;
+    }
+
+    // Faces grow after opening (eg. sizes and glyph slots), so this is checked on every load
+    trimFaces();
+
+    return face;
+}
+
+FT_Error FontStore::requestFace(FTC_FaceID face_id, FT_Library library, FT_Pointer data, FT_Face* face)
+{
+    using namespace assets;
+
+    FontStore* store = (FontStore*) data;
+    const uintptr_t key = (uintptr_t) face_id;
+
+    FT_Error error;
+
+    if (isUIFace(face_id)) {
+        store->m_stats.ui_face_opens++;
+
+        if (key == kUIFontSans) {
+            error = FT_New_Memory_Face(library, opensans_ttf, opensans_ttf_end - opensans_ttf, 0, face);
+        } else {
+            error = FT_New_Memory_Face(library, notomono_otf, notomono_otf_end - notomono_otf, 0, face);
+        }
+
+        if (error) {
+            printf("Error: Embedded font load Failed: 0x%02X\n", error);
+        }
+
     } else {
-        m_active_id = id;
+        const char* path = store->m_font_table.at(key - 1).c_str();
+        ResidentFont* resident = store->findTracked(key - 1);
+
+        if (resident != nullptr && resident->data != nullptr) {
+            store->m_stats.resident_opens++;
+            error = FT_New_Memory_Face(library, resident->data, resident->size, 0, face);
+
+        } else {
+            store->m_stats.face_misses++;
+            error = fs::load_face(path, library, face);
+
+            if (!error && resident != nullptr) {
+                // Now known to be small enough to hold in memory or not
+                resident->size = (*face)->stream->size;
+            }
+        }
+
+        if (error) {
+            printf("Error loading '%s': FreeType error 0x%02X\n", path, error);
+        }
+    }
+
+    if (!error) {
+        // Allows faceId() to find which cache entry a face belongs to
+        (*face)->generic.data = face_id;
     }
 
-    return m_face;
+    return error;
+}
+
+bool FontStore::isUIFace(FTC_FaceID face_id)
+{
+    const uintptr_t key = (uintptr_t) face_id;
+    return key == kUIFontSans || key == kUIFontMono;
+}
+
+FT_Error FontStore::lookupSize(FTC_Scaler scaler, FT_Size* size)
+{
+    if (isUIFace(scaler->face_id)) {
+        // Anything allocated or freed here belongs to the UI cache
+        const uint32_t heap_before = m_heap_used;
+        const FT_Error error = FTC_Manager_LookupSize(m_ui_cache, scaler, size);
+        m_ui_heap_used += m_heap_used - heap_before;
+
+        // Sizes are new to the cache until they're marked as seen
+        if (!error && (*size)->generic.data == nullptr) {
+            (*size)->generic.data = scaler->face_id;
+            m_stats.ui_sizes_created++;
+        }
+
+        return error;
+    }
+
+    FT_Error error = FTC_Manager_LookupSize(m_cache, scaler, size);
+
+    while (error == FT_Err_Out_Of_Memory && evictFace(scaler->face_id, true)) {
+        m_stats.face_evictions_oom++;
+        error = FTC_Manager_LookupSize(m_cache, scaler, size);
+    }
+
+    return error;
+}
+
+FT_Error FontStore::lookupUIFace(FTC_FaceID face_id, FT_Face* face)
+{
+    const uint32_t heap_before = m_heap_used;
+    const FT_Error error = FTC_Manager_LookupFace(m_ui_cache, face_id, face);
+    m_ui_heap_used += m_heap_used - heap_before;
+
+    return error;
+}
+
+FT_Error FontStore::lookupGlyph(FTC_Scaler scaler, FT_Int32 load_flags, FT_UInt glyph_index, FT_Glyph* glyph)
+{
+    if (isUIFace(scaler->face_id)) {
+        // The image cache would set up the size itself, but this counts it
+        FT_Size size;
+        FT_Error error = lookupSize(scaler, &size);
+        if (error) {
+            return error;
+        }
+
+        const uint32_t heap_before = m_heap_used;
+        error = FTC_ImageCache_LookupScaler(m_ui_images, scaler, load_flags, glyph_index, glyph, nullptr);
+        m_ui_heap_used += m_heap_used - heap_before;
+
+        return error;
+    }
+
+    // The image cache already flushes its own glyphs when memory runs out
+    FT_Error error = FTC_ImageCache_LookupScaler(m_images, scaler, load_flags, glyph_index, glyph, nullptr);
+
+    while (error == FT_Err_Out_Of_Memory && evictFace(scaler->face_id, true)) {
+        m_stats.face_evictions_oom++;
+        error = FTC_ImageCache_LookupScaler(m_images, scaler, load_flags, glyph_index, glyph, nullptr);
+    }
+
+    return error;
+}
+
+void FontStore::trimFaces()
+{
+    // Glyphs are limited by the cache itself, so they're allowed for here
+    // Open font files and their read caches are allocated outside FreeType, but are held for as long as their faces.
+    while (m_heap_used - m_heap_library - m_ui_heap_used + fs::open_font_bytes() > m_face_budget + m_cache_budget &&
+           evictFace(nullptr, true)) {
+        m_stats.face_evictions++;
+    }
+}
+
+bool FontStore::isFaceOpen(uint32_t id)
+{
+    return std::find(m_open_fonts.begin(), m_open_fonts.end(), id) != m_open_fonts.end();
+}
+
+bool FontStore::evictFace(FTC_FaceID keep, bool keep_latest)
+{
+    const size_t count = keep_latest && !m_open_fonts.empty() ? m_open_fonts.size() - 1 : m_open_fonts.size();
+
+    for (size_t i = 0; i < count; i++) {
+        const uint16_t id = m_open_fonts[i];
+
+        if (font_face_id(id) != keep) {
+            m_open_fonts.erase(m_open_fonts.begin() + i);
+
+            // Also drops its sizes and cached glyphs
+            FTC_Manager_RemoveFaceID(m_cache, font_face_id(id));
+            printf("Unloaded face %d\n", id);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void FontStore::trackUse(uint32_t id)
+{
+    if (m_resident_budget == 0) {
+        return;
+    }
+
+    ResidentFont* font = findTracked(id);
+
+    if (font == nullptr) {
+        if (m_resident.size() < kMaxTrackedFonts) {
+            // Reserved up front so entries don't move
+            m_resident.reserve(kMaxTrackedFonts);
+            m_resident.push_back({(uint16_t) id, 0, 0, nullptr});
+            font = &m_resident.back();
+
+        } else {
+            // Forget the least used font read from disk
+            for (ResidentFont &other : m_resident) {
+                if (other.data == nullptr && (font == nullptr || other.uses < font->uses)) {
+                    font = &other;
+                }
+            }
+
+            if (font == nullptr) {
+                return;
+            }
+
+            *font = {(uint16_t) id, 0, 0, nullptr};
+        }
+    }
+
+    font->uses++;
+
+    if (font->data == nullptr && font->size != 0 && font->size <= m_resident_budget &&
+        font->uses >= kResidentMinUses) {
+        makeResident(*font);
+    }
+}
+
+FontStore::ResidentFont* FontStore::findTracked(uint32_t id)
+{
+    for (ResidentFont &font : m_resident) {
+        if (font.id == id) {
+            return &font;
+        }
+    }
+
+    return nullptr;
+}
+
+bool FontStore::makeResident(ResidentFont &font)
+{
+    // Fonts are ranked by uses per byte, so a small font used often beats a larger one
+    // used a little more. Only fonts ranked below this one may be dropped for it.
+    const auto ranks_below = [&](const ResidentFont &other) {
+        return (uint64_t) other.uses * font.size < (uint64_t) font.uses * other.size;
+    };
+
+    uint32_t available = m_resident_budget - m_resident_used;
+
+    for (const ResidentFont &other : m_resident) {
+        if (other.data != nullptr && ranks_below(other)) {
+            available += other.size;
+        }
+    }
+
+    if (available < font.size) {
+        return false;
+    }
+
+    uint8_t* data = (uint8_t*) malloc(font.size);
+    if (data == nullptr) {
+        return false;
+    }
+
+    fs::File* file = fs::open(m_font_table.at(font.id).c_str());
+    const bool read = file != nullptr && fs::read(file, data, font.size) == font.size;
+
+    if (file != nullptr) {
+        fs::close(file);
+    }
+
+    if (!read) {
+        printf("Failed to read font %u into memory\n", (unsigned) font.id);
+        free(data);
+        return false;
+    }
+
+    // Drop the lowest ranked fonts until this one fits
+    while (m_resident_budget - m_resident_used < font.size) {
+        ResidentFont* lowest = nullptr;
+
+        for (ResidentFont &other : m_resident) {
+            if (other.data != nullptr && ranks_below(other) &&
+                (lowest == nullptr || (uint64_t) other.uses * lowest->size < (uint64_t) lowest->uses * other.size)) {
+                lowest = &other;
+            }
+        }
+
+        dropResident(*lowest);
+        m_stats.resident_drops++;
+    }
+
+    // Close the face read from disk so the next lookup opens it from memory
+    FTC_Manager_RemoveFaceID(m_cache, font_face_id(font.id));
+
+    const auto open = std::find(m_open_fonts.begin(), m_open_fonts.end(), font.id);
+    if (open != m_open_fonts.end()) {
+        m_open_fonts.erase(open);
+    }
+
+    font.data = data;
+    m_resident_used += font.size;
+
+    m_stats.resident_loads++;
+    m_stats.resident_peak = std::max(m_stats.resident_peak, m_resident_used);
+
+    printf("Holding font %u in memory (%u bytes)\n", (unsigned) font.id, (unsigned) font.size);
+
+    return true;
+}
+
+void FontStore::dropResident(ResidentFont &font)
+{
+    // The face reads directly from the data, so it must be closed first
+    FTC_Manager_RemoveFaceID(m_cache, font_face_id(font.id));
+
+    const auto open = std::find(m_open_fonts.begin(), m_open_fonts.end(), font.id);
+    if (open != m_open_fonts.end()) {
+        m_open_fonts.erase(open);
+    }
+
+    free(font.data);
+    font.data = nullptr;
+    m_resident_used -= font.size;
+
+    printf("Released font %u from memory\n", (unsigned) font.id);
+}
+
+bool FontStore::dropLowestResident(FTC_FaceID keep)
+{
+    ResidentFont* lowest = nullptr;
+
+    for (ResidentFont &font : m_resident) {
+        if (font.data != nullptr && font_face_id(font.id) != keep &&
+            (lowest == nullptr || (uint64_t) font.uses * lowest->size < (uint64_t) lowest->uses * font.size)) {
+            lowest = &font;
+        }
+    }
+
+    if (lowest == nullptr) {
+        return false;
+    }
+
+    dropResident(*lowest);
+
+    return true;
 }
 
 void FontStore::unloadFace()
 {
-    if (m_face != nullptr) {
-        FT_Done_Face(m_face);
-        printf("Unloaded face %d\n", m_active_id);
-        m_face = nullptr;
-        m_active_id = -1;
+    while (evictFace(nullptr, false)) {}
+}
+
+bool FontStore::releaseMemory(FTC_FaceID keep)
+{
+    bool released = m_text_atlas.bytesUsed() != 0;
+    m_text_atlas.clear();
+
+    while (dropLowestResident(keep)) {
+        m_stats.resident_drops++;
+        released = true;
+    }
+
+    while (evictFace(keep, false)) {
+        m_stats.face_evictions_oom++;
+        released = true;
+    }
+
+    if (released) {
+        m_stats.memory_releases++;
+    }
+
+    return released;
+}
+
+void* FontStore::ftAlloc(FT_Memory memory, long size)
+{
+    FontStore* store = (FontStore*) memory->user;
+    const size_t total = sizeof(AllocationHeader) + size;
+
+    AllocationHeader* header = (AllocationHeader*) malloc(total);
+
+    if (header == nullptr) {
+        return nullptr;
+    }
+
+    header->size = total;
+
+    store->m_heap_used += total;
+    store->m_stats.heap_peak = std::max(store->m_stats.heap_peak, store->m_heap_used);
+
+    return header + 1;
+}
+
+void* FontStore::ftRealloc(FT_Memory memory, long, long new_size, void* block)
+{
+    FontStore* store = (FontStore*) memory->user;
+    const size_t total = sizeof(AllocationHeader) + new_size;
+
+    AllocationHeader* header = ((AllocationHeader*) block) - 1;
+    const size_t previous = header->size;
+
+    AllocationHeader* resized = (AllocationHeader*) realloc(header, total);
+
+    if (resized == nullptr) {
+        // The original block is left as it was
+        return nullptr;
     }
+
+    resized->size = total;
+
+    store->m_heap_used += total - previous;
+    store->m_stats.heap_peak = std::max(store->m_stats.heap_peak, store->m_heap_used);
+
+    return resized + 1;
+}
+
+void FontStore::ftFree(FT_Memory memory, void* block)
+{
+    FontStore* store = (FontStore*) memory->user;
+    AllocationHeader* header = ((AllocationHeader*) block) - 1;
+
+    store->m_heap_used -= header->size;
+    free(header);
+}
+
+void FontStore::printStats()
+{
+    printf("Font indexing: %u fonts read directly, %u through FreeType\n",
+        (unsigned) m_stats.fonts_read_directly,
+        (unsigned) m_stats.fonts_read_freetype);
+
+    printf("Font lookups: %u absent (%u loads avoided), %u present, %u unknown\n",
+        (unsigned) m_stats.coverage_absent,
+        (unsigned) m_stats.loads_avoided,
+        (unsigned) m_stats.coverage_present,
+        (unsigned) m_stats.coverage_unknown);
+
+    printf("Font fallbacks: %u glyphs recovered from a fallback font, %u found in no font, %u not found as a font failed to load\n",
+        (unsigned) m_stats.fallbacks_used,
+        (unsigned) m_stats.glyphs_missing,
+        (unsigned) m_stats.lookups_failed);
+
+    printf("Font faces: %u hits, %u misses, %u closed for the budget, %u closed when out of memory\n",
+        (unsigned) m_stats.face_hits,
+        (unsigned) m_stats.face_misses,
+        (unsigned) m_stats.face_evictions,
+        (unsigned) m_stats.face_evictions_oom);
+
+    printf("Font memory: %u fonts open, FreeType using %u bytes + %u for the library, %u for open files (budget %u + %u for glyphs, peak %u)\n",
+        (unsigned) m_open_fonts.size(),
+        (unsigned) (m_heap_used - m_heap_library - m_ui_heap_used),
+        (unsigned) m_heap_library,
+        (unsigned) fs::open_font_bytes(),
+        (unsigned) m_face_budget,
+        (unsigned) m_cache_budget,
+        (unsigned) m_stats.heap_peak);
+
+    printf("Resident fonts: %u bytes held (budget %u, peak %u), %u faces opened from memory, %u fonts read in, %u dropped\n",
+        (unsigned) m_resident_used,
+        (unsigned) m_resident_budget,
+        (unsigned) m_stats.resident_peak,
+        (unsigned) m_stats.resident_opens,
+        (unsigned) m_stats.resident_loads,
+        (unsigned) m_stats.resident_drops);
+
+    printf("Memory released %u times for a glyph that ran out of memory\n",
+        (unsigned) m_stats.memory_releases);
+
+    printf("UI faces: %u opened, %u sizes set up (max %u), FreeType using %u bytes for them (max %u for glyphs)\n",
+        (unsigned) m_stats.ui_face_opens,
+        (unsigned) m_stats.ui_sizes_created,
+        (unsigned) kMaxUISizes,
+        (unsigned) m_ui_heap_used,
+        (unsigned) kUIGlyphCacheBudget);
+
+    m_text_atlas.printStats();
+    BlendTable::printStats();
 }
 
 FT_Error FontStore::registerFont(const char* path)
 {
-    const uint32_t id = m_font_table.size();
+    FontScan scan;
+    scanFont(path, m_ft_library, scan);
 
-    if (id > 255) {
-        printf("All font slots are taken! Refusing to register %s", path);
-        return FT_Err_Out_Of_Memory;
+    return registerScan(path, scan);
+}
+
+void FontStore::scanFont(const char* path, FT_Library library, FontScan &scan)
+{
+    // Read the charmap directly if possible, as opening a full face is slow
+    // IDs are assigned when the scan is registered, so zero is used here
+    if (cmap_reader::read_ranges(path, 0, scan.ranges)) {
+        scan.read_directly = true;
+        return;
     }
 
     FT_Face face;
-    FT_Error error = fs::load_face(path, m_ft_library, &face);
-    if (error) {
-        printf("Error loading '%s': FreeType error 0x%02X\n", path, error);
-        return error;
+    scan.error = fs::load_face(path, library, &face);
+    if (scan.error) {
+        printf("Error loading '%s': FreeType error 0x%02X\n", path, scan.error);
+        return;
     }
 
-    m_indexer.indexFace(id, face);
+    FontIndexer::faceRanges(0, face, scan.ranges);
 
     FT_Done_Face(face);
+}
+
+FT_Error FontStore::registerScan(const char* path, FontScan &scan)
+{
+    if (scan.error) {
+        return scan.error;
+    }
+
+    const uint32_t id = m_font_table.size();
+
+    if (id >= FontIndexer::kCodepointNotFound) {
+        printf("All font slots are taken! Refusing to register %s\n", path);
+        return FT_Err_Out_Of_Memory;
+    }
+
+    if (scan.read_directly) {
+        m_stats.fonts_read_directly++;
+    } else {
+        m_stats.fonts_read_freetype++;
+    }
+
+    for (CodepointRange &range : scan.ranges) {
+        range.id = id;
+    }
+
+    m_indexer.indexRanges(scan.ranges);
 
-    // Register the font only if it actually contributed codepoints
+    // Register the font only if it actually contributed codepoints or is a fallback
     // There's a lot of overlap in the Noto font set, so quite a few fonts end up unused.
-    // (IDs are 8-bit to minimise the index's memory footprint)
-    for (const auto &range : m_indexer.ranges()) {
-        if (range.id == id) {
-            m_font_table.emplace_back(path);
-            break;
-        }
+    if (m_indexer.isReferenced(id)) {
+        m_font_table.emplace_back(path);
     }
 
     return FT_Err_Ok;
 }
 
+#if PICO_ON_DEVICE || defined(EMSCRIPTEN)
+// The host build reads fonts on multiple threads instead (see host/host_font_scan.cpp)
+void FontStore::registerFonts(const std::vector<IndexedFile> &files, const std::function<void(uint8_t progress)> &progress)
+{
+    for (size_t i = 0; i < files.size(); i++) {
+        registerFont(files[i].path.c_str());
+        progress(fs::fp_progress(i + 1, files.size()));
+    }
+}
+#endif
+
 void hexdump(void *ptr, int buflen) {
     unsigned char *buf = (unsigned char*)ptr;
     int i, j;
@@ -220,14 +908,12 @@ bool find_substitutions(FT_Face m_face)
 
 UIFontPen FontStore::get_pen()
 {
-    using namespace assets;
-    return UIFontPen(opensans_ttf, opensans_ttf_end - opensans_ttf, m_ft_library);
+    return UIFontPen(this, (FTC_FaceID) kUIFontSans);
 }
 
 UIFontPen FontStore::get_monospace_pen()
 {
-    using namespace assets;
-    return UIFontPen(notomono_otf, notomono_otf_end - notomono_otf, m_ft_library);
+    return UIFontPen(this, (FTC_FaceID) kUIFontMono);
 }
 
 //
@@ -239,13 +925,13 @@ struct PenRasterState {
     int16_t baseline;
     int16_t screen_x;
     int16_t screen_y;
-    uint32_t colour;
     int16_t width;
     int16_t height;
     uint8_t bg_r;
-    uint8_t bg_g;
-    uint8_t bg_b;
     uint8_t* buffer;
+
+    // Pixel for each coverage value in the pen and background colours
+    const BlendTable* blend;
 };
 
 /**
@@ -259,20 +945,16 @@ static void raster_pen_line(
     const FT_Span* const spans
 )
 {
-    const uint8_t pen_r = state->colour >> 16;
-    const uint8_t pen_g = state->colour >> 8;
-    const uint8_t pen_b = state->colour;
-
     const int16_t offset_x = state->screen_x >= 0 ? 0 : state->screen_x;
 
     for (int i = 0; i < count; ++i) {
         const auto &span = spans[i];
-        const auto &coverage = span.coverage;
 
-        // Blend font colour with background
-        const uint8_t r = ((coverage * pen_r) + ((255 - coverage) * state->bg_r)) >> 8;
-        const uint8_t g = ((coverage * pen_g) + ((255 - coverage) * state->bg_g)) >> 8;
-        const uint8_t b = ((coverage * pen_b) + ((255 - coverage) * state->bg_b)) >> 8;
+        // Font colour blended with background
+        const uint8_t* rgb = state->blend->pixel(span.coverage);
+        const uint8_t r = rgb[0];
+        const uint8_t g = rgb[1];
+        const uint8_t b = rgb[2];
 
         int16_t x = offset_x + state->buf_x + span.x;
         const int16_t end_x = std::min(x + span.len, state->width - 1);
@@ -319,16 +1001,27 @@ static void raster_callback_line(const int y, const int count, const FT_Span* co
         return;
     }
 
+    // Only the part of the line between this glyph's first and last span is written,
+    // as neighbouring glyphs may already be drawn either side of it
+    const int16_t offset_x = state->screen_x >= 0 ? 0 : state->screen_x;
+    const int start_x = std::max(0, offset_x + state->buf_x + spans[0].x);
+    const int end_x = std::min(state->width - 1, offset_x + state->buf_x + spans[count - 1].x + spans[count - 1].len);
+
+    if (start_x >= end_x) {
+        return;
+    }
+
     uint8_t* buf = st7789_line_buffer();
     const uint8_t* buf_end = buf + ST7789_LINE_BUF_SIZE - 1;
-    memset(buf, 0, ST7789_LINE_BUF_SIZE);
+
+    // Same greyscale background cheat as the canvas
+    memset(buf, state->bg_r, ST7789_LINE_BUF_SIZE);
 
     raster_pen_line(state, buf, buf_end, count, spans);
 
-    const uint16_t start_x = state->buf_x;
-    const uint16_t end_x = std::min(DISPLAY_WIDTH, start_x + spans[count -1].x + spans[count -1].len);
+    const int16_t render_x = state->screen_x >= 0 ? state->screen_x : 0;
 
-    st7789_set_cursor(state->screen_x + state->buf_x, state->screen_y + state->height - canvas_y);
+    st7789_set_cursor(render_x + start_x, state->screen_y + canvas_y);
     st7789_write_dma(buf + (start_x * 3), (end_x - start_x) * 3, true);
 }
 
@@ -337,36 +1030,53 @@ static void raster_callback_direct(const int y, const int count, const FT_Span*
     const PenRasterState* state = (const PenRasterState*) user;
     const int canvas_y = state->height - y + state->baseline;
 
-    const uint8_t pen_r = state->colour >> 16;
-    const uint8_t pen_g = state->colour >> 8;
-    const uint8_t pen_b = state->colour;
-
     for (int i = 0; i < count; ++i) {
         const auto &span = spans[i];
-        const auto &coverage = span.coverage;
 
-        // Blend font colour with background
-        const uint8_t channels[3] = {
-            (uint8_t) (((coverage * pen_r) + ((255 - coverage) * state->bg_r)) >> 8),
-            (uint8_t) (((coverage * pen_g) + ((255 - coverage) * state->bg_g)) >> 8),
-            (uint8_t) (((coverage * pen_b) + ((255 - coverage) * state->bg_b)) >> 8),
-        };
+        // Font colour blended with background
+        const uint8_t* rgb = state->blend->pixel(span.coverage);
 
         st7789_set_cursor(state->screen_x + state->buf_x + span.x, state->screen_y + canvas_y);
 
         for (uint32_t k = 0; k < span.len; k++) {
-            st7789_write((uint8_t*) &channels, sizeof(channels));
+            st7789_write(rgb, 3);
         }
     }
 }
 
-// Data shared between UIFontPen instances
-// This is done to avoid reloading the same font for multiple pen instances.
-uint8_t* UIFontPen::ms_fontdata = nullptr;
-FT_Face UIFontPen::ms_face = nullptr;
+/**
+ * Raster spans to a strip of coverage values in memory
+ */
+static void raster_callback_strip(const int y, const int count, const FT_Span* const spans, void * const user)
+{
+    const PenRasterState* state = (const PenRasterState*) user;
+    const int canvas_y = state->height - y + state->baseline;
+
+    if (canvas_y < 0 || canvas_y >= (state->height - 1)) {
+        return;
+    }
+
+    uint8_t* line_buf = state->buffer + (canvas_y * state->width);
+
+    for (int i = 0; i < count; ++i) {
+        const auto &span = spans[i];
 
-UIFontPen::UIFontPen(const uint8_t* fontdata, size_t length, FT_Library library)
-    : m_ft_library(library),
+        // Clipped the same as a canvas, leaving the last column empty
+        const int x = std::max(0, state->buf_x + span.x);
+        const int end_x = std::min(state->buf_x + span.x + span.len, state->width - 1);
+
+        if (x < end_x) {
+            memset(line_buf + x, span.coverage, end_x - x);
+        }
+    }
+}
+
+// Glyphs are loaded the same way for measuring and drawing, so both use the same cache entries
+static const FT_Int32 kPenLoadFlags = FT_LOAD_DEFAULT | FT_LOAD_NO_BITMAP;
+
+UIFontPen::UIFontPen(FontStore* store, FTC_FaceID face_id)
+    : m_store(store),
+      m_face_id(face_id),
       m_x(0),
       m_y(0),
       m_strlen(0),
@@ -374,54 +1084,69 @@ UIFontPen::UIFontPen(const uint8_t* fontdata, size_t length, FT_Library library)
       m_background(0),
       m_size_px(16),
       m_embolden(0),
-      m_mode(UIFontPen::kMode_CanvasBuffer)
-{
-    if (fontdata != ms_fontdata) {
-        UIFontPen::unload_shared();
+      m_mode(UIFontPen::kMode_CanvasBuffer) {}
 
-        FT_Error err = FT_New_Memory_Face(library, fontdata, length, 0, &ms_face);
-        if (err) {
-            printf("Error: Embedded font load Failed: 0x%02X\n", err);
-            ms_face = nullptr;
-            ms_fontdata = nullptr;
-        }
-    }
-}
-
-void UIFontPen::unload_shared()
+void UIFontPen::get_scaler(FTC_ScalerRec &scaler)
 {
-    if (ms_face != nullptr) {
-        FT_Done_Face(ms_face);
-        ms_face = nullptr;
-        ms_fontdata = nullptr;
-    }
+    scaler.face_id = m_face_id;
+    scaler.width = 0;
+    scaler.height = m_size_px;
+    scaler.pixel = 1;
+    scaler.x_res = 0;
+    scaler.y_res = 0;
 }
 
 void UIFontPen::set_size(uint16_t size_px)
 {
-    if (ms_face == nullptr) {
-        printf("Unable to set_size width as the face is in an error state\n");
-        return;
-    }
-
+    // The scaled size is looked up in the cache when drawing
     m_size_px = size_px;
-    FT_Set_Pixel_Sizes(ms_face, 0, size_px);
 }
 
 uint16_t UIFontPen::compute_px_width(const char* str, uint16_t length_limit)
 {
-    if (ms_face == nullptr) {
-        printf("Unable to compute width as the face is in an error state\n");
-        return 0;
-    }
+    const uint32_t start_time = timestamp_us();
+
+    TextAtlas &atlas = m_store->textAtlas();
+    TextAtlas::Advances* advances = atlas.advances(m_face_id, m_size_px);
+
+    FTC_ScalerRec scaler;
+    get_scaler(scaler);
+
+    // The face is only looked up once a glyph needs loading
+    FT_Face face = nullptr;
 
     uint16_t px_width = 0;
 
     {
         uint16_t index = 0;
         while (str[index] != '\0') {
-            FT_Load_Char(ms_face, str[index], FT_LOAD_DEFAULT | FT_LOAD_BITMAP_METRICS_ONLY);
-            px_width += ms_face->glyph->advance.x / 64;
+            const uint8_t c = str[index];
+
+            if (advances != nullptr && advances->contains(c)) {
+                px_width += advances->get(c) / 64;
+                atlas.countAdvance(true);
+
+            } else {
+                if (face == nullptr && m_store->lookupUIFace(m_face_id, &face) != FT_Err_Ok) {
+                    printf("Unable to compute width as the face is in an error state\n");
+                    return 0;
+                }
+
+                const FT_UInt glyph_index = FT_Get_Char_Index(face, str[index]);
+                FT_Glyph glyph;
+
+                // Glyph advances are 16.16 fixed point
+                if (m_store->lookupGlyph(&scaler, kPenLoadFlags, glyph_index, &glyph) == FT_Err_Ok) {
+                    px_width += glyph->advance.x >> 16;
+
+                    if (advances != nullptr) {
+                        advances->set(c, glyph->advance.x >> 10);
+                    }
+                }
+
+                atlas.countAdvance(false);
+            }
+
             index++;
 
             if (length_limit != 0 && index >= length_limit) {
@@ -435,6 +1160,8 @@ uint16_t UIFontPen::compute_px_width(const char* str, uint16_t length_limit)
         px_width += 1;
     }
 
+    atlas.countMeasure(timestamp_us() - start_time);
+
     return px_width;
 }
 
@@ -452,13 +1179,17 @@ UIRect UIFontPen::draw(const char* str)
 
 UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
 {
-    if (ms_face == nullptr) {
-        printf("Unable to draw as the face is in an error state\n");
+    if (canvas_width_px == 0 || str == NULL || *str == '\0') {
+        // Nothing to draw
         return UIRect();
     }
 
-    if (canvas_width_px == 0 || str == NULL || *str == '\0') {
-        // Nothing to draw
+    const uint32_t start_time = timestamp_us();
+
+    // The size is only set up if a glyph has to be loaded, as text in the atlas doesn't need it
+    FT_Face face;
+    if (m_store->lookupUIFace(m_face_id, &face) != FT_Err_Ok) {
+        printf("Unable to draw as the face is in an error state\n");
         return UIRect();
     }
 
@@ -467,27 +1198,26 @@ UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
         ? std::min(DISPLAY_WIDTH -  m_x, static_cast<int>(canvas_width_px))
         : std::min(canvas_width_px + m_x, DISPLAY_WIDTH);
 
-    const int16_t max_height = m_size_px + (m_embolden/64) - (ms_face->descender/64);
+    const int16_t max_height = m_size_px + (m_embolden/64) - (face->descender/64);
     const int16_t px_height = m_y + max_height > DISPLAY_HEIGHT
         ? DISPLAY_HEIGHT - m_y
         : max_height;
 
     const int baseline_correction = (px_height - max_height);
 
-    const uint16_t canvas_bytes = px_width * px_height * 3;
+    const uint32_t canvas_bytes = px_width * px_height * 3;
+    const uint32_t render_x = m_x >= 0 ? m_x : 0;
 
 
     PenRasterState state;
     state.buf_x = 0;
-    state.baseline = (ms_face->descender/64) - baseline_correction;
+    state.baseline = (face->descender/64) - baseline_correction;
     state.screen_x = m_x;
     state.screen_y = m_y;
-    state.colour = m_colour;
     state.width = px_width;
     state.height = px_height;
     state.bg_r = m_background >> 16;
-    state.bg_g = m_background >> 8;
-    state.bg_b = m_background;
+    state.blend = &BlendTable::get(m_colour, m_background);
 
 
     FT_Raster_Params params;
@@ -495,23 +1225,32 @@ UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
     params.flags = FT_RASTER_FLAG_AA | FT_RASTER_FLAG_DIRECT;
     params.user = &state;
 
-    if (m_mode == UIFontPen::kMode_CanvasBuffer) {
-        state.buffer = (uint8_t*) malloc(canvas_bytes);
-        if (state.buffer == NULL) {
-            printf("Failed to allocate render buffer of %d x %d\n", px_width, px_height);
-            return UIRect();
+    // Canvas memory is released when the draw returns
+    frame_arena::Scope scratch;
+    RenderMode mode = m_mode;
+
+    if (mode == UIFontPen::kMode_CanvasBuffer) {
+        state.buffer = (uint8_t*) frame_arena::alloc(canvas_bytes);
+
+        if (state.buffer == nullptr) {
+            // Draw line by line instead, over the area the canvas would have covered
+            frame_arena::count_fallback();
+            st7789_fill_window(state.bg_r, render_x, m_y, px_width, px_height);
+            mode = UIFontPen::kMode_LineBuffer;
         }
+    }
 
+    if (mode == UIFontPen::kMode_CanvasBuffer) {
         // Cheat setting background colour, as we only use greyscale backgrounds
         memset(state.buffer, state.bg_r, canvas_bytes);
 
         params.gray_spans = raster_callback_canvas;
 
-    } else if (m_mode == UIFontPen::kMode_LineBuffer) {
+    } else if (mode == UIFontPen::kMode_LineBuffer) {
         state.buffer = nullptr;
         params.gray_spans = raster_callback_line;
 
-    } else if (m_mode == UIFontPen::kMode_DirectToScreen) {
+    } else if (mode == UIFontPen::kMode_DirectToScreen) {
         state.buffer = nullptr;
         params.gray_spans = raster_callback_direct;
 
@@ -520,7 +1259,159 @@ UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
         return UIRect();
     }
 
-    const int16_t offset_x = m_x >= 0 ? 0 : m_x;
+    draw_glyphs(str, face, params, state);
+
+    // Send rendered line to screen if needed
+    if (mode == UIFontPen::kMode_CanvasBuffer) {
+        st7789_set_window(render_x, m_y, render_x + px_width, m_y + px_height);
+        st7789_write_dma(state.buffer, canvas_bytes, true);
+
+        // Ensure writing completes before the arena memory is reused
+        st7789_deselect();
+    }
+
+    // Absorb the total pen movement into our state
+    m_x += state.buf_x;
+
+    m_store->textAtlas().countDraw(timestamp_us() - start_time);
+
+    return UIRect(state.screen_x, state.screen_y, canvas_width_px, state.height + 1);
+}
+
+uint16_t UIFontPen::render_strip(const char* str, uint16_t canvas_width_px, uint32_t max_bytes,
+                                 std::vector<uint8_t> &strip)
+{
+    strip.clear();
+    shrinkContainer(strip);
+
+    if (canvas_width_px == 0 || str == NULL || *str == '\0') {
+        return 0;
+    }
+
+    FT_Face face;
+    if (m_store->lookupUIFace(m_face_id, &face) != FT_Err_Ok) {
+        printf("Unable to draw as the face is in an error state\n");
+        return 0;
+    }
+
+    // Same height and baseline as draw() would use at this y position
+    const int16_t max_height = m_size_px + (m_embolden/64) - (face->descender/64);
+    const int16_t px_height = m_y + max_height > DISPLAY_HEIGHT
+        ? DISPLAY_HEIGHT - m_y
+        : max_height;
+
+    if (px_height <= 0 || (uint32_t) (canvas_width_px * px_height) > max_bytes) {
+        return 0;
+    }
+
+    strip.resize(canvas_width_px * px_height);
+
+    PenRasterState state;
+    state.buf_x = 0;
+    state.baseline = (face->descender/64) - (px_height - max_height);
+    state.screen_x = 0;
+    state.screen_y = m_y;
+    state.width = canvas_width_px;
+    state.height = px_height;
+    state.bg_r = 0;
+    state.buffer = strip.data();
+    state.blend = nullptr;
+
+    FT_Raster_Params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = FT_RASTER_FLAG_AA | FT_RASTER_FLAG_DIRECT;
+    params.gray_spans = raster_callback_strip;
+    params.user = &state;
+
+    const uint32_t start_time = timestamp_us();
+
+    draw_glyphs(str, face, params, state);
+
+    m_store->textAtlas().countDraw(timestamp_us() - start_time);
+
+    return px_height;
+}
+
+UIRect UIFontPen::draw_strip(const std::vector<uint8_t> &strip, uint16_t canvas_width_px, uint16_t height,
+                             const UIRect &erase)
+{
+    if (canvas_width_px == 0 || height == 0 || strip.size() < (size_t) (canvas_width_px * height)) {
+        return UIRect();
+    }
+
+    // Same region of screen as draw() would write for the string
+    const int16_t px_width = m_x >= 0
+        ? std::min(DISPLAY_WIDTH -  m_x, static_cast<int>(canvas_width_px))
+        : std::min(canvas_width_px + m_x, DISPLAY_WIDTH);
+
+    const int16_t render_x = m_x >= 0 ? m_x : 0;
+
+    // Extend the write over whatever part of the erase region is beside the text
+    int16_t start_x = render_x;
+    int16_t end_x = render_x + px_width;
+
+    if (erase.is_valid()) {
+        start_x = std::max(0, std::min<int>(start_x, erase.x));
+        end_x = std::min<int>(DISPLAY_WIDTH, std::max<int>(end_x, erase.x + erase.width));
+    }
+
+    if (px_width <= 0 || start_x >= end_x) {
+        return UIRect();
+    }
+
+    const uint32_t start_time = timestamp_us();
+
+    const BlendTable &blend = BlendTable::get(m_colour, m_background);
+    const uint8_t bg_r = m_background >> 16;
+
+    // The last column of a canvas is never drawn to
+    const int16_t text_end_x = render_x + px_width - 1;
+    const uint32_t line_bytes = (end_x - start_x) * 3;
+
+    st7789_set_window(start_x, m_y, end_x, m_y + height);
+
+    for (uint16_t row = 0; row < height; row++) {
+        uint8_t* buf = st7789_line_buffer();
+
+        // Same greyscale background cheat as the canvas
+        memset(buf, bg_r, line_bytes);
+
+        // Strip column zero is at the pen position
+        const uint8_t* coverage = strip.data() + (row * canvas_width_px);
+        uint8_t* out = buf + ((render_x - start_x) * 3);
+
+        for (int16_t x = render_x; x < text_end_x; x++) {
+            const uint8_t c = coverage[x - m_x];
+
+            if (c != 0) {
+                const uint8_t* rgb = blend.pixel(c);
+                out[0] = rgb[0];
+                out[1] = rgb[1];
+                out[2] = rgb[2];
+            }
+
+            out += 3;
+        }
+
+        st7789_write_dma(buf, line_bytes, true);
+    }
+
+    m_store->textAtlas().countDraw(timestamp_us() - start_time);
+
+    return UIRect(m_x, m_y, canvas_width_px, height + 1);
+}
+
+void UIFontPen::draw_glyphs(const char* str, FT_Face face, FT_Raster_Params &params, PenRasterState &state)
+{
+    FTC_ScalerRec scaler;
+    get_scaler(scaler);
+
+    const int16_t offset_x = state.screen_x >= 0 ? 0 : state.screen_x;
+
+    // Glyphs are drawn from the atlas where possible, and added to it as they're first drawn
+    TextAtlas &atlas = m_store->textAtlas();
+    TextAtlas::Strip* strip = atlas.strip(m_face_id, m_size_px, m_embolden);
+    TextAtlas::Advances* advances = atlas.advances(m_face_id, m_size_px);
 
     uint16_t index = 0;
     while (str[index] != '\0') {
@@ -528,21 +1419,73 @@ UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
             break;
         }
 
-        FT_Load_Char(ms_face, str[index], FT_LOAD_DEFAULT | FT_LOAD_NO_BITMAP);
+        const uint8_t c = str[index];
 
-        const auto &slot = ms_face->glyph;
+        if (strip != nullptr && strip->contains(c)) {
+            const FT_Pos advance = strip->advance(c);
 
-        if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
-            if (m_embolden != 0) {
-                FT_Outline_Embolden(&slot->outline, m_embolden);
+            if (state.screen_x + state.buf_x + (advance / 64) >= 0) {
+                atlas.draw(*strip, c, params.gray_spans, &state);
             }
 
-            if (m_x + state.buf_x + slot->advance.x >= 0) {
-                FT_Outline_Render(m_ft_library, &slot->outline, &params);
+            state.buf_x += advance / 64;
+
+        } else if (advances != nullptr && advances->contains(c) &&
+                   state.screen_x + state.buf_x + (advances->get(c) / 64) < 0) {
+            // Scrolled off the left of the screen: only the advance is needed
+            state.buf_x += advances->get(c) / 64;
+            atlas.countAdvance(true);
+
+        } else {
+            const FT_UInt glyph_index = FT_Get_Char_Index(face, str[index]);
+            FT_Glyph glyph;
+
+            if (m_store->lookupGlyph(&scaler, kPenLoadFlags, glyph_index, &glyph) == FT_Err_Ok) {
+                // Glyph advances are 16.16 fixed point: convert to 26.6 like a glyph slot
+                const FT_Pos advance = glyph->advance.x >> 10;
+                const bool visible = state.screen_x + state.buf_x + (advance / 64) >= 0;
+
+                if (advances != nullptr) {
+                    advances->set(c, advance);
+                }
+
+                const bool can_add = strip != nullptr && strip->canAdd(c);
+
+                if (glyph->format == FT_GLYPH_FORMAT_OUTLINE && (visible || can_add)) {
+                    FT_Outline* outline = &((FT_OutlineGlyph) glyph)->outline;
+                    FT_Glyph copy = nullptr;
+
+                    if (m_embolden != 0) {
+                        // Cached glyphs are shared, so embolden a copy
+                        if (FT_Glyph_Copy(glyph, &copy) == FT_Err_Ok) {
+                            outline = &((FT_OutlineGlyph) copy)->outline;
+                            FT_Outline_Embolden(outline, m_embolden);
+                        } else {
+                            outline = nullptr;
+                        }
+                    }
+
+                    if (outline != nullptr) {
+                        if (can_add && atlas.add(*strip, c, m_store->get_library(), outline, advance)) {
+                            if (visible) {
+                                atlas.draw(*strip, c, params.gray_spans, &state);
+                            }
+
+                        } else if (visible) {
+                            FT_Outline_Render(m_store->get_library(), outline, &params);
+                            atlas.countRendered();
+                        }
+                    }
+
+                    if (copy != nullptr) {
+                        FT_Done_Glyph(copy);
+                    }
+                }
+
+                state.buf_x += advance / 64;
             }
         }
 
-        state.buf_x += slot->advance.x / 64;
         index++;
 
         if (m_strlen != 0 && index >= m_strlen) {
@@ -551,22 +1494,4 @@ UIRect UIFontPen::draw(const char* str, const uint16_t canvas_width_px)
             break;
         }
     }
-
-    // Send rendered line to screen if needed
-    if (m_mode == UIFontPen::kMode_CanvasBuffer) {
-        const uint32_t render_x = m_x >= 0 ? m_x : 0;
-
-        st7789_set_window(render_x, m_y, render_x + px_width, m_y + px_height);
-        st7789_write_dma(state.buffer, px_width * px_height * 3, true);
-
-        // Ensure writing completes before we deallocate the buffer
-        st7789_deselect();
-
-        free(state.buffer);
-    }
-
-    // Absorb the total pen movement into our state
-    m_x += state.buf_x;
-
-    return UIRect(state.screen_x, state.screen_y, canvas_width_px, state.height + 1);
 }
@@ -1,18 +1,25 @@
 #pragma once
 
 #include "font_indexer.hh"
+#include "index_cache.hh"
 #include "ui/common.hh"
+#include "ui/text_atlas.hh"
 #include "util.hh"
 
 // FreeType
 #include "ft2build.h"
 #include FT_CACHE_H
 #include FT_FREETYPE_H
+#include FT_SYSTEM_H
 
 // C++
+#include <functional>
 #include <string>
 #include <vector>
 
+class FontStore;
+struct PenRasterState;
+
 /**
  * Rendering state for drawing text in the UI
  */
@@ -34,14 +41,9 @@ public:
     };
 
     /**
-     * Clear any currently loaded font shared between UIFontPen instances
-     *
-     * This must be called manually after UIFontPen instances have been
-     * destructed to release the last used memory font.
+     * Pens are created by FontStore, which caches the face, sizes and glyphs they use
      */
-    static void unload_shared();
-
-    UIFontPen(const uint8_t* fontdata, size_t length, FT_Library library);
+    UIFontPen(FontStore* store, FTC_FaceID face_id);
 
     /**
      * Draw the complete null-terminated string, calculating canvas size automatically
@@ -58,6 +60,31 @@ public:
      */
     UIRect draw_length(const char* str, uint16_t length);
 
+    /**
+     * Rasterise a string into memory instead of to screen, for drawing with draw_strip()
+     *
+     * The strip holds one byte of coverage per pixel, canvas_width_px wide and as tall as
+     * draw() would make the text at the pen's current y position. Colours aren't stored,
+     * so the strip can be drawn in whatever colour the pen has at the time.
+     *
+     * Returns the height of the strip, or zero if there was nothing to draw or the strip
+     * would be larger than max_bytes.
+     */
+    uint16_t render_strip(const char* str, uint16_t canvas_width_px, uint32_t max_bytes,
+                          std::vector<uint8_t> &strip);
+
+    /**
+     * Draw a strip from render_strip() at the pen position, with the pen's colours
+     *
+     * The result is the same as drawing the string with draw(), but without rasterising it
+     * again. Columns of the erase region either side of the text are filled with the
+     * background in the same write, in place of a separate UIRect::diff_blank().
+     *
+     * Returns the region drawn, as draw() would for the string.
+     */
+    UIRect draw_strip(const std::vector<uint8_t> &strip, uint16_t canvas_width_px, uint16_t height,
+                      const UIRect &erase);
+
     /**
      * Set the font size in pixels
      */
@@ -118,7 +145,19 @@ public:
 
 private:
 
-    FT_Library m_ft_library;
+    /**
+     * Fill in a cache scaler for the current size
+     */
+    void get_scaler(FTC_ScalerRec &scaler);
+
+    /**
+     * Pass each glyph of a string to the raster callback in params
+     * This advances state.buf_x by the width drawn, stopping at the edge of the state's width.
+     */
+    void draw_glyphs(const char* str, FT_Face face, FT_Raster_Params &params, PenRasterState &state);
+
+    FontStore* m_store;
+    FTC_FaceID m_face_id;
 
     int16_t m_x;
     int16_t m_y;
@@ -130,10 +169,6 @@ private:
     uint16_t m_embolden;
 
     RenderMode m_mode;
-
-    // Shared data between UIFontPen instances to avoid reloading the same font repeatedly
-    static uint8_t* ms_fontdata;
-    static FT_Face ms_face;
 };
 
 /**
@@ -141,11 +176,68 @@ private:
  */
 class FontStore {
 public:
-    FontStore();
+    /**
+     * Faces, sizes and glyphs are held in a FreeType cache (FTC_Manager)
+     *
+     * The cache budget is the max_bytes of the cache, used for loaded glyph outlines.
+     * The face budget is how much more heap FreeType may hold, mostly for open faces
+     * and their sizes, before the least recently used fonts are closed. Heap for the
+     * files of fonts opened from disk, including their read caches, counts towards it
+     * too. A face budget of zero keeps only one font open at a time.
+     *
+     * The embedded UI fonts have a cache of their own, with fixed limits outside these
+     * budgets. Their faces and sizes stay open for as long as the store exists.
+     *
+     * The resident budget is heap for keeping whole font files in memory, so the most
+     * used small fonts are opened and read without going to disk. Zero disables this.
+     * This memory is allocated outside FreeType, so it's released if opening a face
+     * still runs out of memory once every other face is closed.
+     *
+     * The text atlas budget is heap for pre-rasterised UI text glyphs (see TextAtlas).
+     * Zero disables the atlas, so all UI text is rasterised as it's drawn.
+     */
+    FontStore(uint32_t face_budget = 0, uint32_t cache_budget = 16 * 1024, uint32_t resident_budget = 0,
+              uint32_t text_atlas_budget = 0);
     ~FontStore();
 
+    /**
+     * Codepoint coverage read from a font file, ready to be registered
+     */
+    struct FontScan {
+        FT_Error error = FT_Err_Ok;
+
+        // True if the cmap was read directly rather than through FreeType
+        bool read_directly = false;
+
+        std::vector<CodepointRange> ranges;
+    };
+
+    /**
+     * Read a font's coverage and add it to the index
+     * Fonts must be registered in the same order every time for the index to match.
+     */
     FT_Error registerFont(const char* path);
 
+    /**
+     * Register a list of fonts in order, reporting progress after each one
+     *
+     * On the host, fonts are read on a pool of worker threads (one FreeType
+     * library each) and merged on the calling thread in list order, so the
+     * index is identical to registering them one at a time.
+     */
+    void registerFonts(const std::vector<IndexedFile> &files, const std::function<void(uint8_t progress)> &progress);
+
+    /**
+     * Read the coverage of a font file without modifying the store
+     * This only uses the passed FreeType library, so it's safe to call from other threads.
+     */
+    static void scanFont(const char* path, FT_Library library, FontScan &scan);
+
+    /**
+     * Add a font read with scanFont() to the index
+     */
+    FT_Error registerScan(const char* path, FontScan &scan);
+
     UIFontPen get_pen();
     UIFontPen get_monospace_pen();
 
@@ -154,9 +246,12 @@ public:
         return m_ft_library;
     }
 
-    inline const std::vector<CodepointRange>& codepointRanges()
+    /**
+     * Glyphs for the UI text drawn by pens
+     */
+    inline TextAtlas& textAtlas()
     {
-        return m_indexer.ranges();
+        return m_text_atlas;
     }
 
     inline const uint32_t countCodepoints()
@@ -164,41 +259,313 @@ public:
         return m_indexer.countCodepoints();
     }
 
-    inline void optimise()
+    inline void optimise(const IndexSettings &settings)
     {
         shrinkContainer(m_font_table);
-        return m_indexer.compressRanges();
+        return m_indexer.compressRanges(settings);
+    }
+
+    /**
+     * Restore a previously saved index instead of registering fonts
+     * Returns false if there's no saved index or it was built from different files or settings.
+     * times_changed is set if the index should be saved again (see index_cache::load()).
+     */
+    inline bool loadIndex(const char* path, const char* fontdir, const std::vector<IndexedFile> &files,
+                          const IndexSettings &settings, bool &times_changed)
+    {
+        return index_cache::load(path, fontdir, files, settings, m_indexer, m_font_table, times_changed);
+    }
+
+    /**
+     * Save the index for loading on the next start
+     * This should be called after optimise() once all fonts are registered.
+     */
+    inline bool saveIndex(const char* path, const char* fontdir, const std::vector<IndexedFile> &files)
+    {
+        return index_cache::save(path, fontdir, files, m_indexer, m_font_table);
     }
 
     /**
      * Load a registered font with a glyph for the given codepoint
-     * Returns nullptr if no font matched the codepoint
+     *
+     * If the indexed font doesn't have the glyph, the range's fallback fonts are
+     * tried in order. The result is remembered to avoid repeating failed loads.
+     *
+     * Recently used faces are kept open within the face budget, so switching back
+     * to them doesn't read from disk again. Only the face returned by the latest
+     * call is guaranteed to stay open: any other may be closed to make room.
+     *
+     * Returns nullptr if no font has a glyph for the codepoint
      */
     FT_Face loadFaceByCodepoint(uint32_t codepoint);
 
     /**
-     * Unload any loaded FreeType face to free up heap memory
+     * Unload all open FreeType faces to free up heap memory
      */
     void unloadFace();
 
+    /**
+     * Free memory held to speed up drawing, after FreeType ran out of memory
+     *
+     * This empties the text atlas, releases fonts held in memory and closes open faces,
+     * except for the passed face, which stays open. Returns false if nothing was freed.
+     */
+    bool releaseMemory(FTC_FaceID keep);
+
+    /**
+     * Look up a scaled size of a face through the cache
+     * The size is activated on its face, ready to load glyphs into the face's slot.
+     */
+    FT_Error lookupSize(FTC_Scaler scaler, FT_Size* size);
+
+    /**
+     * Look up one of the embedded UI faces through its cache, without setting up a size
+     * Pens only need a size once they load a glyph, which lookupGlyph() does itself.
+     */
+    FT_Error lookupUIFace(FTC_FaceID face_id, FT_Face* face);
+
+    /**
+     * Load a glyph image through the cache
+     *
+     * The glyph is owned by the cache and is only valid until the next cache call,
+     * so it must be copied (FT_Glyph_Copy) to be modified or kept.
+     */
+    FT_Error lookupGlyph(FTC_Scaler scaler, FT_Int32 load_flags, FT_UInt glyph_index, FT_Glyph* glyph);
+
+    /**
+     * Get the cache id of a face returned by loadFaceByCodepoint()
+     */
+    static inline FTC_FaceID faceId(FT_Face face)
+    {
+        return face->generic.data;
+    }
+
+    /**
+     * Print lookup counters to stdout
+     */
+    void printStats();
+
 private:
 
+    struct Stats {
+        // Fonts indexed with cmap_reader, or by opening a face when that failed
+        uint32_t fonts_read_directly = 0;
+        uint32_t fonts_read_freetype = 0;
+
+        // Lookups answered by the coverage index
+        uint32_t coverage_absent = 0;
+        uint32_t coverage_present = 0;
+        uint32_t coverage_unknown = 0;
+
+        // Absent lookups that would otherwise have loaded a different font from disk
+        uint32_t loads_avoided = 0;
+
+        // Glyphs found in a fallback font after the indexed font didn't have them
+        uint32_t fallbacks_used = 0;
+
+        // Codepoints that no candidate font had a glyph for
+        uint32_t glyphs_missing = 0;
+
+        // Lookups that found no glyph, but couldn't open every candidate font to be sure
+        uint32_t lookups_failed = 0;
+
+        // Face loads served by an open face, or that had to open one from disk
+        uint32_t face_hits = 0;
+        uint32_t face_misses = 0;
+
+        // Fonts closed to stay within the face budget, or when FreeType ran out of memory
+        uint32_t face_evictions = 0;
+        uint32_t face_evictions_oom = 0;
+
+        // Most heap FreeType has held at once
+        uint32_t heap_peak = 0;
+
+        // Faces opened from a font held in memory
+        uint32_t resident_opens = 0;
+
+        // Fonts read into memory, and dropped again for a more used font or when memory ran out
+        uint32_t resident_loads = 0;
+        uint32_t resident_drops = 0;
+
+        // Most memory used by resident fonts at once
+        uint32_t resident_peak = 0;
+
+        // Times memory was released to retry a failed allocation (see releaseMemory)
+        uint32_t memory_releases = 0;
+
+        // Embedded UI faces opened, and sizes set up for them
+        uint32_t ui_face_opens = 0;
+        uint32_t ui_sizes_created = 0;
+    };
+
+    /**
+     * How often a font is used, and its file data if it's held in memory
+     */
+    struct ResidentFont {
+        uint16_t id;
+
+        // Loads through loadFace()
+        uint32_t uses;
+
+        // File size, known once the font has been opened (zero before that)
+        uint32_t size;
+
+        // Whole file, or nullptr if the font is read from disk
+        uint8_t* data;
+    };
+
+    // Fonts whose use is tracked for choosing which to hold in memory
+    static const uint32_t kMaxTrackedFonts = 32;
+
+    // Loads before a font is worth holding in memory
+    // Fonts only loaded once or twice are cheaper to read from disk as needed.
+    static const uint32_t kResidentMinUses = 4;
+
+    // Most registered fonts kept open at once, and the cache limits that follow from it
+    static const uint32_t kMaxOpenFonts = 8;
+    static const uint32_t kMaxCachedFaces = kMaxOpenFonts;
+    static const uint32_t kMaxCachedSizes = 8;
+
+    // Limits of the separate cache for the embedded UI fonts
+    // Each size hinted with the TrueType interpreter costs several KB, so only about as many
+    // as one screen uses are kept. Text drawn from the atlas doesn't need a size at all.
+    static const uint32_t kMaxUIFaces = 2;
+    static const uint32_t kMaxUISizes = 6;
+    static const uint32_t kUIGlyphCacheBudget = 8 * 1024;
+
+    // Font chosen for a recently looked up codepoint
+    struct ResolvedCodepoint {
+        uint32_t codepoint;
+        uint16_t id;
+    };
+
+    static const uint32_t kResolvedCacheSize = 16;
+
     /**
      * Load an indexed font by its registered id
      * Returns nullptr if no font is valid for the given index
      */
     FT_Face loadFace(uint32_t id);
 
+    // Result of checking a font for a glyph
+    enum GlyphCheck {
+        kGlyph_Present,
+        kGlyph_Absent,
+
+        // The font couldn't be opened, so whether it has the glyph isn't known
+        kGlyph_LoadFailed,
+    };
+
+    /**
+     * Load a font by id and check if it has a glyph for the codepoint
+     */
+    GlyphCheck checkGlyph(uint32_t id, uint32_t codepoint);
+
+    /**
+     * Check if a font is already open
+     */
+    bool isFaceOpen(uint32_t id);
+
+    /**
+     * Close the least recently used font, other than the passed face
+     * The most recently used font is also kept if keep_latest is set. Returns false
+     * if there was nothing to close.
+     */
+    bool evictFace(FTC_FaceID keep, bool keep_latest);
+
+    /**
+     * Close the least recently used fonts until within the face budget
+     * The most recently used font is always kept open.
+     */
+    void trimFaces();
+
+    /**
+     * Count a use of a font, and read it into memory if it's now one of the most used
+     * small fonts that fit in the resident budget
+     */
+    void trackUse(uint32_t id);
+
+    /**
+     * Find a tracked font, or nullptr if it isn't tracked
+     */
+    ResidentFont* findTracked(uint32_t id);
+
+    /**
+     * Read a font into memory, dropping less used resident fonts to make room
+     * Returns false if it isn't worth the memory, or couldn't be read.
+     */
+    bool makeResident(ResidentFont &font);
+
+    /**
+     * Close a resident font's face if it's open and release its file data
+     */
+    void dropResident(ResidentFont &font);
+
+    /**
+     * Release the lowest ranked resident font, other than the one backing the passed face
+     * Returns false if there was none to release.
+     */
+    bool dropLowestResident(FTC_FaceID keep);
+
+    /**
+     * Check if a cache face id is one of the embedded UI fonts
+     */
+    static bool isUIFace(FTC_FaceID face_id);
+
+    /**
+     * Open a face for the cache (FTC_Face_Requester)
+     * Registered fonts are read with fs::load_face, unless they're held in memory like
+     * the UI fonts.
+     */
+    static FT_Error requestFace(FTC_FaceID face_id, FT_Library library, FT_Pointer data, FT_Face* face);
+
+    /**
+     * FreeType memory functions, which track how much heap FreeType is using
+     */
+    static void* ftAlloc(FT_Memory memory, long size);
+    static void* ftRealloc(FT_Memory memory, long cur_size, long new_size, void* block);
+    static void ftFree(FT_Memory memory, void* block);
+
     // Codepoint lookup
     FontIndexer m_indexer;
 
     // FreeType state
     FT_Library m_ft_library;
+    FT_MemoryRec_ m_ft_memory;
+
+    // Heap currently allocated by FreeType in bytes, and how much of that is the library itself
+    uint32_t m_heap_used;
+    uint32_t m_heap_library;
+
+    // Cache of faces, sizes and glyph images
+    FTC_Manager m_cache;
+    FTC_ImageCache m_images;
+    uint32_t m_cache_budget;
+
+    // Cache for the embedded UI fonts, which loading and evicting registered fonts never touches
+    // Heap used through it is tracked separately so it doesn't count towards the other budgets.
+    FTC_Manager m_ui_cache;
+    FTC_ImageCache m_ui_images;
+    uint32_t m_ui_heap_used;
 
-    // Currently loaded font face
-    FT_Face m_face;
-    uint32_t m_active_id;
+    // Registered fonts open in the cache, from least to most recently used
+    std::vector<uint16_t> m_open_fonts;
+    uint32_t m_face_budget;
 
     // Table of registered fonts
     std::vector<std::string> m_font_table;
+
+    // Recently used fonts, some of which are held in memory
+    std::vector<ResidentFont> m_resident;
+    uint32_t m_resident_budget;
+    uint32_t m_resident_used;
+
+    // Pre-rasterised UI text
+    TextAtlas m_text_atlas;
+
+    // Direct-mapped cache of which font each recent codepoint resolved to
+    // (FontIndexer::kCodepointNotFound if every candidate font opened and had no glyph)
+    ResolvedCodepoint m_resolved[kResolvedCacheSize];
+
+    Stats m_stats;
 };
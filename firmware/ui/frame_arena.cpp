@@ -0,0 +1,92 @@
+#include "ui/frame_arena.hh"
+
+// C++
+#include <algorithm>
+#include <cstddef>
+
+// C
+#include <stdio.h>
+
+
+// Allocations are aligned as malloc would for any type
+static const uint32_t kAlignment = alignof(std::max_align_t);
+
+alignas(std::max_align_t) static uint8_t s_block[frame_arena::kSize];
+
+// Offset of the next allocation
+static uint32_t s_used = 0;
+
+static struct {
+    // Allocations made, and requests that didn't fit
+    uint32_t allocations = 0;
+    uint32_t fallbacks = 0;
+
+    // Frames that started with memory still allocated (a Scope left open)
+    uint32_t leaked_frames = 0;
+
+    // Most memory allocated at once
+    uint32_t high_water = 0;
+} s_stats;
+
+namespace frame_arena {
+
+void* alloc(uint32_t size)
+{
+    const uint32_t aligned = (size + kAlignment - 1) & ~(kAlignment - 1);
+
+    if (aligned < size || aligned > kSize - s_used) {
+        return nullptr;
+    }
+
+    void* ptr = s_block + s_used;
+    s_used += aligned;
+
+    s_stats.allocations++;
+    s_stats.high_water = std::max(s_stats.high_water, s_used);
+
+    return ptr;
+}
+
+uint32_t available()
+{
+    return kSize - s_used;
+}
+
+bool contains(const void* ptr)
+{
+    return ptr >= s_block && ptr < s_block + kSize;
+}
+
+void count_fallback()
+{
+    s_stats.fallbacks++;
+}
+
+void reset()
+{
+    if (s_used != 0) {
+        s_stats.leaked_frames++;
+    }
+
+    s_used = 0;
+}
+
+void print_stats()
+{
+    printf("Frame arena: %u allocations, %u requests that didn't fit, peak %u of %u bytes, %u frames started with memory in use\n",
+        (unsigned) s_stats.allocations,
+        (unsigned) s_stats.fallbacks,
+        (unsigned) s_stats.high_water,
+        (unsigned) kSize,
+        (unsigned) s_stats.leaked_frames);
+}
+
+Scope::Scope()
+    : m_mark(s_used) {}
+
+Scope::~Scope()
+{
+    s_used = m_mark;
+}
+
+}; // namespace frame_arena
@@ -0,0 +1,70 @@
+#pragma once
+
+// C
+#include <stdint.h>
+
+/**
+ * Fixed block of scratch memory for drawing, in place of short-lived heap allocations
+ *
+ * Text canvases, glyph span recordings and PNG decoding each need several KB for the
+ * length of one draw call, many times a second. Taking that from the heap between
+ * FreeType's long-lived allocations fragments it, so it's taken from this statically
+ * allocated block instead.
+ *
+ * Memory is handed out from the start of the block and released in reverse order by
+ * Scope, so each draw reuses the space the previous one released. Everything is also
+ * released once per frame by reset(). Requests that don't fit return nullptr: callers
+ * fall back to drawing without the memory, or to the heap.
+ */
+namespace frame_arena {
+
+// Size of the block
+// This fits a canvas for a full-width line of UI text at up to 24px.
+static const uint32_t kSize = 24 * 1024;
+
+/**
+ * Allocate memory from the arena, valid until the enclosing Scope ends
+ * Returns nullptr if there isn't enough space left.
+ */
+void* alloc(uint32_t size);
+
+/**
+ * Space left in the arena in bytes
+ */
+uint32_t available();
+
+/**
+ * Check if a pointer is memory from the arena
+ */
+bool contains(const void* ptr);
+
+/**
+ * Count a request that didn't fit and was handled another way
+ */
+void count_fallback();
+
+/**
+ * Release everything allocated from the arena
+ * This is called at the start of each frame, when no Scope should be open.
+ */
+void reset();
+
+void print_stats();
+
+/**
+ * Releases everything allocated from the arena during its lifetime when it ends
+ * Scopes must end in the reverse order they were started.
+ */
+class Scope {
+public:
+    Scope();
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    uint32_t m_mark;
+};
+
+}; // namespace frame_arena
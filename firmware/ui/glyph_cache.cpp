@@ -0,0 +1,239 @@
+#include "glyph_cache.hh"
+
+#include "st7789.h"
+#include "ui/frame_arena.hh"
+#include "util.hh"
+
+// C++
+#include <algorithm>
+
+// C
+#include <stdio.h>
+
+
+// Span positions and lengths are stored in a byte
+static_assert(DISPLAY_WIDTH <= 0xFF, "Cached span x does not fit the display width");
+
+// Bytes per row header and per span
+static const uint32_t kRowHeaderSize = 3;
+static const uint32_t kSpanSize = 3;
+
+GlyphCache::SpanWriter::SpanWriter(uint32_t limit)
+    : m_size(0),
+      m_limit(limit),
+      m_valid(limit >= kRowHeaderSize + kSpanSize) // Room for at least one span
+{
+    m_scratch_size = std::min(limit, frame_arena::available());
+    m_scratch = (uint8_t*) frame_arena::alloc(m_scratch_size);
+
+    if (m_scratch == nullptr) {
+        m_scratch_size = 0;
+    }
+}
+
+void GlyphCache::SpanWriter::addRow(int x, int y, int count, const FT_Span* spans)
+{
+    if (!m_valid || count == 0) {
+        return;
+    }
+
+    const uint32_t row_size = kRowHeaderSize + (count * kSpanSize);
+
+    if (y < 0 || y >= DISPLAY_HEIGHT || count > 0xFF || m_size + row_size > m_limit) {
+        // Can't be kept
+        invalidate();
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int span_x = x + spans[i].x;
+
+        if (span_x < 0 || span_x + spans[i].len > DISPLAY_WIDTH) {
+            invalidate();
+            return;
+        }
+    }
+
+    uint8_t* out = append(row_size);
+
+    *(out++) = y & 0xFF;
+    *(out++) = y >> 8;
+    *(out++) = count;
+
+    for (int i = 0; i < count; i++) {
+        *(out++) = x + spans[i].x;
+        *(out++) = spans[i].len;
+        *(out++) = spans[i].coverage;
+    }
+}
+
+uint8_t* GlyphCache::SpanWriter::append(uint32_t count)
+{
+    if (m_data.empty() && m_size + count > m_scratch_size) {
+        // Outgrew the scratch memory: continue on the heap
+        frame_arena::count_fallback();
+        m_data.assign(m_scratch, m_scratch + m_size);
+    }
+
+    uint8_t* out;
+
+    if (m_data.empty()) {
+        out = m_scratch + m_size;
+    } else {
+        m_data.resize(m_size + count);
+        out = m_data.data() + m_size;
+    }
+
+    m_size += count;
+
+    return out;
+}
+
+void GlyphCache::SpanWriter::invalidate()
+{
+    m_valid = false;
+    m_size = 0;
+
+    m_data.clear();
+    shrinkContainer(m_data);
+}
+
+GlyphCache::GlyphCache(uint32_t budget)
+    : m_budget(budget),
+      m_bytes_used(0) {}
+
+const GlyphCache::Entry* GlyphCache::find(const Key &key)
+{
+    for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+        if (it->key == key) {
+            m_stats.hits++;
+
+            // Move to the most recently used position
+            if (it + 1 != m_entries.end()) {
+                Entry entry = std::move(*it);
+                m_entries.erase(it);
+                m_entries.push_back(std::move(entry));
+            }
+
+            return &m_entries.back();
+        }
+    }
+
+    m_stats.misses++;
+    return nullptr;
+}
+
+bool GlyphCache::contains(const Key &key) const
+{
+    for (const Entry &entry : m_entries) {
+        if (entry.key == key) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+GlyphCache::SpanWriter GlyphCache::record() const
+{
+    const uint32_t overhead = sizeof(Entry);
+    return SpanWriter(m_budget > overhead ? m_budget - overhead : 0);
+}
+
+GlyphCache::SpanWriter GlyphCache::recordSpare() const
+{
+    const uint32_t overhead = m_bytes_used + sizeof(Entry);
+    return SpanWriter(m_budget > overhead ? m_budget - overhead : 0);
+}
+
+void GlyphCache::insert(const Key &key, const UIRect &rect, SpanWriter &writer)
+{
+    if (!writer.isValid() || writer.m_size == 0) {
+        m_stats.rejected++;
+        return;
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.rect = rect;
+    entry.spans.assign(writer.data(), writer.data() + writer.m_size);
+
+    const uint32_t size = entrySize(entry);
+
+    while (!m_entries.empty() && m_bytes_used + size > m_budget) {
+        m_bytes_used -= entrySize(m_entries.front());
+        m_entries.erase(m_entries.begin());
+        m_stats.evictions++;
+    }
+
+    m_bytes_used += size;
+    m_entries.push_back(std::move(entry));
+
+    m_stats.stored++;
+    m_stats.bytes_peak = std::max(m_stats.bytes_peak, m_bytes_used);
+}
+
+void GlyphCache::blit(const Entry &entry)
+{
+    static uint8_t px_value[2];
+    static uint8_t active_index = 0;
+
+    const uint8_t* pos = entry.spans.data();
+    const uint8_t* end = pos + entry.spans.size();
+
+    while (pos != end) {
+        const uint16_t y = pos[0] | (pos[1] << 8);
+        const uint8_t count = pos[2];
+        pos += kRowHeaderSize;
+
+        for (uint8_t i = 0; i < count; i++, pos += kSpanSize) {
+            const uint8_t x = pos[0];
+            const uint8_t len = pos[1];
+
+            st7789_set_cursor(x, y);
+
+            if (len == 1) {
+                // For tiny spans, skip DMA as it's faster to send directly
+                st7789_put_mono(pos[2]);
+
+            } else {
+                // Alternate value buffers to avoid disturbing in-progress DMA
+                active_index = !active_index;
+                px_value[active_index] = pos[2];
+
+                st7789_write_dma(&px_value[active_index], len * 3, false);
+            }
+        }
+    }
+}
+
+void GlyphCache::clear()
+{
+    m_entries.clear();
+    shrinkContainer(m_entries);
+    m_bytes_used = 0;
+}
+
+void GlyphCache::printStats()
+{
+    const uint32_t lookups = m_stats.hits + m_stats.misses;
+
+    printf("Glyph cache: %u hits, %u misses (%u%% hit rate), %u stored, %u evicted, %u not cacheable\n",
+        (unsigned) m_stats.hits,
+        (unsigned) m_stats.misses,
+        (unsigned) (lookups != 0 ? (m_stats.hits * 100) / lookups : 0),
+        (unsigned) m_stats.stored,
+        (unsigned) m_stats.evictions,
+        (unsigned) m_stats.rejected);
+
+    printf("Glyph cache memory: %u glyphs using %u bytes (budget %u, peak %u)\n",
+        (unsigned) m_entries.size(),
+        (unsigned) m_bytes_used,
+        (unsigned) m_budget,
+        (unsigned) m_stats.bytes_peak);
+}
+
+uint32_t GlyphCache::entrySize(const Entry &entry)
+{
+    return sizeof(Entry) + entry.spans.capacity();
+}
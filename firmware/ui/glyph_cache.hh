@@ -0,0 +1,192 @@
+#pragma once
+
+#include "ui/common.hh"
+
+// FreeType
+#include "ft2build.h"
+#include FT_FREETYPE_H
+
+// C++
+#include <vector>
+
+// C
+#include <stdint.h>
+
+/**
+ * Recently rendered glyphs, kept as the coverage spans written to the screen
+ *
+ * Redrawing a cached glyph is a straight copy to the display, with no font loading,
+ * size fitting or rasterising. Entries are evicted least recently used first to stay
+ * within a fixed memory budget.
+ */
+class GlyphCache {
+public:
+
+    /**
+     * Identifies a glyph rendering
+     * The same codepoint fitted to a different display box renders differently.
+     */
+    struct Key {
+        uint32_t codepoint;
+        uint16_t max_width;
+        uint16_t max_height;
+        int16_t y_offset;
+
+        inline bool operator==(const Key &other) const
+        {
+            return codepoint == other.codepoint &&
+                   max_width == other.max_width &&
+                   max_height == other.max_height &&
+                   y_offset == other.y_offset;
+        }
+    };
+
+    /**
+     * Collects spans as they are rasterised, in screen coordinates
+     *
+     * Spans are grouped in rows:
+     *
+     *   uint16     y (little endian)
+     *   uint8      span count
+     *   (per span) uint8 x, uint8 length, uint8 coverage
+     *
+     * Recording stops being usable if the data would exceed the limit, or a span lies
+     * outside what the format can store.
+     *
+     * Spans are collected in scratch memory from the frame arena, so a frame_arena::Scope
+     * must be open for as long as the writer is used. They only move to the heap if the
+     * arena doesn't have room for them.
+     */
+    class SpanWriter {
+    public:
+        SpanWriter(uint32_t limit);
+
+        /**
+         * Record a row of spans from a FreeType raster callback
+         * @param x - Screen position of span x = 0
+         */
+        void addRow(int x, int y, int count, const FT_Span* spans);
+
+        inline bool isValid() const { return m_valid; }
+
+    private:
+        friend class GlyphCache;
+
+        /**
+         * Make room for more data, returning where to write it
+         */
+        uint8_t* append(uint32_t count);
+
+        /**
+         * Stop recording and release what was collected
+         */
+        void invalidate();
+
+        inline const uint8_t* data() const
+        {
+            return m_data.empty() ? m_scratch : m_data.data();
+        }
+
+        // Arena memory, used until the recording outgrows it
+        uint8_t* m_scratch;
+        uint32_t m_scratch_size;
+
+        // Recording once it no longer fits the scratch memory
+        std::vector<uint8_t> m_data;
+
+        uint32_t m_size;
+        uint32_t m_limit;
+        bool m_valid;
+    };
+
+    struct Entry {
+        Key key;
+
+        // Screen area covered by the glyph
+        UIRect rect;
+
+        std::vector<uint8_t> spans;
+    };
+
+    struct Stats {
+        // Lookups that found a cached glyph, or didn't
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+
+        // Renderings added, and entries evicted to make room for them
+        uint32_t stored = 0;
+        uint32_t evictions = 0;
+
+        // Renderings that couldn't be kept (too large or partly off screen)
+        uint32_t rejected = 0;
+
+        // Most memory used by entries at once
+        uint32_t bytes_peak = 0;
+    };
+
+    /**
+     * @param budget - Bytes entries may use in total
+     */
+    GlyphCache(uint32_t budget);
+
+    /**
+     * Look up a rendering and mark it as most recently used
+     * Returns nullptr if it isn't cached. The entry is valid until the next insert.
+     */
+    const Entry* find(const Key &key);
+
+    /**
+     * Check if a rendering is cached, without counting a lookup
+     */
+    bool contains(const Key &key) const;
+
+    /**
+     * Start recording a rendering, limited to what could be kept
+     */
+    SpanWriter record() const;
+
+    /**
+     * Start recording a rendering, limited to space that's currently unused
+     * Inserting this never evicts another entry, and the writer is invalid if there's no room.
+     */
+    SpanWriter recordSpare() const;
+
+    /**
+     * Keep a recorded rendering, evicting older entries to make room
+     */
+    void insert(const Key &key, const UIRect &rect, SpanWriter &writer);
+
+    /**
+     * Draw a cached rendering directly to screen
+     */
+    static void blit(const Entry &entry);
+
+    /**
+     * Remove all entries
+     */
+    void clear();
+
+    /**
+     * Memory currently charged to the budget
+     */
+    inline uint32_t bytesUsed() const { return m_bytes_used; }
+
+    void printStats();
+
+private:
+
+    /**
+     * Memory charged to the budget for an entry
+     */
+    static uint32_t entrySize(const Entry &entry);
+
+private:
+
+    // Least recently used first
+    std::vector<Entry> m_entries;
+
+    uint32_t m_budget;
+    uint32_t m_bytes_used;
+
+    Stats m_stats;
+};
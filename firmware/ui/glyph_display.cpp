@@ -1,9 +1,13 @@
 #include "glyph_display.hh"
 
+#include "io_trace.hh"
 #include "unicode_db.hh"
 #include "st7789.h"
+#include "ui/frame_arena.hh"
+#include "util.hh"
 
 // FreeType
+#include <freetype/ftglyph.h>
 #include <freetype/ftoutln.h>
 #include <freetype/internal/ftobjs.h>
 
@@ -37,6 +41,26 @@ static void raster_callback_mono_direct(const int y, const int count, const FT_S
     }
 }
 
+/**
+ * Record spans for the glyph cache, rendering them directly to screen if requested
+ */
+struct RecordingTarget {
+    FT_Vector offset;
+    GlyphCache::SpanWriter* writer;
+    bool to_screen;
+};
+
+static void raster_callback_mono_record(const int y, const int count, const FT_Span* const spans, void * const user)
+{
+    RecordingTarget* target = (RecordingTarget*) user;
+
+    if (target->to_screen) {
+        raster_callback_mono_direct(y, count, spans, &target->offset);
+    }
+
+    target->writer->addRow(target->offset.x, target->offset.y - y, count, spans);
+}
+
 static void raster_callback_mono_line(const int y, const int count, const FT_Span* const spans, void * const user)
 {
     FT_Vector* offset = (FT_Vector*) user;
@@ -65,12 +89,20 @@ static void raster_callback_mono_line(const int y, const int count, const FT_Spa
 }
 
 
+// Memory for keeping recently drawn glyphs
+static const uint32_t kGlyphCacheBudget = 8 * 1024;
+
+GlyphCache GlyphDisplay::ms_cache(kGlyphCacheBudget);
+GlyphDisplay::DrawStats GlyphDisplay::ms_stats;
+
 GlyphDisplay::GlyphDisplay(FontStore& fontstore, uint16_t max_width, uint16_t max_height, int y_offset)
     : m_y_offset(y_offset),
       m_max_width(max_width),
       m_max_height(max_height),
       m_last_result(kResult_None),
-      m_fontstore(fontstore) {}
+      m_fontstore(fontstore),
+      m_strike_face(nullptr),
+      m_strike_index(0) {}
 
 void GlyphDisplay::clear()
 {
@@ -108,7 +140,10 @@ void GlyphDisplay::draw(uint32_t codepoint, bool is_valid)
         m_last_result = kResult_ControlChar;
 
     } else {
+        // Attribute font reads to the glyph when tracing I/O
+        io_trace::set_codepoint(codepoint);
         const bool didDrawGlyph = drawGlyph(codepoint);
+        io_trace::set_codepoint(io_trace::kNoCodepoint);
 
         if (didDrawGlyph) {
             m_last_result = kResult_DrewGlyph;
@@ -168,7 +203,86 @@ void GlyphDisplay::draw(uint32_t codepoint, bool is_valid)
     }
 }
 
-bool GlyphDisplay::drawGlyph(uint32_t codepoint)
+void GlyphDisplay::printStats()
+{
+    ms_cache.printStats();
+
+    printf("Glyph rendering: %u drawn through FreeType (%u bitmaps), %u outline loads, %u outlines scaled to fit\n",
+        (unsigned) ms_stats.draws,
+        (unsigned) ms_stats.bitmaps,
+        (unsigned) ms_stats.outline_loads,
+        (unsigned) ms_stats.outlines_scaled);
+
+    printf("Glyph rendering time: %u us average, %u us max\n",
+        (unsigned) (ms_stats.draws != 0 ? ms_stats.draw_time_us / ms_stats.draws : 0),
+        (unsigned) ms_stats.draw_time_max_us);
+}
+
+void GlyphDisplay::prefetch(uint32_t codepoint, bool render)
+{
+    if (is_control_char(codepoint)) {
+        // Drawn as a label only
+        return;
+    }
+
+    io_trace::set_codepoint(codepoint);
+
+    if (render) {
+        drawGlyph(codepoint, false);
+    } else {
+        m_fontstore.loadFaceByCodepoint(codepoint);
+    }
+
+    io_trace::set_codepoint(io_trace::kNoCodepoint);
+}
+
+bool GlyphDisplay::drawGlyph(uint32_t codepoint, bool to_screen)
+{
+    const GlyphCache::Key key = {codepoint, m_max_width, m_max_height, (int16_t) m_y_offset};
+
+    if (to_screen) {
+        // Redraw a recently rendered glyph without going through FreeType
+        const GlyphCache::Entry* cached = ms_cache.find(key);
+
+        if (cached != nullptr) {
+            // Blank out the previous drawing at the very last moment
+            clear();
+
+            GlyphCache::blit(*cached);
+            m_last_draw = cached->rect;
+
+            return true;
+        }
+
+    } else if (ms_cache.contains(key)) {
+        // Already prefetched
+        return true;
+    }
+
+    const uint32_t start_time = timestamp_us();
+    const bool rendered = renderGlyph(codepoint, key, to_screen);
+
+    if (rendered && to_screen) {
+        const uint32_t elapsed = timestamp_us() - start_time;
+
+        ms_stats.draws++;
+        ms_stats.draw_time_us += elapsed;
+        ms_stats.draw_time_max_us = std::max(ms_stats.draw_time_max_us, elapsed);
+    }
+
+    return rendered;
+}
+
+bool GlyphDisplay::releaseMemory(FTC_FaceID keep)
+{
+    // Spans of recently drawn glyphs are only kept to redraw them faster
+    const bool had_glyphs = ms_cache.bytesUsed() != 0;
+    ms_cache.clear();
+
+    return m_fontstore.releaseMemory(keep) || had_glyphs;
+}
+
+bool GlyphDisplay::renderGlyph(uint32_t codepoint, const GlyphCache::Key &key, bool to_screen)
 {
     FT_Face face = m_fontstore.loadFaceByCodepoint(codepoint);
     if (face == nullptr) {
@@ -180,25 +294,66 @@ bool GlyphDisplay::drawGlyph(uint32_t codepoint)
     int height = 0;
 
     const auto &slot = face->glyph;
+    const FT_UInt glyph_index = FT_Get_Char_Index(face, codepoint);
 
-    if (face->num_fixed_sizes > 0) {
-        // Bitmap font: look for the most appropriate size available
+    // Sizes belong to the cache, so they're requested through it rather than set on the face
+    FTC_ScalerRec scaler;
+    scaler.face_id = FontStore::faceId(face);
 
-        const int target_size_px = 128;
+    // Cached outline glyph, only valid until the next call into the cache
+    FT_Glyph glyph = nullptr;
+    FT_BBox bbox;
 
-        int best_index = 0;
-        int best_delta = 0xFFFF;
+    // Copy of the outline scaled to fit the screen, if it was too large
+    FT_Glyph scaled = nullptr;
 
-        for (int i = 0; i < face->num_fixed_sizes; i++) {
-            const int delta = std::abs(target_size_px - face->available_sizes[i].height);
-            if (delta < best_delta) {
-                best_index = i;
-                best_delta = delta;
+    if (face->num_fixed_sizes > 0) {
+        if (!to_screen) {
+            // Bitmaps aren't cached, so there's nothing more to prepare
+            return false;
+        }
+
+        // Bitmap font: look for the most appropriate size available
+        // This is the same for every glyph in the face, so it's only worked out once.
+        if (m_strike_face != scaler.face_id) {
+            const int target_size_px = 128;
+
+            int best_index = 0;
+            int best_delta = 0xFFFF;
+
+            for (int i = 0; i < face->num_fixed_sizes; i++) {
+                const int delta = std::abs(target_size_px - face->available_sizes[i].height);
+                if (delta < best_delta) {
+                    best_index = i;
+                    best_delta = delta;
+                }
             }
+
+            m_strike_face = scaler.face_id;
+            m_strike_index = best_index;
         }
 
-        FT_Select_Size(face, best_index);
-        error = FT_Load_Char(face, codepoint, FT_LOAD_DEFAULT | FT_LOAD_COLOR);
+        // Requesting the strike's exact pixel size selects it
+        const FT_Bitmap_Size &strike = face->available_sizes[m_strike_index];
+        scaler.width = (strike.x_ppem + 32) / 64;
+        scaler.height = (strike.y_ppem + 32) / 64;
+        scaler.pixel = 1;
+        scaler.x_res = 0;
+        scaler.y_res = 0;
+
+        // Bitmaps are loaded into the glyph slot rather than the image cache, as a
+        // single colour glyph can be larger than the whole cache budget
+        FT_Size size;
+        error = m_fontstore.lookupSize(&scaler, &size);
+
+        if (!error) {
+            error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT | FT_LOAD_COLOR);
+
+            // Colour bitmaps are decoded whole, which needs more memory than the caches leave free
+            if (error == FT_Err_Out_Of_Memory && releaseMemory(scaler.face_id)) {
+                error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT | FT_LOAD_COLOR);
+            }
+        }
 
         if (error) {
             return false;
@@ -207,88 +362,143 @@ bool GlyphDisplay::drawGlyph(uint32_t codepoint)
     } else {
         // Load an outline glyph so that it will fit on screen
 
-        // Start with a size that will allow 95% of glyphs fit comfortably on screen
-        FT_UInt point_size = 60;
+        // Size that lets 95% of glyphs fit comfortably on screen
+        const FT_UInt point_size = 60;
+
+        // Width and height in 1/64th of points
+        scaler.width = point_size * 64;
+        scaler.height = point_size * 64;
+        scaler.pixel = 0;
+        scaler.x_res = 218; // Device resolution
+        scaler.y_res = 218;
 
-        while (point_size != 0) {
-            FT_Set_Char_Size(
-                  face,
-                  0, point_size * 64, // width and height in 1/64th of points
-                  218, 218 // Device resolution
-            );
+        // Load without auto-hinting, since hinting data isn't used with FT_Outline_Render
+        // and auto-hinting can be memory intensive on complex glyphs. FT_LOAD_NO_HINTING
+        // appears to make the font metrics inaccurate so I'm not using that here.
+        const uint32_t flags = FT_LOAD_DEFAULT | FT_LOAD_COMPUTE_METRICS | FT_LOAD_NO_AUTOHINT;
+        error = m_fontstore.lookupGlyph(&scaler, flags, glyph_index, &glyph);
+        ms_stats.outline_loads++;
 
-            // Load without auto-hinting, since hinting data isn't used with FT_Outline_Render
-            // and auto-hinting can be memory intensive on complex glyphs. FT_LOAD_NO_HINTING
-            // appears to make the font metrics inaccurate so I'm not using that here.
-            const uint32_t flags = FT_LOAD_DEFAULT | FT_LOAD_COMPUTE_METRICS | FT_LOAD_NO_AUTOHINT;
-            error = FT_Load_Char(face, codepoint, flags);
+        if (error || glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+            return false;
+        }
 
-            // Get dimensions, rouded up
-            // Since we're using COMPUTE_METRICS, this should be correct regardless of the font contents
-            width = (slot->metrics.width + 32) / 64;
-            height = (slot->metrics.height + 32) / 64;
+        // Get dimensions, rouded up
+        // The grid-fitted box matches the metrics FreeType computes for the glyph slot
+        FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_GRIDFIT, &bbox);
+        width = ((bbox.xMax - bbox.xMin) + 32) / 64;
+        height = ((bbox.yMax - bbox.yMin) + 32) / 64;
 
-            if (error || width == 0 || height == 0) {
+        if (width == 0 || height == 0) {
+            return false;
+        }
+
+        if (width > m_max_width || height > m_max_height) {
+            // Too big for the screen: scale the outline down rather than loading it again
+            // at a smaller size. The cached glyph can't be modified, so this works on a copy.
+            error = FT_Glyph_Copy(glyph, &scaled);
+            if (error) {
                 return false;
             }
 
-            // Reduce font size proportionally if the glpyh won't fit on screen
-            // Worst case we should only need two passes to find a fitting size
-            if (width > m_max_width) {
-                const uint32_t new_size = (((m_max_width << 8) / width) * point_size) >> 8;
+            glyph = scaled;
+            ms_stats.outlines_scaled++;
 
-                if (new_size == point_size) {
-                    point_size--;
-                } else {
-                    point_size = new_size;
-                }
+            // Scale from the exact outline size, then correct for grid-fitting rounding
+            // the box up, which rarely needs more than one extra step
+            FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_SUBPIXELS, &bbox);
 
-            } else if (height > m_max_height) {
-                const uint32_t new_size = (((m_max_height << 8) / height) * point_size) >> 8;
+            FT_Fixed scale = std::min(FT_DivFix(m_max_width * 64, std::max(bbox.xMax - bbox.xMin, (FT_Pos) 1)),
+                                      FT_DivFix(m_max_height * 64, std::max(bbox.yMax - bbox.yMin, (FT_Pos) 1)));
 
-                if (new_size == point_size) {
-                    point_size--;
-                } else {
-                    point_size = new_size;
-                }
+            for (int attempt = 0; attempt < 4 && (width > m_max_width || height > m_max_height); attempt++) {
+                FT_Matrix matrix = {scale, 0, 0, scale};
+                FT_Outline_Transform(&((FT_OutlineGlyph) glyph)->outline, &matrix);
 
-            } else {
-                // Glyph is an acceptable size
-                break;
+                FT_Glyph_Get_CBox(glyph, FT_GLYPH_BBOX_GRIDFIT, &bbox);
+                width = ((bbox.xMax - bbox.xMin) + 32) / 64;
+                height = ((bbox.yMax - bbox.yMin) + 32) / 64;
+
+                // Shrink by the remaining overshoot next time
+                scale = std::min(FT_DivFix(m_max_width, std::max(width, 1)),
+                                 FT_DivFix(m_max_height, std::max(height, 1)));
             }
-        };
+
+            if (width == 0 || height == 0 || width > m_max_width || height > m_max_height) {
+                FT_Done_Glyph(scaled);
+                return false;
+            }
+        }
     }
 
     // Draw the glyph to screen
-    if (slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+    if (glyph != nullptr) {
 
         // Calculation offsets to center the glyph on screen
-        const int offsetY = ((slot->metrics.height - slot->metrics.horiBearingY) / 64 );
-        const int offsetX = (slot->metrics.horiBearingX / 64);
+        const int offsetY = (-bbox.yMin / 64);
+        const int offsetX = (bbox.xMin / 64);
 
         FT_Vector offset;
         offset.x = ((DISPLAY_WIDTH - width)/2) - offsetX;
         offset.y = DISPLAY_HEIGHT - (((DISPLAY_HEIGHT - height)/2)) - offsetY + m_y_offset;
 
+        // Keep the spans as they're drawn so the next visit is a straight copy
+        // Prefetched glyphs only use spare space so they don't push out anything recent.
+        // The recording is collected in frame scratch memory, released at the end of this block.
+        frame_arena::Scope scratch;
+        GlyphCache::SpanWriter writer = to_screen ? ms_cache.record() : ms_cache.recordSpare();
+
+        if (!to_screen && !writer.isValid()) {
+            // Nowhere to keep a prefetched drawing, so don't rasterise it.
+            // The face and outline are still loaded, which is most of the work saved.
+            if (scaled != nullptr) {
+                FT_Done_Glyph(scaled);
+            }
+
+            return true;
+        }
+
+        RecordingTarget target;
+        target.offset = offset;
+        target.writer = &writer;
+        target.to_screen = to_screen;
+
         FT_Raster_Params params;
         memset(&params, 0, sizeof(params));
         params.flags = FT_RASTER_FLAG_AA | FT_RASTER_FLAG_DIRECT;
-        params.gray_spans = raster_callback_mono_direct;
-        params.user = &offset;
+        params.gray_spans = raster_callback_mono_record;
+        params.user = &target;
 
         // Blank out the previous drawing at the very last moment
-        clear();
+        if (to_screen) {
+            clear();
+        }
+
+        FT_Outline_Render(m_fontstore.get_library(), &((FT_OutlineGlyph) glyph)->outline, &params);
 
-        FT_Outline_Render(m_fontstore.get_library(), &slot->outline, &params);
+        if (scaled != nullptr) {
+            FT_Done_Glyph(scaled);
+        }
 
         // Store drawn region for blanking next glyph
         // This removes the compensation for baseline and bearing added to drew exactly centred
-        m_last_draw.x = offset.x + offsetX;
-        m_last_draw.y = offset.y + offsetY - height; // flip as glyph drawing is bottom-up
-        m_last_draw.width = width;
-        m_last_draw.height = height + 1;
+        const UIRect drawn(
+            offset.x + offsetX,
+            offset.y + offsetY - height, // flip as glyph drawing is bottom-up
+            width,
+            height + 1
+        );
+
+        if (to_screen) {
+            m_last_draw = drawn;
+            ms_cache.insert(key, drawn, writer);
+
+        } else if (writer.isValid()) {
+            ms_cache.insert(key, drawn, writer);
+        }
 
     } else {
+        ms_stats.bitmaps++;
 
         // Use the built-in PNG rendering in FreeType
         //
@@ -300,7 +510,18 @@ bool GlyphDisplay::drawGlyph(uint32_t codepoint)
         //       FreeType, so it would probably need some linker trickery or a source
         //       patch to hook into the PNG scanline rendering API (png_read_row)
         //
-        FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL);
+        error = FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL);
+
+        if (error == FT_Err_Out_Of_Memory && releaseMemory(scaler.face_id)) {
+            error = FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL);
+        }
+
+        if (error) {
+            // The slot doesn't hold a usable bitmap, so leave the screen as it was
+            printf("Failed to render bitmap glyph U+%04X: 0x%02X\n", (unsigned) codepoint, error);
+            ft_glyphslot_free_bitmap(slot);
+            return false;
+        }
 
         // Blank out the previous drawing at the very last moment
         clear();
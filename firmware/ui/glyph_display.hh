@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ui/font.hh"
+#include "ui/glyph_cache.hh"
 
 /**
  * Glyph rendering with fallback for non-renderable codepoints
@@ -23,21 +24,61 @@ public:
      */
     void draw(uint32_t codepoint, bool is_valid);
 
+    /**
+     * Prepare for a codepoint likely to be drawn soon, without drawing anything
+     * This opens the font for it and, if render is set, rasterises the glyph into spare
+     * glyph cache space. Glyphs that are already cached are never evicted for this.
+     */
+    void prefetch(uint32_t codepoint, bool render);
+
     /**
      * Clear the last drawn codepoint or fallback
      */
     void clear();
 
+    /**
+     * Print statistics for the glyph cache and rendering, shared by all displays
+     */
+    static void printStats();
+
 private:
 
     /**
      * Attempt to find a font and draw a glyph
      * Returns true if the glyph was successfully drawn.
+     *
+     * @param to_screen - If false, the glyph is only rendered into spare glyph cache space
      */
-    bool drawGlyph(uint32_t codepoint);
+    bool drawGlyph(uint32_t codepoint, bool to_screen = true);
+
+    /**
+     * Load, fit and rasterise a glyph that isn't in the glyph cache
+     */
+    bool renderGlyph(uint32_t codepoint, const GlyphCache::Key &key, bool to_screen);
+
+    /**
+     * Free cached glyphs and fonts so an allocation that failed can be tried again
+     * The passed face stays open. Returns false if there was nothing left to free.
+     */
+    bool releaseMemory(FTC_FaceID keep);
 
 private:
 
+    struct DrawStats {
+        // Glyphs drawn to screen through FreeType rather than the glyph cache, and how
+        // many of those were bitmaps
+        uint32_t draws = 0;
+        uint32_t bitmaps = 0;
+
+        // Outline glyph lookups, and outlines scaled down to fit the display area
+        uint32_t outline_loads = 0;
+        uint32_t outlines_scaled = 0;
+
+        // Time for draws, from finding the font to the glyph being on screen
+        uint64_t draw_time_us = 0;
+        uint32_t draw_time_max_us = 0;
+    };
+
     enum Result {
         kResult_None,
         kResult_DrewGlyph,
@@ -60,4 +101,14 @@ private:
     UIRect m_last_fallback_draw;
 
     FontStore& m_fontstore;
+
+    // Bitmap strike chosen for the last bitmap font drawn
+    // Cache face ids identify a font even if it's closed and opened again.
+    FTC_FaceID m_strike_face;
+    int m_strike_index;
+
+    // Recently drawn glyphs, shared between displays to keep one memory budget
+    static GlyphCache ms_cache;
+
+    static DrawStats ms_stats;
 };
\ No newline at end of file
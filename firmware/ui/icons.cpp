@@ -13,6 +13,31 @@ static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t lengt
     png_ptr->io_ptr = ((uint8_t*) png_ptr->io_ptr) + length;
 }
 
+/**
+ * Allocate libpng memory from the frame arena, or the heap if it doesn't fit
+ */
+static png_voidp png_scratch_alloc(png_structp, png_alloc_size_t size)
+{
+    void* ptr = size <= UINT32_MAX ? frame_arena::alloc(size) : nullptr;
+
+    if (ptr == nullptr) {
+        frame_arena::count_fallback();
+        ptr = malloc(size);
+    }
+
+    return ptr;
+}
+
+/**
+ * Free libpng memory, leaving arena memory to be released when the image's scope ends
+ */
+static void png_scratch_free(png_structp, png_voidp ptr)
+{
+    if (!frame_arena::contains(ptr)) {
+        free(ptr);
+    }
+}
+
 PngImage::PngImage(const uint8_t* buffer)
 {
     // Check if the first 8 bytes actually look like a PNG file
@@ -23,7 +48,10 @@ PngImage::PngImage(const uint8_t* buffer)
         return;
     }
 
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_ptr = png_create_read_struct_2(
+        PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+        NULL, png_scratch_alloc, png_scratch_free
+    );
 
     if (png_ptr == NULL) {
         printf("[read_png_file] png_create_read_struct failed\n");
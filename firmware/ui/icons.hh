@@ -1,11 +1,18 @@
 #pragma once
 
+#include "ui/frame_arena.hh"
+
 #include <png.h>
 #include <pngstruct.h>
 
 #include <stdint.h>
 
 
+/**
+ * PNG being decoded row by row
+ * Memory libpng needs while decoding is taken from the frame arena where it fits, so an
+ * image must be released in the same frame it was loaded.
+ */
 class PngImage {
 public:
     PngImage(const uint8_t* buffer);
@@ -18,6 +25,10 @@ public:
         return png_ptr != nullptr;
     }
 
+private:
+    // Releases libpng's scratch memory after everything else is destroyed
+    frame_arena::Scope m_scratch;
+
 public:
     png_structp png_ptr;
     png_infop info_ptr;
@@ -3,9 +3,14 @@
 #include "filesystem.hh"
 #include "st7789.h"
 #include "ui/codepoint_view.hh"
+#include "ui/frame_arena.hh"
+#include "ui/glyph_display.hh"
 #include "ui/icons.hh"
 #include "ui/numeric_view.hh"
 #include "ui/utf8_view.hh"
+#include "util.hh"
+
+#include <algorithm>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -17,8 +22,35 @@
 #define sleep_ms(x)usleep(x * 1000);
 #endif
 
+// The budgets below are sized together with the other fixed reservations to leave room
+// for decoding a colour emoji bitmap: see "Memory use" in the README before raising any.
+
+// Heap FreeType may keep for open font faces, so switching between fonts doesn't reload them
+// This includes each open font file's read cache (kReadCacheSettings).
+// Faces are also closed if FreeType runs out of memory, but other allocations can't reclaim it.
+static const uint32_t kFaceBudget = 24 * 1024;
+
+// Heap FreeType may keep for cached glyph outlines of registered fonts (UI fonts have their own cache)
+static const uint32_t kGlyphCacheBudget = 12 * 1024;
+
+// Heap for holding the most used small fonts entirely in memory, so their glyphs load without disk reads
+// Fonts held in memory also don't need a read cache (kReadCacheSettings) while they're open.
+static const uint32_t kResidentFontBudget = 16 * 1024;
+
+// Heap for pre-rasterised UI text, filled with the glyphs drawn first at each size
+// Text that doesn't fit is rasterised as it's drawn, like text at sizes the atlas doesn't keep.
+static const uint32_t kTextAtlasBudget = 12 * 1024;
+
 // Font lookup for application
-static FontStore s_fontstore;
+static FontStore s_fontstore(kFaceBudget, kGlyphCacheBudget, kResidentFontBudget, kTextAtlasBudget);
+
+// Blocks kept for each open font file to serve FreeType's small reads
+// This is per file, so it costs over 4KB of the face budget for every face opened from disk.
+static const BlockCache::Settings kReadCacheSettings = {
+    1024,  // block_size: two SD card sectors
+    4,     // num_blocks
+    false, // read_ahead: an I/O trace used only 4 of 27 blocks read ahead, which pushed out useful ones
+};
 
 // Available views to cycle through
 // These are created at initialisation so we don't have to deal with
@@ -40,7 +72,7 @@ static void draw_startup_error(const char* msg)
 
     const uint16_t text_width = pen.compute_px_width(msg);
     pen.move_to(std::max(0, (DISPLAY_WIDTH - text_width)/2), DISPLAY_HEIGHT - 50);
-    pen.draw(msg);
+    pen.draw(msg, text_width);
 }
 
 MainUI::MainUI()
@@ -70,6 +102,8 @@ bool MainUI::load(const char* fontdir)
 
     st7789_display_on(true);
 
+    fs::set_read_cache(kReadCacheSettings);
+
     if (fs::mount()) {
         // TODO: Show message on screen
         printf("Failed to mount SD Card\n");
@@ -83,19 +117,47 @@ bool MainUI::load(const char* fontdir)
         return false;
     }
 
-    printf("\n\nLoading fonts...\n");
+    const std::string index_path = std::string(fontdir) + "/" + index_cache::kFileName;
+
+    // List font files to check against the saved index
+    // This only reads the directory, so it's fast even with hundreds of fonts.
+    const std::vector<IndexedFile> fontfiles = index_cache::list_files(fontdir);
+
+    const uint32_t start_time = timestamp_us();
+
+    bool times_changed;
+
+    if (s_fontstore.loadIndex(index_path.c_str(), fontdir, fontfiles, index_cache::kSettings, times_changed)) {
+        printf("Loaded saved font index in %u ms\n", (timestamp_us() - start_time) / 1000);
+        progress_img.update_progress(0xFF);
+
+        // Files were checked by reading them (eg. the index was built on a host and copied)
+        // Record their current times so the next start only needs to list the directory.
+        if (times_changed && s_fontstore.saveIndex(index_path.c_str(), fontdir, fontfiles)) {
+            printf("Updated file times in %s\n", index_path.c_str());
+        }
+
+    } else {
+        printf("\n\nLoading fonts...\n");
 
-    fs::walkdir(fontdir, [&](const char* fontpath, uint8_t progress) {
-        s_fontstore.registerFont(fontpath);
-        progress_img.update_progress(progress);
-    });
+        s_fontstore.registerFonts(fontfiles, [&](uint8_t progress) {
+            progress_img.update_progress(progress);
+        });
 
-    // Join adjacent ranges that use the same font
-    //
-    // This significantly reduces the memory footprint of the index, at the cost of not
-    // being able to identify missing codepoints with the index. This is fine as we can ask
-    // the associated font before rendering if it actually has a glyph.
-    s_fontstore.optimise();
+        // Join adjacent ranges that use the same font
+        //
+        // This significantly reduces the memory footprint of the index, at the cost of not
+        // being able to identify missing codepoints with the range table alone. An exact
+        // coverage index is kept within a fixed budget to answer that instead.
+        s_fontstore.optimise(index_cache::kSettings);
+
+        printf("Indexed %u fonts in %u ms\n", (unsigned) fontfiles.size(), (timestamp_us() - start_time) / 1000);
+
+        // Keep the result so the next start can skip scanning
+        if (s_fontstore.saveIndex(index_path.c_str(), fontdir, fontfiles)) {
+            printf("Saved font index to %s\n", index_path.c_str());
+        }
+    }
 
     // Show the full logo briefly before switching to the application
     sleep_ms(250);
@@ -110,7 +172,12 @@ bool MainUI::load(const char* fontdir)
 
 void MainUI::tick()
 {
+    // Scratch memory from the last frame is no longer in use
+    frame_arena::reset();
+
     m_view->tick();
+
+    s_fontstore.textAtlas().countFrame();
 }
 
 void MainUI::render()
@@ -118,6 +185,11 @@ void MainUI::render()
     m_view->render();
 }
 
+bool MainUI::prefetch()
+{
+    return m_view->prefetch();
+}
+
 void MainUI::set_low_byte(uint8_t value)
 {
     m_view->set_low_byte(value);
@@ -152,6 +224,18 @@ const std::vector<uint32_t> MainUI::get_codepoints()
     return m_view->get_codepoints();
 }
 
+void MainUI::print_stats()
+{
+    s_fontstore.printStats();
+    GlyphDisplay::printStats();
+    frame_arena::print_stats();
+    fs::print_stats();
+
+    for (size_t i = 0; i < s_num_views; i++) {
+        s_views[i]->print_stats();
+    }
+}
+
 void MainUI::goto_next_mode(uint8_t input_switches)
 {
     // Forward to the view if it has another mode to show
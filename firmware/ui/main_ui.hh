@@ -15,6 +15,8 @@ public:
     virtual void reset() = 0;
     virtual void flush_buffer() = 0;
     virtual const std::vector<uint32_t> get_codepoints() = 0;
+    virtual bool prefetch() { return false; }
+    virtual void print_stats() {}
 
     /**
      * Get the underlying data being manipulated by the input switches
@@ -69,6 +71,13 @@ public:
      */
     void render();
 
+    /**
+     * Do a small piece of speculative work while waiting for the next frame
+     * This prepares what's likely to be shown after the next input, such as the glyphs
+     * one switch away. Returns false when there's nothing left to do until input changes.
+     */
+    bool prefetch();
+
     /**
      * Update the least significant byte of the current buffer
      * This is for passing the state of input switches through to the application
@@ -109,6 +118,11 @@ public:
      */
     const std::vector<uint32_t> get_codepoints();
 
+    /**
+     * Print performance counters collected since start-up to stdout
+     */
+    void print_stats();
+
 private:
     // The currently active view mode
     UIDelegate* m_view;
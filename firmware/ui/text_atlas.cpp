@@ -0,0 +1,276 @@
+#include "ui/text_atlas.hh"
+#include "util.hh"
+
+// FreeType
+#include <freetype/ftoutln.h>
+
+// C++
+#include <algorithm>
+
+// C
+#include <stdio.h>
+#include <string.h>
+
+
+// Most spans FreeType passes in one callback that a glyph can be stored with
+// The gray rasteriser flushes well before this, so it only guards replay's stack buffer.
+static const int kMaxSpans = 32;
+
+// Spans are stored as their length and coverage in 16 bits, with the top bit set when
+// the span's x position follows, as most spans start where the previous one ended
+static const uint16_t kMaxSpanLength = 0x7F;
+static const uint16_t kSpanHasX = 0x8000;
+
+/**
+ * Glyph being recorded by TextAtlas::recordSpans
+ */
+struct RecordState {
+    std::vector<int16_t> data;
+    uint16_t calls;
+    bool failed;
+};
+
+TextAtlas::TextAtlas(uint32_t budget)
+    : m_budget(budget),
+      m_bytes_used(0) {}
+
+TextAtlas::Strip* TextAtlas::strip(FTC_FaceID face_id, uint16_t size_px, uint16_t embolden)
+{
+    for (Strip &strip : m_strips) {
+        if (strip.m_face_id == face_id && strip.m_size_px == size_px && strip.m_embolden == embolden) {
+            return &strip;
+        }
+    }
+
+    if (size_px > kMaxSizePx || m_bytes_used + sizeof(Strip) > m_budget) {
+        return nullptr;
+    }
+
+    m_strips.emplace_back();
+
+    Strip &strip = m_strips.back();
+    strip.m_face_id = face_id;
+    strip.m_size_px = size_px;
+    strip.m_embolden = embolden;
+
+    for (uint16_t &index : strip.m_index) {
+        index = Strip::kMissing;
+    }
+
+    m_bytes_used += stripSize(strip);
+
+    return &strip;
+}
+
+TextAtlas::Advances* TextAtlas::advances(FTC_FaceID face_id, uint16_t size_px)
+{
+    if (size_px > kMaxSizePx) {
+        return nullptr;
+    }
+
+    for (Advances &advances : m_advances) {
+        if (advances.m_face_id == face_id && advances.m_size_px == size_px) {
+            return &advances;
+        }
+    }
+
+    if (m_bytes_used + sizeof(Advances) > m_budget) {
+        return nullptr;
+    }
+
+    m_advances.emplace_back();
+    m_bytes_used += sizeof(Advances);
+
+    Advances &advances = m_advances.back();
+    advances.m_face_id = face_id;
+    advances.m_size_px = size_px;
+
+    for (int16_t &advance : advances.m_advance) {
+        advance = Advances::kUnknown;
+    }
+
+    return &advances;
+}
+
+bool TextAtlas::add(Strip &strip, uint8_t c, FT_Library library, const FT_Outline* outline, FT_Pos advance)
+{
+    if (!strip.canAdd(c)) {
+        return false;
+    }
+
+    uint16_t &index = strip.m_index[c - kFirstChar];
+
+    // Render into a separate buffer first, so the strip only grows if the glyph fits
+    RecordState record;
+    record.calls = 0;
+    record.failed = advance < 0 || advance > INT16_MAX;
+    record.data.push_back(advance);
+    record.data.push_back(0);
+
+    if (!record.failed) {
+        FT_Raster_Params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = FT_RASTER_FLAG_AA | FT_RASTER_FLAG_DIRECT;
+        params.gray_spans = &TextAtlas::recordSpans;
+        params.user = &record;
+
+        if (FT_Outline_Render(library, const_cast<FT_Outline*>(outline), &params) != FT_Err_Ok) {
+            record.failed = true;
+        }
+    }
+
+    const size_t needed = strip.m_data.size() + record.data.size();
+
+    if (record.failed || needed >= Strip::kNotCacheable) {
+        index = Strip::kNotCacheable;
+        return false;
+    }
+
+    // Grow by half again when full, so adding glyphs one at a time doesn't copy the whole
+    // strip for each one. Near the end of the budget, the strip only grows to fit.
+    const size_t capacity = strip.m_data.capacity();
+    size_t new_capacity = capacity;
+
+    if (needed > capacity) {
+        new_capacity = std::max(needed, capacity + (capacity / 2));
+
+        if (m_bytes_used + (new_capacity - capacity) * sizeof(int16_t) > m_budget) {
+            new_capacity = needed;
+        }
+    }
+
+    const uint32_t added_bytes = (new_capacity - capacity) * sizeof(int16_t);
+
+    if (m_bytes_used + added_bytes > m_budget) {
+        index = Strip::kNotCacheable;
+        m_stats.glyphs_rejected++;
+        return false;
+    }
+
+    record.data[1] = record.calls;
+
+    index = strip.m_data.size();
+    strip.m_data.reserve(new_capacity);
+    strip.m_data.insert(strip.m_data.end(), record.data.begin(), record.data.end());
+
+    m_bytes_used += added_bytes;
+    m_stats.glyphs_added++;
+
+    return true;
+}
+
+void TextAtlas::draw(const Strip &strip, uint8_t c, FT_SpanFunc callback, void* user)
+{
+    const int16_t* data = strip.m_data.data() + strip.m_index[c - kFirstChar];
+    const uint16_t calls = data[1];
+
+    data += 2;
+
+    FT_Span spans[kMaxSpans];
+
+    for (uint16_t call = 0; call < calls; call++) {
+        const int y = data[0];
+        const int count = data[1];
+
+        data += 2;
+
+        int16_t x = 0;
+
+        for (int i = 0; i < count; i++) {
+            const uint16_t packed = *(data++);
+
+            if (packed & kSpanHasX) {
+                x = *(data++);
+            }
+
+            spans[i].x = x;
+            spans[i].len = (packed >> 8) & kMaxSpanLength;
+            spans[i].coverage = packed & 0xFF;
+
+            x += spans[i].len;
+        }
+
+        callback(y, count, spans, user);
+    }
+
+    m_stats.glyphs_drawn++;
+}
+
+void TextAtlas::recordSpans(const int y, const int count, const FT_Span* const spans, void* const user)
+{
+    RecordState* record = (RecordState*) user;
+
+    if (record->failed) {
+        return;
+    }
+
+    if (count > kMaxSpans || y < INT16_MIN || y > INT16_MAX || record->calls == UINT16_MAX) {
+        record->failed = true;
+        return;
+    }
+
+    record->data.push_back(y);
+    record->data.push_back(count);
+
+    for (int i = 0; i < count; i++) {
+        const FT_Span &span = spans[i];
+
+        if (span.len > kMaxSpanLength) {
+            record->failed = true;
+            return;
+        }
+
+        const bool has_x = i == 0 || span.x != spans[i - 1].x + spans[i - 1].len;
+        const uint16_t packed = (has_x ? kSpanHasX : 0) | (span.len << 8) | span.coverage;
+
+        record->data.push_back((int16_t) packed);
+
+        if (has_x) {
+            record->data.push_back(span.x);
+        }
+    }
+
+    record->calls++;
+}
+
+void TextAtlas::clear()
+{
+    m_strips.clear();
+    shrinkContainer(m_strips);
+
+    m_advances.clear();
+    shrinkContainer(m_advances);
+
+    m_bytes_used = 0;
+}
+
+uint32_t TextAtlas::stripSize(const Strip &strip)
+{
+    return sizeof(Strip) + strip.m_data.capacity() * sizeof(int16_t);
+}
+
+void TextAtlas::printStats()
+{
+    printf("UI text atlas: %u sizes, %u glyphs in %u bytes (budget %u), %u glyphs drawn from the atlas, %u through FreeType, %u not added for the budget\n",
+        (unsigned) m_strips.size(),
+        (unsigned) m_stats.glyphs_added,
+        (unsigned) m_bytes_used,
+        (unsigned) m_budget,
+        (unsigned) m_stats.glyphs_drawn,
+        (unsigned) m_stats.glyphs_rendered,
+        (unsigned) m_stats.glyphs_rejected);
+
+    printf("UI text advances: %u sizes in %u bytes, %u characters measured from the table, %u by loading their glyph\n",
+        (unsigned) m_advances.size(),
+        (unsigned) (m_advances.capacity() * sizeof(Advances)),
+        (unsigned) m_stats.advances_known,
+        (unsigned) m_stats.advances_loaded);
+
+    const uint32_t frames = m_stats.frames != 0 ? m_stats.frames : 1;
+
+    printf("UI text time: %u draws over %u frames, %u us per frame drawing + %u us measuring\n",
+        (unsigned) m_stats.draws,
+        (unsigned) m_stats.frames,
+        (unsigned) (m_stats.draw_time_us / frames),
+        (unsigned) (m_stats.measure_time_us / frames));
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+// FreeType
+#include "ft2build.h"
+#include FT_CACHE_H
+#include FT_FREETYPE_H
+
+// C++
+#include <vector>
+
+// C
+#include <stdint.h>
+
+/**
+ * Pre-rasterised glyphs for UI text, kept as the spans FreeType produced for them
+ *
+ * UI text is drawn at a handful of sizes of the embedded fonts, almost entirely in
+ * printable ASCII. Each of those glyphs is rasterised once per face, size and
+ * emboldening, and text is then drawn by replaying its spans through the pen's raster
+ * callback, which blends coverage with the pen colour. The replayed spans are exactly
+ * what FreeType produced, so text looks the same as if it was rasterised every time.
+ *
+ * Glyphs are added as they're first drawn, until the memory budget is used. Anything
+ * that isn't in the atlas is drawn with FreeType as before.
+ */
+class TextAtlas {
+public:
+
+    // Range of characters kept
+    static const uint8_t kFirstChar = 0x20;
+    static const uint8_t kLastChar = 0x7E;
+
+    // Largest size kept
+    // Bigger text is rare in the UI, and its glyphs take more memory than they save time.
+    static const uint16_t kMaxSizePx = 48;
+
+    /**
+     * Glyphs for one face, size and emboldening
+     */
+    class Strip {
+    public:
+        /**
+         * Check if a character's glyph is in the strip
+         */
+        inline bool contains(uint8_t c) const
+        {
+            return c >= kFirstChar && c <= kLastChar && m_index[c - kFirstChar] < kNotCacheable;
+        }
+
+        /**
+         * Check if a character's glyph is worth trying to add
+         */
+        inline bool canAdd(uint8_t c) const
+        {
+            return c >= kFirstChar && c <= kLastChar && m_index[c - kFirstChar] == kMissing;
+        }
+
+        /**
+         * Advance of a glyph in the strip, in 26.6 pixels
+         */
+        inline FT_Pos advance(uint8_t c) const
+        {
+            return m_data[m_index[c - kFirstChar]];
+        }
+
+    private:
+        friend class TextAtlas;
+
+        // Index values for glyphs that aren't in the data
+        static const uint16_t kMissing = 0xFFFF;
+        static const uint16_t kNotCacheable = 0xFFFE;
+
+        FTC_FaceID m_face_id;
+        uint16_t m_size_px;
+        uint16_t m_embolden;
+
+        // Position of each glyph in m_data, or one of the values above
+        uint16_t m_index[kLastChar - kFirstChar + 1];
+
+        // Glyphs, each stored as:
+        //
+        //   advance (26.6 pixels)
+        //   number of span callbacks
+        //   (per callback) y, span count, then each span's length and coverage,
+        //   followed by its x position if it doesn't start where the last span ended
+        //
+        std::vector<int16_t> m_data;
+    };
+
+    /**
+     * Advances of the glyphs for one face and size
+     * Emboldening doesn't change how far the pen moves, so these are shared by all strips
+     * of the same face and size.
+     */
+    class Advances {
+    public:
+        /**
+         * Check if a character's advance is known
+         */
+        inline bool contains(uint8_t c) const
+        {
+            return c >= kFirstChar && c <= kLastChar && m_advance[c - kFirstChar] != kUnknown;
+        }
+
+        /**
+         * Advance of a character, in 26.6 pixels
+         */
+        inline FT_Pos get(uint8_t c) const
+        {
+            return m_advance[c - kFirstChar];
+        }
+
+        /**
+         * Remember the advance of a character (26.6 pixels) if it's in the range kept
+         */
+        inline void set(uint8_t c, FT_Pos advance)
+        {
+            if (c >= kFirstChar && c <= kLastChar && advance >= 0 && advance <= INT16_MAX) {
+                m_advance[c - kFirstChar] = advance;
+            }
+        }
+
+    private:
+        friend class TextAtlas;
+
+        static const int16_t kUnknown = -1;
+
+        FTC_FaceID m_face_id;
+        uint16_t m_size_px;
+
+        int16_t m_advance[kLastChar - kFirstChar + 1];
+    };
+
+    struct Stats {
+        // Glyphs drawn from the atlas, or with FreeType as they weren't in it
+        uint32_t glyphs_drawn = 0;
+        uint32_t glyphs_rendered = 0;
+
+        // Glyphs added, and glyphs that couldn't be as the budget was used
+        uint32_t glyphs_added = 0;
+        uint32_t glyphs_rejected = 0;
+
+        // Text drawn, and the time spent drawing it
+        uint32_t draws = 0;
+        uint64_t draw_time_us = 0;
+
+        // Time spent measuring text widths before drawing
+        uint64_t measure_time_us = 0;
+
+        // Characters measured or skipped using a known advance, or by loading their glyph
+        uint32_t advances_known = 0;
+        uint32_t advances_loaded = 0;
+
+        // Frames counted with countFrame()
+        uint32_t frames = 0;
+    };
+
+    /**
+     * @param budget - Bytes the atlas may use in total (zero disables it)
+     */
+    TextAtlas(uint32_t budget);
+
+    /**
+     * Get the strip for a face, size and emboldening, creating it if there's room
+     * Returns nullptr if there's no strip and no room for one, or the size isn't kept.
+     */
+    Strip* strip(FTC_FaceID face_id, uint16_t size_px, uint16_t embolden);
+
+    /**
+     * Get the advance table for a face and size, creating it if there's room
+     * Tables count towards the budget like strips. Returns nullptr if there's no table
+     * and no room for one, or the size isn't kept.
+     */
+    Advances* advances(FTC_FaceID face_id, uint16_t size_px);
+
+    /**
+     * Rasterise an outline into a strip, as the glyph for a character
+     * Returns false if there wasn't room, in which case the character isn't tried again.
+     *
+     * @param outline - Outline at the strip's size, already emboldened
+     */
+    bool add(Strip &strip, uint8_t c, FT_Library library, const FT_Outline* outline, FT_Pos advance);
+
+    /**
+     * Draw a glyph by passing its spans to a raster callback, as FT_Outline_Render would
+     */
+    void draw(const Strip &strip, uint8_t c, FT_SpanFunc callback, void* user);
+
+    /**
+     * Drop every strip and advance table, releasing their memory
+     * Glyphs are added again as they're drawn, so this is only for when memory runs out.
+     */
+    void clear();
+
+    /**
+     * Memory currently charged to the budget
+     */
+    inline uint32_t bytesUsed() const { return m_bytes_used; }
+
+    /**
+     * Count a glyph drawn with FreeType rather than the atlas
+     */
+    inline void countRendered() { m_stats.glyphs_rendered++; }
+
+    /**
+     * Add the time taken to draw a piece of text
+     */
+    inline void countDraw(uint32_t time_us)
+    {
+        m_stats.draws++;
+        m_stats.draw_time_us += time_us;
+    }
+
+    /**
+     * Count a character measured or skipped with a known advance, or by loading its glyph
+     */
+    inline void countAdvance(bool known)
+    {
+        if (known) {
+            m_stats.advances_known++;
+        } else {
+            m_stats.advances_loaded++;
+        }
+    }
+
+    /**
+     * Add the time taken to measure the width of a piece of text
+     */
+    inline void countMeasure(uint32_t time_us)
+    {
+        m_stats.measure_time_us += time_us;
+    }
+
+    /**
+     * Mark the end of a UI frame, for reporting text drawing time per frame
+     */
+    inline void countFrame() { m_stats.frames++; }
+
+    void printStats();
+
+private:
+
+    /**
+     * Memory charged to the budget for a strip
+     */
+    static uint32_t stripSize(const Strip &strip);
+
+    /**
+     * Raster callback that appends spans to the strip being added to
+     */
+    static void recordSpans(const int y, const int count, const FT_Span* const spans, void* const user);
+
+private:
+
+    std::vector<Strip> m_strips;
+    std::vector<Advances> m_advances;
+
+    uint32_t m_budget;
+    uint32_t m_bytes_used;
+
+    Stats m_stats;
+};
@@ -1,5 +1,21 @@
 #include "util.hh"
 
+#if PICO_ON_DEVICE
+#include "hardware/timer.h"
+#else
+#include <chrono>
+#endif
+
+uint32_t timestamp_us()
+{
+#if PICO_ON_DEVICE
+    return time_us_32();
+#else
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
 const char* codepoint_to_utf8(uint32_t codepoint)
 {
     static char output[5];
@@ -15,6 +15,12 @@ template<typename C> void shrinkContainer(C &container) {
     }
 }
 
+/**
+ * Get a microsecond timestamp for measuring durations
+ * This wraps around every ~71 minutes, so only use it for short intervals.
+ */
+uint32_t timestamp_us();
+
 /**
  * Encode a Unicode codepoint as UTF-8
  * 
@@ -0,0 +1,556 @@
+#!/usr/bin/env python3
+
+"""
+Replay a log of font file reads against different read caches
+
+The firmware can log every read FreeType makes from a font file (see io_trace.hh),
+tagged with the codepoint being drawn. This runs the reads from one of those logs
+through models of the block cache in block_cache.cpp with different settings, and
+through FatFs and the SD card below it, to show how each choice would have done on
+the same access pattern.
+
+The log can be a whole serial console capture from the device, or a file written by
+the host build: only lines starting with "@io" are used.
+
+SD card time is an estimate from a simple model, so it's for comparing settings
+rather than predicting real timings. FatFs keeps the last sector read from each open
+file in a buffer, and reads of whole sectors go straight to the card. Each run of
+sectors that has to come from the card costs one command, plus the time to transfer
+each sector over SPI. Files are assumed to be contiguous on the card, as seeks use
+cluster link maps and don't walk the FAT.
+
+Cache configurations are written as:
+
+  direct                    No cache: every read goes to FatFs
+  file:<size>x<blocks>      Blocks kept per open file, as in the firmware
+  shared:<size>x<blocks>    One pool of blocks for all files, kept after they close
+
+Either cache can be followed by "+ra" to read ahead on sequential misses, and by
+":fifo" to evict the oldest block loaded instead of the least recently used.
+For example: file:1024x4 (the firmware default, with read-ahead off), file:1024x4+ra
+or shared:512x16:fifo.
+"""
+
+import argparse
+import collections
+import re
+import sys
+
+
+# Must match the format in io_trace.cpp
+TRACE_PREFIX = '@io '
+NO_CODEPOINT = '-'
+
+SECTOR_SIZE = 512
+
+# Must match BlockCache in block_cache.cpp
+MIN_BLOCK_SIZE = 512
+MAX_BLOCK_SIZE = 4096
+
+# Simulated when no configuration is given: the firmware's settings (kReadCacheSettings in
+# main_ui.cpp) and some alternatives
+DEFAULT_CONFIGS = [
+    'direct',
+    'file:512x4',
+    'file:1024x4', # firmware default
+    'file:1024x4+ra',
+    'file:4096x4+ra',
+    'file:1024x8+ra',
+    'shared:1024x16+ra',
+]
+
+# SPI clock for the SD card (baud_rate in hw_config.c)
+DEFAULT_SPI_MHZ = 20
+
+# Time to send a read command and wait for the card to start sending data
+# This varies a lot between cards: measure with a real card to get useful absolute times.
+DEFAULT_COMMAND_US = 250
+
+# Per-sector overhead on top of the data: start token, CRC and gaps between blocks
+DEFAULT_SECTOR_OVERHEAD_US = 10
+
+
+class Open:
+    def __init__(self, font, size, path):
+        self.font = font
+        self.size = size
+        self.path = path
+
+
+class Read:
+    def __init__(self, font, offset, count, codepoint):
+        self.font = font
+        self.offset = offset
+        self.count = count
+        self.codepoint = codepoint
+
+
+class Close:
+    def __init__(self, font):
+        self.font = font
+
+
+def parse_trace(lines):
+    """
+    Read events from a trace, skipping any other output mixed in with it
+    """
+    events = []
+    skipped = 0
+
+    for line in lines:
+        # Serial captures can have other output running into the start of a line
+        start = line.find(TRACE_PREFIX)
+        if start == -1:
+            continue
+
+        fields = line[start + len(TRACE_PREFIX):].rstrip('\r\n').split(' ')
+
+        try:
+            if fields[0] == 'open':
+                # Paths can contain spaces
+                path = ' '.join(fields[3:])
+                events.append(Open(int(fields[1]), int(fields[2]), path))
+
+            elif fields[0] == 'read':
+                codepoint = None if fields[4] == NO_CODEPOINT else int(fields[4], 16)
+                events.append(Read(int(fields[1]), int(fields[2]), int(fields[3]), codepoint))
+
+            elif fields[0] == 'close':
+                events.append(Close(int(fields[1])))
+
+            else:
+                skipped += 1
+
+        except (IndexError, ValueError):
+            # Truncated or corrupted line
+            skipped += 1
+
+    return events, skipped
+
+
+class SdCard:
+    """
+    FatFs and the SD card below a cache, counting what reaches the card
+    """
+
+    def __init__(self, spi_mhz, command_us, sector_overhead_us):
+        self.sector_us = (SECTOR_SIZE * 8) / spi_mhz + sector_overhead_us
+        self.command_us = command_us
+
+        # Sector held in each open file's FatFs buffer
+        self.buffered = {}
+
+        # Position of each open file, to count seeks
+        self.position = {}
+
+        self.reads = 0
+        self.seeks = 0
+        self.commands = 0
+        self.sectors = 0
+        self.bytes = 0
+
+    def open(self, font):
+        self.buffered[font] = None
+        self.position[font] = 0
+
+    def close(self, font):
+        self.buffered.pop(font, None)
+        self.position.pop(font, None)
+
+    def read(self, font, offset, count):
+        """
+        Read from a file with f_lseek and f_read
+        Returns the estimated time in microseconds.
+        """
+        self.reads += 1
+        self.bytes += count
+
+        if self.position.get(font, 0) != offset:
+            self.seeks += 1
+
+        self.position[font] = offset + count
+
+        first = offset // SECTOR_SIZE
+        last = (offset + count - 1) // SECTOR_SIZE
+        buffered = self.buffered.get(font)
+
+        # Count runs of sectors that aren't in the file's buffer
+        commands = 0
+        sectors = 0
+        in_run = False
+
+        for sector in range(first, last + 1):
+            if sector == buffered:
+                in_run = False
+                continue
+
+            if not in_run:
+                commands += 1
+                in_run = True
+
+            sectors += 1
+
+        # FatFs buffers a sector when a read only uses part of it
+        if (offset + count) % SECTOR_SIZE != 0:
+            self.buffered[font] = last
+        elif offset % SECTOR_SIZE != 0 and first != last:
+            self.buffered[font] = first
+
+        self.commands += commands
+        self.sectors += sectors
+
+        return commands * self.command_us + sectors * self.sector_us
+
+    def time_us(self):
+        return self.commands * self.command_us + self.sectors * self.sector_us
+
+
+class Config:
+    """
+    Parsed cache configuration
+    """
+
+    PATTERN = re.compile(r'^(file|shared):(\d+)x(\d+)(\+ra)?(?::(lru|fifo))?$')
+
+    def __init__(self, text):
+        self.text = text
+        self.scope = 'direct'
+        self.block_size = 0
+        self.num_blocks = 0
+        self.read_ahead = False
+        self.policy = 'lru'
+
+        if text == 'direct':
+            return
+
+        match = self.PATTERN.match(text)
+        if match is None:
+            raise ValueError('Unrecognised cache configuration: %s' % text)
+
+        self.scope = match.group(1)
+        self.num_blocks = int(match.group(3))
+        self.read_ahead = match.group(4) is not None
+        self.policy = match.group(5) or 'lru'
+
+        # Same rounding as the BlockCache constructor
+        requested = min(int(match.group(2)), MAX_BLOCK_SIZE)
+        self.block_size = MIN_BLOCK_SIZE
+
+        while self.block_size * 2 <= requested:
+            self.block_size *= 2
+
+    def memory(self, open_files):
+        if self.scope == 'file':
+            return self.block_size * self.num_blocks * open_files
+
+        return self.block_size * self.num_blocks
+
+
+class BlockCache:
+    """
+    Model of BlockCache, optionally shared between files
+    """
+
+    def __init__(self, config, card):
+        self.config = config
+        self.card = card
+
+        # (font, block) -> [length, last used, read ahead and not used yet], oldest first
+        self.slots = collections.OrderedDict()
+        self.clock = 0
+        self.last_loaded = {}
+
+        self.sizes = {}
+
+        self.reads = 0
+        self.direct_reads = 0
+        self.hits = 0
+        self.misses = 0
+        self.read_ahead_blocks = 0
+        self.read_ahead_used = 0
+
+    def open(self, font, size):
+        self.sizes[font] = size
+        self.last_loaded[font] = None
+
+    def close(self, font):
+        if self.config.scope == 'file':
+            for key in [key for key in self.slots if key[0] == font]:
+                del self.slots[key]
+
+        self.last_loaded.pop(font, None)
+
+    def read(self, font, offset, count):
+        """
+        Returns the estimated card time in microseconds
+        """
+        self.reads += 1
+
+        block_size = self.config.block_size
+
+        if self.config.num_blocks == 0 or count >= block_size:
+            self.direct_reads += 1
+            return self.card.read(font, offset, count)
+
+        time = 0
+        position = offset
+        end = min(offset + count, self.sizes.get(font, offset + count))
+
+        while position < end:
+            block = position // block_size
+            slot = self.slots.get((font, block))
+
+            if slot is not None:
+                self.hits += 1
+
+                if slot[2]:
+                    self.read_ahead_used += 1
+                    slot[2] = False
+
+            else:
+                self.misses += 1
+
+                sequential = (self.config.read_ahead and self.config.num_blocks > 1 and
+                              self.last_loaded.get(font) is not None and
+                              block == self.last_loaded[font] + 1)
+
+                slot, load_time = self.load(font, block)
+                time += load_time
+
+                if slot is None:
+                    break
+
+                if sequential and (font, block + 1) not in self.slots:
+                    # Either policy evicts something older than the block just loaded
+                    next_slot, load_time = self.load(font, block + 1)
+                    time += load_time
+
+                    if next_slot is not None:
+                        next_slot[2] = True
+                        self.read_ahead_blocks += 1
+
+            self.clock += 1
+            slot[1] = self.clock
+
+            position = (block + 1) * block_size
+
+        return time
+
+    def load(self, font, block):
+        offset = block * self.config.block_size
+        size = self.sizes.get(font, 0)
+
+        if offset >= size:
+            return None, 0
+
+        if len(self.slots) >= self.config.num_blocks:
+            if self.config.policy == 'fifo':
+                victim = next(iter(self.slots))
+            else:
+                victim = min(self.slots, key=lambda key: self.slots[key][1])
+
+            del self.slots[victim]
+
+        length = min(self.config.block_size, size - offset)
+        time = self.card.read(font, offset, length)
+
+        self.clock += 1
+        slot = [length, self.clock, False]
+        self.slots[(font, block)] = slot
+        self.last_loaded[font] = block
+
+        return slot, time
+
+
+class GlyphCost:
+    def __init__(self):
+        self.loads = 0
+        self.reads = 0
+        self.seeks = 0
+        self.bytes = 0
+        self.time_us = 0
+
+
+class Result:
+    def __init__(self, config):
+        self.config = config
+        self.reads = 0
+        self.stream_seeks = 0
+        self.bytes_requested = 0
+        self.peak_open = 0
+        self.glyphs = collections.defaultdict(GlyphCost)
+        self.untagged = GlyphCost()
+        self.card = None
+        self.cache = None
+
+
+def replay(events, config, spi_mhz, command_us, sector_overhead_us):
+    result = Result(config)
+
+    card = SdCard(spi_mhz, command_us, sector_overhead_us)
+    cache = BlockCache(config, card) if config.scope != 'direct' else None
+
+    open_files = set()
+    previous_codepoint = None
+
+    for event in events:
+        if isinstance(event, Open):
+            open_files.add(event.font)
+            result.peak_open = max(result.peak_open, len(open_files))
+
+            card.open(event.font)
+            if cache is not None:
+                cache.open(event.font, event.size)
+
+        elif isinstance(event, Close):
+            open_files.discard(event.font)
+
+            card.close(event.font)
+            if cache is not None:
+                cache.close(event.font)
+
+        elif isinstance(event, Read):
+            cost = result.untagged if event.codepoint is None else result.glyphs[event.codepoint]
+
+            # Consecutive reads for the same codepoint are one glyph load
+            if event.codepoint is not None and event.codepoint != previous_codepoint:
+                cost.loads += 1
+
+            previous_codepoint = event.codepoint
+
+            result.reads += 1
+            cost.reads += 1
+
+            if event.count == 0:
+                # Seek only, which doesn't touch the file
+                result.stream_seeks += 1
+                cost.seeks += 1
+                continue
+
+            result.bytes_requested += event.count
+            cost.bytes += event.count
+
+            if cache is not None:
+                cost.time_us += cache.read(event.font, event.offset, event.count)
+            else:
+                cost.time_us += card.read(event.font, event.offset, event.count)
+
+    result.card = card
+    result.cache = cache
+
+    return result
+
+
+def print_summary(results):
+    print('%-20s %8s %8s %8s %8s %9s %9s %10s %10s' % (
+        'Cache', 'Memory', 'Hit %', 'Card rd', 'Seeks', 'Commands', 'KB read', 'SD ms', 'ms/glyph'))
+
+    for result in results:
+        config = result.config
+        card = result.card
+        cache = result.cache
+
+        lookups = (cache.hits + cache.misses) if cache is not None else 0
+        hit_rate = ('%d' % ((cache.hits * 100) // lookups)) if lookups else '-'
+
+        glyph_loads = sum(cost.loads for cost in result.glyphs.values())
+        glyph_time = sum(cost.time_us for cost in result.glyphs.values())
+        per_glyph = ('%.2f' % (glyph_time / glyph_loads / 1000)) if glyph_loads else '-'
+
+        print('%-20s %7dK %8s %8d %8d %9d %9d %10.1f %10s' % (
+            config.text,
+            config.memory(result.peak_open) // 1024,
+            hit_rate,
+            card.reads,
+            card.seeks,
+            card.commands,
+            (card.sectors * SECTOR_SIZE) // 1024,
+            card.time_us() / 1000,
+            per_glyph))
+
+
+def print_cache_details(result):
+    cache = result.cache
+    if cache is None:
+        return
+
+    print('%s: %d reads (%d direct), %d block hits, %d misses, %d read ahead (%d used)' % (
+        result.config.text,
+        cache.reads,
+        cache.direct_reads,
+        cache.hits,
+        cache.misses,
+        cache.read_ahead_blocks,
+        cache.read_ahead_used))
+
+
+def print_glyphs(result, limit):
+    glyphs = sorted(result.glyphs.items(), key=lambda item: item[1].time_us, reverse=True)
+
+    print('Most expensive glyphs with %s:' % result.config.text)
+    print('  %-10s %6s %8s %8s %10s %10s' % ('Codepoint', 'Loads', 'Reads', 'Seeks', 'Bytes', 'SD ms'))
+
+    for codepoint, cost in glyphs[:limit]:
+        print('  U+%-8X %6d %8d %8d %10d %10.1f' % (
+            codepoint, cost.loads, cost.reads, cost.seeks, cost.bytes, cost.time_us / 1000))
+
+    untagged = result.untagged
+    if untagged.reads:
+        print('  %-10s %6s %8d %8d %10d %10.1f' % (
+            '(other)', '-', untagged.reads, untagged.seeks, untagged.bytes, untagged.time_us / 1000))
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Replay a font I/O trace against different read caches')
+    parser.add_argument('trace', help='Trace file or serial log, or - for stdin')
+    parser.add_argument('--config', '-c', action='append',
+                        help='Cache configuration to simulate (repeatable, default: a range of sizes)')
+    parser.add_argument('--glyphs', type=int, default=10,
+                        help='Number of most expensive glyphs to list for the first configuration (default: %(default)s)')
+    parser.add_argument('--spi-mhz', type=float, default=DEFAULT_SPI_MHZ,
+                        help='SD card SPI clock in MHz (default: %(default)s)')
+    parser.add_argument('--command-us', type=float, default=DEFAULT_COMMAND_US,
+                        help='Time for each read command before data arrives (default: %(default)s)')
+    parser.add_argument('--sector-overhead-us', type=float, default=DEFAULT_SECTOR_OVERHEAD_US,
+                        help='Time for each sector on top of its data (default: %(default)s)')
+
+    args = parser.parse_args()
+
+    try:
+        configs = [Config(text) for text in (args.config or DEFAULT_CONFIGS)]
+    except ValueError as e:
+        parser.error(str(e))
+
+    if args.trace == '-':
+        events, skipped = parse_trace(sys.stdin)
+    else:
+        with open(args.trace, 'r', errors='replace') as f:
+            events, skipped = parse_trace(f)
+
+    reads = [event for event in events if isinstance(event, Read)]
+    fonts = set(event.font for event in events if isinstance(event, Open))
+    codepoints = set(event.codepoint for event in reads if event.codepoint is not None)
+
+    print('Trace: %d reads (%d seek only) from %d fonts for %d codepoints, %d KB requested' % (
+        len(reads),
+        sum(1 for event in reads if event.count == 0),
+        len(fonts),
+        len(codepoints),
+        sum(event.count for event in reads) // 1024))
+
+    if skipped:
+        print('Skipped %d unreadable lines' % skipped)
+
+    print()
+
+    results = [replay(events, config, args.spi_mhz, args.command_us, args.sector_overhead_us) for config in configs]
+
+    print_summary(results)
+    print()
+
+    for result in results:
+        print_cache_details(result)
+
+    if args.glyphs > 0 and results and results[0].glyphs:
+        print()
+        print_glyphs(results[0], args.glyphs)